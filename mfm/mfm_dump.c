@@ -11,6 +11,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 // #include <stdint.h>
 
 typedef unsigned char u_char;
@@ -27,7 +29,14 @@ int my_head = 3;
 
 char * out_path = "disk.img";
 
-enum { SCAN, DUMP, EXTRACT } option = EXTRACT;
+/* Emulator file, written along with the image if given */
+char * emu_path = NULL;
+
+/* For the self test */
+char * results_path = "mfm_test.txt";
+char * golden_path = NULL;
+
+enum { SCAN, DUMP, EXTRACT, TEST, GOLDEN } option = EXTRACT;
 
 int data_dump_len = 128;
 
@@ -35,9 +44,18 @@ int data_dump_len = 128;
  * The transitions file has data all the way through
  * cylinder 320, but it just causes trouble to try to
  * do anything with it.
+ * Salvage mode (-x) goes on past the limit anyway and
+ * takes whatever it can get from those tracks.
  */
 #define CYLINDER_LIMIT	305
 
+int salvage = 0;
+
+/* -a writes sectors into an existing image rather than replacing it,
+ * say to fill in a good image from a salvage run.
+ */
+int fill_in = 0;
+
 /* ------------------------------ */
 
 void tran_read_all ( char * );
@@ -45,6 +63,8 @@ void tran_read_deltas ( char *, int, int, u_short *, int * );
 void mfm_extract_image ( char * );
 void mfm_scan_marks ( u_short *, int );
 void mfm_scan_headers ( u_short *, int );
+int mfm_self_test ( char *, char * );
+void mfm_write_golden ( char *, int, int );
 
 // void mfm_decode_deltas ( int, int, u_short *, int );
 
@@ -100,7 +120,7 @@ handle_args ( int argc, char **argv )
 	argv++;
 
 	/* First argument (if any) is the input file */
-	if ( argc ) {
+	if ( argc && *argv[0] != '-' ) {
 	    tran_path = argv[0];
 	    --argc;
 	    ++argv;
@@ -151,6 +171,45 @@ handle_args ( int argc, char **argv )
 		argc--;
 		argv++;
 	    }
+	    if ( *p == 'm' ) {
+		emu_path = argv[1];
+		argc -= 2;
+		argv += 2;
+	    }
+	    if ( *p == 'x' ) {
+		option = EXTRACT;
+		salvage = 1;
+		argc--;
+		argv++;
+	    }
+	    if ( *p == 'a' ) {
+		option = EXTRACT;
+		fill_in = 1;
+		argc--;
+		argv++;
+	    }
+
+	    /* -t results -- run the self test
+	     * -g golden -- save what we find on a track (-c, -h)
+	     * -k golden -- check real tracks as part of the self test
+	     */
+	    if ( *p == 't' ) {
+		option = TEST;
+		results_path = argv[1];
+		argc -= 2;
+		argv += 2;
+	    }
+	    if ( *p == 'g' ) {
+		option = GOLDEN;
+		golden_path = argv[1];
+		argc -= 2;
+		argv += 2;
+	    }
+	    if ( *p == 'k' ) {
+		golden_path = argv[1];
+		argc -= 2;
+		argv += 2;
+	    }
 	}
 }
 
@@ -166,6 +225,9 @@ main ( int argc, char **argv )
 	return 0;
     }
 
+    if ( option == TEST )
+	return mfm_self_test ( results_path, golden_path ) ? 1 : 0;
+
     tran_read_deltas ( tran_path, my_cyl, my_head, deltas, &ndeltas );
 
     // forget about this.
@@ -177,6 +239,9 @@ main ( int argc, char **argv )
     if ( option == DUMP )
 	mfm_scan_headers ( deltas, ndeltas );
 
+    if ( option == GOLDEN )
+	mfm_write_golden ( golden_path, my_cyl, my_head );
+
     return 0;
 }
 
@@ -292,6 +357,7 @@ tran_read_deltas ( char *path, int cyl, int head, u_short *deltas, int *ndeltas
 	// printf ( "Track for %d:%d -- %d bytes\n", track_hdr.cyl, track_hdr.head, track_hdr.size );
 	read ( fd, raw_deltas, track_hdr.size );
 	unpack_deltas ( raw_deltas, track_hdr.size, deltas, ndeltas );
+	close ( fd );
 	return;
     }
 
@@ -300,7 +366,7 @@ tran_read_deltas ( char *path, int cyl, int head, u_short *deltas, int *ndeltas
     error ( "Did not find requested track" );
 }
 
-typedef void (*tfptr) ( u_short *, int  );
+typedef void (*tfptr) ( int, int, u_short *, int  );
 
 /* Loop through entire file,
  * call given function to process each track.
@@ -331,14 +397,14 @@ tran_loop_iter ( char *path, tfptr func )
 	    break;
 	if ( track_hdr.cyl == -1 &&  track_hdr.head == -1 )
 	    break;
-	if ( track_hdr.cyl > CYLINDER_LIMIT )
+	if ( track_hdr.cyl > CYLINDER_LIMIT && ! salvage )
 	    break;
 	// printf ( "Track for %d:%d -- %d bytes\n", track_hdr.cyl, track_hdr.head, track_hdr.size );
 	pos += track_hdr.size + sizeof(track_hdr) + 4;
 
 	read ( fd, raw_deltas, track_hdr.size );
 	unpack_deltas ( raw_deltas, track_hdr.size, deltas, &ndeltas );
-	(*func) ( deltas, ndeltas );
+	(*func) ( track_hdr.cyl, track_hdr.head, deltas, ndeltas );
     }
 
     close ( fd );
@@ -613,20 +679,209 @@ mfm_scan_headers ( u_short *deltas, int ndeltas )
     printf ( "final filtered bit sep time: %.3f\n", avg_bit_sep_time );
 }
 
-/* This will be used to actually extract data from the disk.
+/* -------------------------------------------------------- */
+/* Track decoder */
+
+/* Everything we know (or think we know) about the Callan format.
+ * A header is A1 FE cyl (cyl_hi<<4 | head) sector followed by
+ * a 16 bit CRC.  A data field is A1 F8 and 512 bytes of data
+ * followed by a 32 bit CRC/ECC.
+ * The CRC parameters are the ones the WD_1006 entry in David's
+ * tables uses.  The CRC is run over the entire field, including
+ * the A1 and the check bytes, so a good field yields zero.
  */
-void
-mfm_process_track ( u_short *deltas, int ndeltas )
+#define SECTOR_SIZE	512
+#define NUM_HEADS	8
+#define NUM_SECTORS	17
+
+#define HEADER_ID	0xfe
+#define DATA_ID		0xf8
+
+#define HEADER_FIELD	7
+#define DATA_FIELD	(2 + SECTOR_SIZE + 4)
+
+#define HEADER_CRC_INIT	0xffff
+#define HEADER_CRC_POLY	0x1021
+#define HEADER_CRC_BITS	16
+
+#define DATA_CRC_INIT	0xffffffff
+#define DATA_CRC_POLY	0x140a0445
+#define DATA_CRC_BITS	32
+
+/* More than enough for a track read with some overlap */
+#define MAX_TRACK_SECTORS	40
+
+/* When resyncing on damaged tracks, give up after this many marks.
+ * A good track has two per sector.
+ */
+#define MAX_TRACK_MARKS		(4 * MAX_TRACK_SECTORS)
+
+/* One of these for every sector (or piece of a sector) found.
+ * Mark positions are the delta index where the A1 mark ended,
+ * the same numbers mfm_scan_marks() prints.
+ */
+struct sector_rec {
+    int hdr_mark;	/* -1 if we found data without a header */
+    int data_mark;	/* -1 if we never found the data */
+    int hdr_time;	/* clocks from the index to each mark */
+    int data_time;
+    int cyl;
+    int head;
+    int sector;
+    int hdr_ok;
+    int data_ok;
+    u_int sum;		/* hash of the data bytes */
+    u_char data[SECTOR_SIZE];
+};
+
+struct track_rec {
+    int nmarks;		/* all A1 marks seen */
+    int nfalse;		/* marks not followed by a known ID byte */
+    int nsec;
+    struct sector_rec sec[MAX_TRACK_SECTORS];
+
+    /* If words is set, the raw MFM bits from the index on are saved
+     * there (MSB first), up to max_bits of them.  It must be zeroed.
+     */
+    u_int *words;
+    int max_bits;
+    int nbits;
+};
+
+/* Straightforward MSB first CRC.
+ */
+u_int64
+crc_bytes ( u_char *bytes, int len, u_int64 init, u_int64 poly, int bits )
+{
+    u_int64 crc;
+    u_int64 top;
+    u_int64 mask;
+    int i, j;
+
+    top = (u_int64) 1 << (bits-1);
+    mask = (top << 1) - 1;
+
+    crc = init & mask;
+    for ( i=0; i<len; i++ ) {
+	crc ^= (u_int64) bytes[i] << (bits-8);
+	for ( j=0; j<8; j++ ) {
+	    if ( crc & top )
+		crc = (crc << 1) ^ poly;
+	    else
+		crc <<= 1;
+	}
+	crc &= mask;
+    }
+
+    return crc;
+}
+
+/* FNV-1a, just to compare sector contents cheaply */
+u_int
+data_sum ( u_char *bytes, int len )
+{
+    u_int sum = 2166136261u;
+    int i;
+
+    for ( i=0; i<len; i++ ) {
+	sum ^= bytes[i];
+	sum *= 16777619;
+    }
+    return sum;
+}
+
+static struct sector_rec *
+new_sector ( struct track_rec *tp )
 {
-    // printf ( "P track - %d\n", ndeltas );
+    struct sector_rec *sp;
+
+    if ( tp->nsec >= MAX_TRACK_SECTORS )
+	return NULL;
+
+    sp = &tp->sec[tp->nsec++];
+    sp->hdr_mark = -1;
+    sp->data_mark = -1;
+    sp->hdr_time = 0;
+    sp->data_time = 0;
+    sp->cyl = -1;
+    sp->head = -1;
+    sp->sector = -1;
+    sp->hdr_ok = 0;
+    sp->data_ok = 0;
+    sp->sum = 0;
+    return sp;
+}
 
+/* Nominal time for one sector at 3600 RPM, in 200 Mhz clocks.
+ * Data more than half of this after a header is not its data
+ * (the next header mark was lost), and a sector we place by
+ * position has to be within half of this.
+ */
+#define SECTOR_CLOCKS	(PRU_HZ / 60 / NUM_SECTORS)
+
+/* Called when a complete header or data field has been collected.
+ * sp is the sector whose header we saw last, still waiting for data.
+ */
+static struct sector_rec *
+finish_field ( struct track_rec *tp, struct sector_rec *sp, u_char *bytes, int mark, int mark_time )
+{
+    u_int64 crc;
+
+    if ( bytes[1] == HEADER_ID ) {
+	sp = new_sector ( tp );
+	if ( ! sp )
+	    return NULL;
+	crc = crc_bytes ( bytes, HEADER_FIELD, HEADER_CRC_INIT, HEADER_CRC_POLY, HEADER_CRC_BITS );
+	sp->hdr_mark = mark;
+	sp->hdr_time = mark_time;
+	sp->cyl = bytes[2] | ((bytes[3]&0xf0)<<4);
+	sp->head = bytes[3] & 0xf;
+	sp->sector = bytes[4];
+	sp->hdr_ok = (crc == 0);
+	return sp;
+    }
+
+    /* Data, which belongs to the last header unless it already
+     * has some, or is too far back to be this sector's.
+     */
+    if ( ! sp || sp->data_mark != -1 || mark_time - sp->hdr_time > SECTOR_CLOCKS / 2 )
+	sp = new_sector ( tp );
+    if ( ! sp )
+	return NULL;
+
+    crc = crc_bytes ( bytes, DATA_FIELD, DATA_CRC_INIT, DATA_CRC_POLY, DATA_CRC_BITS );
+    sp->data_mark = mark;
+    sp->data_time = mark_time;
+    sp->data_ok = (crc == 0);
+    memcpy ( sp->data, &bytes[2], SECTOR_SIZE );
+    sp->sum = data_sum ( sp->data, SECTOR_SIZE );
+
+    /* No more data for this one */
+    return NULL;
+}
+
+/* This makes one pass over the deltas for a track, finding every A1 mark.
+ * The byte after the mark tells us if we have a header or a data field,
+ * and we collect and check exactly as many bytes as that field has.
+ * Anything else is a false mark and we go back to searching.
+ *
+ * With resync set (for damaged tracks) we also watch for marks while
+ * collecting a field.  A mark can't appear in good MFM data, so one
+ * showing up means the field was cut short, and we start over on the
+ * new mark rather than losing it.  We also give up on the track after
+ * MAX_TRACK_MARKS marks, so garbage can't cost us more than that,
+ * though the bits still go to the emulator track to the end.
+ */
+void
+mfm_decode_track ( u_short *deltas, int ndeltas, struct track_rec *tp, int resync )
+{
     /* These are values in units of 200 Mhz clocks.
      * The value will be 20.0 for a 10 Mhz clock.
      */
     float avg_bit_sep_time;
     float nominal_bit_sep_time;
 
-    int track_time = 0;
+    int track_time;
     float clock_time = 0.0;
     float filter_state = 0;
 
@@ -639,41 +894,30 @@ mfm_process_track ( u_short *deltas, int ndeltas )
     u_int decoded_word = 0;
     int decoded_bit_cntr = 0;
 
-#define MAX_BYTES	128
-// dump too many for the header and we miss the data mark
-// #define DUMP_COUNT	40
-// #define DUMP_COUNT	30
-#define DUMP_COUNT_HEADER	24
-// #define DUMP_COUNT_DATA		128
-    u_char bytes[MAX_BYTES];
-    int byte_count;
-
+    u_char bytes[DATA_FIELD];
+    int byte_count = 0;
+    int expect = 0;
     int mark = 0;
-    int expect;
-
-    enum { SEARCH, DUMP } state;
-    enum { HEADER, DATA } who;
+    int mark_time = 0;
 
+    struct sector_rec *sp = NULL;
+    enum { SEARCH, FIELD, DONE } state;
     int i;
-    int nsec = 0;
-    int first = 1;
-
-    int cyl;
-    int head;
-    int sector;
 
     /* ---------------- */
 
+    tp->nmarks = 0;
+    tp->nfalse = 0;
+    tp->nsec = 0;
+
     state = SEARCH;
-    who = HEADER;
-    expect = DUMP_COUNT_HEADER;
 
     nominal_bit_sep_time = PRU_HZ / CONTROLLER_HZ;
-
     avg_bit_sep_time = nominal_bit_sep_time;
-    // printf ( "Initial bit sep time: %.3f\n", avg_bit_sep_time );
 
-    // printf ( "First deltas: %d %d %d\n", deltas[0], deltas[1], deltas[2] );
+    /* The first delta is from the index */
+    track_time = ndeltas > 0 ? deltas[0] : 0;
+    tp->nbits = track_time / nominal_bit_sep_time + 0.5;
 
     for ( i=1; i< ndeltas; i++ ) {
 	track_time += deltas[i];
@@ -682,25 +926,40 @@ mfm_process_track ( u_short *deltas, int ndeltas )
 	for (bit_pos = 0; clock_time > avg_bit_sep_time / 2;
                clock_time -= avg_bit_sep_time, bit_pos++) ;
 
-	 avg_bit_sep_time = nominal_bit_sep_time + filter(clock_time, &filter_state);
+	avg_bit_sep_time = nominal_bit_sep_time + filter(clock_time, &filter_state);
 
-	 /* If the shift is bigger than the word size, then
-	  * it pushes the already accumulated bits entirely out
-	  * of the word.  This would only happen if something
-	  * out of the ordinary was going on.
-	  */
-         if (bit_pos >= sizeof(raw_word)*8) {
-            raw_word = 1;
-         } else {
-            raw_word = (raw_word << bit_pos) | 1;
-         }
+	if (bit_pos >= sizeof(raw_word)*8) {
+	    raw_word = 1;
+	} else {
+	    raw_word = (raw_word << bit_pos) | 1;
+	}
 
-         raw_bit_cntr += bit_pos;
+	if ( tp->words && bit_pos ) {
+	    tp->nbits += bit_pos;
+	    if ( tp->nbits < tp->max_bits )
+		tp->words[tp->nbits >> 5] |= 0x80000000u >> (tp->nbits & 31);
+	}
 
-	 if ( state == SEARCH ) {
-	     if ((raw_word & 0xffff) == 0x4489) {
-		mark++;
-		// printf ( "Mark (A1) %d at index %d of %d\n", mark, i, ndeltas );
+	raw_bit_cntr += bit_pos;
+
+	/* Past the mark limit we only keep the bits, for the emulator */
+	if ( state == DONE )
+	    continue;
+
+	if ( state == FIELD && resync && (raw_word & 0xffff) == 0x4489 )
+	    state = SEARCH;
+
+	if ( state == SEARCH ) {
+	    if ((raw_word & 0xffff) == 0x4489) {
+		if ( resync && tp->nmarks >= MAX_TRACK_MARKS ) {
+		    if ( ! tp->words )
+			break;
+		    state = DONE;
+		    continue;
+		}
+		tp->nmarks++;
+		mark = i;
+		mark_time = track_time;
 
 		raw_bit_cntr = 0;
 		decoded_word = 0;
@@ -709,57 +968,984 @@ mfm_process_track ( u_short *deltas, int ndeltas )
 		bytes[0] = 0xa1;
 		byte_count = 1;
 
-		state = DUMP;
+		/* We don't know how long it is until we see the ID byte */
+		expect = 2;
+		state = FIELD;
 	    }
+	    continue;
+	}
 
-	    /* PORK XXX */
-	 } else {  /* DUMP */
-	    while ( raw_bit_cntr >= 4 ) {
-               u_int tmp;
-               // If we have more than 4 only process 4 this time
-               raw_bit_cntr -= 4;
-               tmp = raw_word >> raw_bit_cntr;
-               decoded_word = (decoded_word << 2) | code_bits[tmp & 0xf];
-               decoded_bit_cntr += 2;
+	/* A dropout in the middle of a field.
+	 * The bits we wanted have been shifted out of raw_word.
+	 */
+	if ( raw_bit_cntr > sizeof(raw_word)*8 ) {
+	    state = SEARCH;
+	    continue;
+	}
 
-               // If we have a bytes worth store it
-	       // We increment by 2 bits at a time,
-	       // so this will always come out even.
-               if (decoded_bit_cntr >= 8) {
-		  bytes[byte_count++] = decoded_word & 0xff;
-		  decoded_word = 0;
-		  decoded_bit_cntr = 0;
-	       }
-	    }
-	    if ( byte_count >= expect ) {
-		if ( who == HEADER ) {
-		    cyl = bytes[2] | ((bytes[3]&0xf0)<<4);
-		    head = bytes[3] & 0xf;
-		    if ( bytes[1] != 0xfe )
-			printf ( "Funky header for CH = %d %d\n", cyl, head );
-		    sector = bytes[4];
-		    // dump_em ( "header", bytes, byte_count, 0 );
-		    who = DATA;
-		    expect = data_dump_len;
-		} else {
-		    nsec++;
-		    // dump_em ( "data  ", bytes, byte_count, 1 );
-		    who = HEADER;
-		    expect = DUMP_COUNT_HEADER;
+	while ( state == FIELD && raw_bit_cntr >= 4 ) {
+	    raw_bit_cntr -= 4;
+	    decoded_word = (decoded_word << 2) | code_bits[(raw_word >> raw_bit_cntr) & 0xf];
+	    decoded_bit_cntr += 2;
+
+	    if ( decoded_bit_cntr < 8 )
+		continue;
+
+	    bytes[byte_count++] = decoded_word & 0xff;
+	    decoded_word = 0;
+	    decoded_bit_cntr = 0;
+
+	    if ( byte_count < expect )
+		continue;
+
+	    if ( expect == 2 ) {
+		if ( bytes[1] == HEADER_ID )
+		    expect = HEADER_FIELD;
+		else if ( bytes[1] == DATA_ID )
+		    expect = DATA_FIELD;
+		else {
+		    tp->nfalse++;
+		    state = SEARCH;
 		}
-		state = SEARCH;
+		continue;
 	    }
-	 }
+
+	    sp = finish_field ( tp, sp, bytes, mark, mark_time );
+	    state = SEARCH;
+	}
+    }
+}
+
+/* -------------------------------------------------------- */
+/* Emulator file
+ *
+ * The emulator wants a file of MFM bits for every track, and the
+ * decoder recovers exactly those bits as it goes, so we can write
+ * the emulator file in the same pass that extracts the sectors.
+ *
+ * The layout follows emu_tran_file.c in David's code.  File header:
+ *   8 byte id, version, file header size, track header size,
+ *   cylinders, heads, track size in bytes, bit rate,
+ *   command line (length, string), note (length, string),
+ *   start time in ns.
+ * Then for each track a header (0x12345678, cyl, head) followed
+ * by the MFM bits packed MSB first into 32 bit words.
+ * A track header with cyl and head of -1 ends the file.
+ *
+ * Writing is done by a separate thread, fed from a small ring of
+ * track buffers.  The decoder fills a buffer in place and hands it
+ * off, so the writes overlap with decoding the following tracks.
+ */
+
+u_char emu_id[] = { 0xee, 0x4d, 0x46, 0x45, 0x0d, 0x0a, 0x1a, 0x00};
+
+#define EMU_VERSION		0x02000000
+#define EMU_TRACK_MAGIC		0x12345678
+
+/* From the WD_1006 entry, 10 Mhz for one revolution at 3600 RPM */
+#define EMU_TRACK_WORDS		5209
+#define EMU_TRACK_BYTES		(EMU_TRACK_WORDS * sizeof(u_int))
+
+struct emu_header {
+    u_char id[8];
+    u_int version;
+    u_int fh_size;
+    u_int th_size;
+    int num_cyl;
+    int num_head;
+    u_int track_bytes;
+    u_int rate;
+};
+
+struct emu_track {
+    int magic;
+    int cyl;
+    int head;
+};
+
+#define EMU_RING	4
+
+struct emu_slot {
+    struct emu_track th;
+    u_int words[EMU_TRACK_WORDS];
+};
+
+static struct emu_slot emu_ring[EMU_RING];
+static int emu_put;		/* slots handed to the writer */
+static int emu_got;		/* slots the writer is done with */
+static int emu_quit;
+
+static pthread_t emu_thread;
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_cond = PTHREAD_COND_INITIALIZER;
+
+static int emu_fd = -1;
+static int emu_max_cyl = -1;
+static int emu_max_head = -1;
+
+static void
+emu_write ( void *buf, int len )
+{
+    if ( write ( emu_fd, buf, len ) != len )
+	error ( "cannot write emulator file" );
+}
+
+static void *
+emu_writer ( void *arg )
+{
+    struct emu_slot *ep;
+
+    for ( ;; ) {
+	pthread_mutex_lock ( &emu_lock );
+	while ( emu_got == emu_put && ! emu_quit )
+	    pthread_cond_wait ( &emu_cond, &emu_lock );
+	if ( emu_got == emu_put ) {
+	    pthread_mutex_unlock ( &emu_lock );
+	    break;
+	}
+	ep = &emu_ring[emu_got % EMU_RING];
+	pthread_mutex_unlock ( &emu_lock );
+
+	emu_write ( &ep->th, sizeof(ep->th) );
+	emu_write ( ep->words, EMU_TRACK_BYTES );
+
+	pthread_mutex_lock ( &emu_lock );
+	emu_got++;
+	pthread_cond_signal ( &emu_cond );
+	pthread_mutex_unlock ( &emu_lock );
+    }
+
+    return NULL;
+}
+
+#define EMU_CMDLINE	"mfm_dump"
+#define EMU_NOTE	"Callan Rodime 204"
+
+static struct emu_header emu_hdr;
+
+static void
+emu_string ( char *str )
+{
+    u_int len;
+
+    len = strlen ( str ) + 1;
+    emu_write ( &len, sizeof(len) );
+    emu_write ( str, len );
+}
+
+/* The cylinder and head counts get filled in by emu_close()
+ */
+void
+emu_open ( char *path )
+{
+    u_int start_ns = 0;
+
+    emu_fd = open ( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( emu_fd < 0 )
+	error ( "cannot open emulator file" );
+
+    memcpy ( emu_hdr.id, emu_id, sizeof(emu_hdr.id) );
+    emu_hdr.version = EMU_VERSION;
+    emu_hdr.fh_size = sizeof(emu_hdr) +
+	sizeof(u_int) + sizeof(EMU_CMDLINE) +
+	sizeof(u_int) + sizeof(EMU_NOTE) +
+	sizeof(start_ns);
+    emu_hdr.th_size = sizeof(struct emu_track);
+    emu_hdr.track_bytes = EMU_TRACK_BYTES;
+    emu_hdr.rate = CONTROLLER_HZ;
+
+    emu_write ( &emu_hdr, sizeof(emu_hdr) );
+    emu_string ( EMU_CMDLINE );
+    emu_string ( EMU_NOTE );
+    emu_write ( &start_ns, sizeof(start_ns) );
+
+    if ( pthread_create ( &emu_thread, NULL, emu_writer, NULL ) )
+	error ( "cannot start emulator writer" );
+}
+
+/* Wait for a free slot.  The decoder puts the track bits right into it.
+ */
+u_int *
+emu_get_words ( void )
+{
+    u_int *words;
+
+    pthread_mutex_lock ( &emu_lock );
+    while ( emu_put - emu_got >= EMU_RING )
+	pthread_cond_wait ( &emu_cond, &emu_lock );
+    words = emu_ring[emu_put % EMU_RING].words;
+    pthread_mutex_unlock ( &emu_lock );
+
+    memset ( words, 0, EMU_TRACK_BYTES );
+    return words;
+}
+
+void
+emu_put_track ( int cyl, int head )
+{
+    struct emu_slot *ep;
+
+    if ( cyl > emu_max_cyl )
+	emu_max_cyl = cyl;
+    if ( head > emu_max_head )
+	emu_max_head = head;
+
+    pthread_mutex_lock ( &emu_lock );
+    ep = &emu_ring[emu_put % EMU_RING];
+    ep->th.magic = EMU_TRACK_MAGIC;
+    ep->th.cyl = cyl;
+    ep->th.head = head;
+    emu_put++;
+    pthread_cond_signal ( &emu_cond );
+    pthread_mutex_unlock ( &emu_lock );
+}
+
+void
+emu_close ( void )
+{
+    struct emu_track th;
+    off_t pos;
+
+    pthread_mutex_lock ( &emu_lock );
+    emu_quit = 1;
+    pthread_cond_signal ( &emu_cond );
+    pthread_mutex_unlock ( &emu_lock );
+    pthread_join ( emu_thread, NULL );
+
+    th.magic = EMU_TRACK_MAGIC;
+    th.cyl = -1;
+    th.head = -1;
+    emu_write ( &th, sizeof(th) );
+    pos = lseek ( emu_fd, 0, SEEK_CUR );
+
+    /* Now we know how big things are */
+    emu_hdr.num_cyl = emu_max_cyl + 1;
+    emu_hdr.num_head = emu_max_head + 1;
+    if ( pwrite ( emu_fd, &emu_hdr, sizeof(emu_hdr), 0 ) != sizeof(emu_hdr) )
+	error ( "cannot write emulator file" );
+
+    close ( emu_fd );
+    printf ( "Emulator file: %d cylinders, %d heads, %ld bytes\n",
+	emu_hdr.num_cyl, emu_hdr.num_head, (long) pos );
+}
+
+/* -------------------------------------------------------- */
+/* Extraction */
+
+static struct track_rec cur_track;
+
+int image_fd = -1;
+
+/* Statistics for the whole run */
+int num_tracks;
+int num_written;
+int num_salvaged;
+
+/* Where each sector sits on the track (clocks from the index),
+ * averaged over every good header we have seen so far.
+ * Salvage uses this to place sectors whose header is damaged
+ * or missing entirely.  It doesn't care about interleave.
+ */
+static double sec_hdr_time[NUM_SECTORS];
+static double sec_data_time[NUM_SECTORS];
+static int sec_count[NUM_SECTORS];
+
+static void
+learn_position ( struct sector_rec *sp )
+{
+    int s = sp->sector;
+
+    sec_count[s]++;
+    sec_hdr_time[s] += (sp->hdr_time - sec_hdr_time[s]) / sec_count[s];
+    sec_data_time[s] += (sp->data_time - sec_data_time[s]) / sec_count[s];
+}
+
+/* Returns the sector number, or -1 if we can't tell.
+ */
+static int
+infer_sector ( struct sector_rec *sp )
+{
+    double *times;
+    double t, d;
+    double best_d;
+    int best;
+    int s;
+
+    if ( sp->hdr_mark != -1 ) {
+	t = sp->hdr_time;
+	times = sec_hdr_time;
+    } else {
+	t = sp->data_time;
+	times = sec_data_time;
+    }
+
+    best = -1;
+    best_d = SECTOR_CLOCKS / 2;
+    for ( s=0; s<NUM_SECTORS; s++ ) {
+	if ( ! sec_count[s] )
+	    continue;
+	d = t - times[s];
+	if ( d < 0 )
+	    d = -d;
+	if ( d < best_d ) {
+	    best_d = d;
+	    best = s;
+	}
+    }
+
+    return best;
+}
+
+static void
+write_sector ( int cyl, int head, int sector, u_char *data )
+{
+    off_t block;
+
+    if ( image_fd < 0 )
+	return;
+
+    block = ((off_t) cyl * NUM_HEADS + head) * NUM_SECTORS + sector;
+    if ( pwrite ( image_fd, data, SECTOR_SIZE, block * SECTOR_SIZE ) != SECTOR_SIZE )
+	error ( "cannot write image" );
+    num_written++;
+}
+
+/* Decode a track and put the good sectors into the image.
+ * Past CYLINDER_LIMIT (salvage) we resync on every mark, and take any
+ * data that passes the CRC, even when the header is bad or missing.
+ * For those, cyl and head come from the track record and the sector
+ * comes from where it is on the track.
+ */
+void
+mfm_process_track ( int cyl, int head, u_short *deltas, int ndeltas )
+{
+    struct track_rec *tp = &cur_track;
+    struct sector_rec *sp;
+    char done[NUM_SECTORS];
+    int damaged;
+    int ngood = 0;
+    int nsalv = 0;
+    int i, s;
+
+    damaged = cyl > CYLINDER_LIMIT;
+
+    if ( emu_path ) {
+	tp->words = emu_get_words ();
+	tp->max_bits = EMU_TRACK_WORDS * 32;
+    }
+
+    mfm_decode_track ( deltas, ndeltas, tp, damaged );
+    num_tracks++;
+
+    if ( emu_path )
+	emu_put_track ( cyl, head );
+
+    memset ( done, 0, sizeof(done) );
+
+    /* Sectors that are just fine.
+     * The track may be read with some overlap, so take
+     * the first good copy we see.
+     */
+    for ( i=0; i<tp->nsec; i++ ) {
+	sp = &tp->sec[i];
+	if ( ! sp->hdr_ok || ! sp->data_ok )
+	    continue;
+	if ( sp->cyl != cyl || sp->head != head || sp->sector >= NUM_SECTORS ) {
+	    printf ( "CH = %4d %d -- found header for %d %d %d\n", cyl, head,
+		sp->cyl, sp->head, sp->sector );
+	    continue;
+	}
+	if ( done[sp->sector] )
+	    continue;
+	learn_position ( sp );
+	write_sector ( cyl, head, sp->sector, sp->data );
+	done[sp->sector] = 1;
+	ngood++;
+    }
+
+    if ( ! damaged ) {
+	printf ( "CH = %4d %d -- %d sectors (%d good)\n", cyl, head, tp->nsec, ngood );
+	return;
     }
 
-    // printf ( "final filtered bit sep time: %.3f\n", avg_bit_sep_time );
-    printf ( "CH = %4d %d -- %d sectors\n", cyl, head, nsec );
+    /* Good data behind a bad (or lost) header */
+    for ( i=0; i<tp->nsec; i++ ) {
+	sp = &tp->sec[i];
+	if ( sp->hdr_ok || ! sp->data_ok )
+	    continue;
+	s = infer_sector ( sp );
+	if ( s < 0 || done[s] )
+	    continue;
+	write_sector ( cyl, head, s, sp->data );
+	done[s] = 1;
+	nsalv++;
+    }
+
+    num_salvaged += nsalv;
+    printf ( "CH = %4d %d -- %d sectors (%d good, %d salvaged, %d marks)\n",
+	cyl, head, tp->nsec, ngood, nsalv, tp->nmarks );
 }
 
 void
 mfm_extract_image ( char *path )
 {
+    image_fd = open ( out_path, O_WRONLY | O_CREAT | (fill_in ? 0 : O_TRUNC), 0644 );
+    if ( image_fd < 0 )
+	error ( "cannot open output image" );
+
+    if ( emu_path )
+	emu_open ( emu_path );
+
     tran_loop_iter ( path, mfm_process_track );
+
+    close ( image_fd );
+    if ( emu_path )
+	emu_close ();
+
+    printf ( "%d tracks, %d sectors written to %s", num_tracks, num_written, out_path );
+    if ( salvage )
+	printf ( " (%d salvaged)", num_salvaged );
+    printf ( "\n" );
+}
+
+/* -------------------------------------------------------- */
+/* Self test
+ *
+ * This checks the track decoder against a corpus of track records
+ * where we know what the answer should be.  Most of them are
+ * synthetic, built here by MFM encoding sectors we make up, and
+ * some have flaws deliberately put in.  Real tracks can be added
+ * by writing a golden file (-g) from a track we trust, then
+ * checking against it later (-k).
+ * Each case is also timed, and the results (pass/fail and
+ * decode throughput) go to a file so that speed can be tracked
+ * along with correctness.
+ */
+
+#define SYNTH_CELL	20.0		/* 200 Mhz clocks per bit cell */
+#define SYNTH_MAX_BITS	200000
+
+static u_char synth_bits[SYNTH_MAX_BITS];
+static int synth_nbits;
+static int synth_prev;
+
+static int synth_marks[2*MAX_TRACK_SECTORS];
+static int synth_nmarks;
+
+static u_int synth_seed;
+
+struct synth_case {
+    char *name;
+    int cyl;
+    int head;
+    int jitter;		/* +/- clocks of noise on each delta */
+    float cell;		/* clocks per bit cell (spindle speed) */
+    int bad_data;	/* sector with a corrupted data field */
+    int bad_header;	/* sector with a corrupted header */
+    int no_data_mark;	/* sector whose data mark is lost */
+    int no_hdr_mark;	/* sector whose header mark is lost */
+    int short_data;	/* sector whose data field is cut off by the next mark */
+    int resync;		/* decode as a damaged track */
+};
+
+/* -1 means no such flaw */
+struct synth_case synth_cases[] = {
+    { "clean",		180, 3, 0, SYNTH_CELL, -1, -1, -1, -1, -1, 0 },
+    { "jitter",		180, 3, 3, SYNTH_CELL, -1, -1, -1, -1, -1, 0 },
+    { "slow",		 17, 0, 1, 20.4, -1, -1, -1, -1, -1, 0 },
+    { "fast",		 17, 5, 1, 19.6, -1, -1, -1, -1, -1, 0 },
+    { "high_cyl",	300, 7, 2, SYNTH_CELL, -1, -1, -1, -1, -1, 0 },
+    { "bad_data",	 42, 1, 2, SYNTH_CELL,  5, -1, -1, -1, -1, 0 },
+    { "bad_header",	 42, 2, 2, SYNTH_CELL, -1,  9, -1, -1, -1, 0 },
+    { "lost_mark",	 99, 4, 2, SYNTH_CELL, -1, -1,  3, -1, -1, 0 },
+    { "lost_two",	 99, 5, 2, SYNTH_CELL, -1, -1,  7,  8, -1, 0 },
+    { "salvage",	310, 6, 3, SYNTH_CELL,  2,  4, -1, -1, 11, 1 },
+};
+
+#define NUM_SYNTH	(sizeof(synth_cases) / sizeof(synth_cases[0]))
+
+static int
+synth_rand ( int range )
+{
+    synth_seed = synth_seed * 1103515245 + 12345;
+    return (synth_seed >> 16) % (2*range+1) - range;
+}
+
+static void
+synth_bit ( int bit )
+{
+    if ( synth_nbits >= SYNTH_MAX_BITS )
+	error ( "synthetic track too long" );
+    synth_bits[synth_nbits++] = bit;
+}
+
+/* Normal MFM encoding: a clock bit is written only between two zeros */
+static void
+synth_byte ( int val )
+{
+    int i;
+    int d;
+
+    for ( i=7; i>=0; i-- ) {
+	d = (val >> i) & 1;
+	synth_bit ( ! synth_prev && ! d );
+	synth_bit ( d );
+	synth_prev = d;
+    }
+}
+
+static void
+synth_fill ( int val, int count )
+{
+    while ( count-- )
+	synth_byte ( val );
+}
+
+/* A1 with the missing clock, i.e. 0x4489 */
+static void
+synth_mark ( void )
+{
+    int i;
+
+    for ( i=15; i>=0; i-- )
+	synth_bit ( (0x4489 >> i) & 1 );
+    synth_prev = 1;
+
+    synth_marks[synth_nmarks++] = synth_nbits - 1;
+}
+
+static void
+synth_field ( u_char *bytes, int len )
+{
+    int i;
+
+    /* skip the A1, which was written as the mark */
+    for ( i=1; i<len; i++ )
+	synth_byte ( bytes[i] );
+}
+
+static void
+synth_crc ( u_char *bytes, int len, u_int64 init, u_int64 poly, int bits )
+{
+    u_int64 crc;
+    int i;
+
+    crc = crc_bytes ( bytes, len, init, poly, bits );
+    for ( i=0; i<bits/8; i++ )
+	bytes[len+i] = crc >> (bits - 8*(i+1));
+}
+
+/* Build the MFM bits for a whole track, and fill in what the
+ * decoder ought to find.  Mark positions are bit numbers here,
+ * and get converted to delta indices by synth_deltas().
+ */
+static void
+synth_track ( struct synth_case *cp, struct track_rec *ep )
+{
+    u_char hdr[HEADER_FIELD];
+    u_char data[DATA_FIELD];
+    struct sector_rec *sp;
+    int s, i;
+
+    synth_nbits = 0;
+    synth_prev = 0;
+    synth_nmarks = 0;
+
+    ep->nmarks = 0;
+    ep->nfalse = 0;
+    ep->nsec = 0;
+
+    /* The decoder wants a transition to start from */
+    synth_bit ( 1 );
+    synth_prev = 0;
+    synth_fill ( 0x4e, 20 );
+
+    for ( s=0; s<NUM_SECTORS; s++ ) {
+	hdr[0] = 0xa1;
+	hdr[1] = HEADER_ID;
+	hdr[2] = cp->cyl & 0xff;
+	hdr[3] = ((cp->cyl >> 4) & 0xf0) | cp->head;
+	hdr[4] = s;
+	synth_crc ( hdr, HEADER_FIELD-2, HEADER_CRC_INIT, HEADER_CRC_POLY, HEADER_CRC_BITS );
+	if ( s == cp->bad_header )
+	    hdr[4] ^= 0x40;
+
+	data[0] = 0xa1;
+	data[1] = DATA_ID;
+	for ( i=0; i<SECTOR_SIZE; i++ )
+	    data[2+i] = (i < 64) ? 0 : (i*7 + s*31 + cp->head*13 + cp->cyl);
+	synth_crc ( data, DATA_FIELD-4, DATA_CRC_INIT, DATA_CRC_POLY, DATA_CRC_BITS );
+	if ( s == cp->bad_data )
+	    data[100] ^= 0x10;
+
+	sp = new_sector ( ep );
+	synth_fill ( 0x4e, 15 );
+	synth_fill ( 0x00, 12 );
+	if ( s == cp->no_hdr_mark ) {
+	    /* the data that follows is all we find of this one */
+	    synth_byte ( 0xa1 );
+	} else {
+	    sp->cyl = hdr[2] | ((hdr[3]&0xf0)<<4);
+	    sp->head = hdr[3] & 0xf;
+	    sp->sector = hdr[4];
+	    sp->hdr_ok = crc_bytes ( hdr, HEADER_FIELD, HEADER_CRC_INIT, HEADER_CRC_POLY, HEADER_CRC_BITS ) == 0;
+	    synth_mark ();
+	    ep->nmarks++;
+	    sp->hdr_mark = synth_nmarks - 1;
+	}
+	synth_field ( hdr, HEADER_FIELD );
+
+	synth_fill ( 0x4e, 5 );
+	synth_fill ( 0x00, 12 );
+	if ( s == cp->no_data_mark ) {
+	    /* an ordinary A1, with its clock bit */
+	    synth_byte ( 0xa1 );
+	} else if ( s == cp->short_data ) {
+	    /* a write splice, the next sector starts right away */
+	    synth_mark ();
+	    ep->nmarks++;
+	    synth_field ( data, 100 );
+	    continue;
+	} else {
+	    synth_mark ();
+	    ep->nmarks++;
+	    sp->data_mark = synth_nmarks - 1;
+	    sp->data_ok = crc_bytes ( data, DATA_FIELD, DATA_CRC_INIT, DATA_CRC_POLY, DATA_CRC_BITS ) == 0;
+	    memcpy ( sp->data, &data[2], SECTOR_SIZE );
+	    sp->sum = data_sum ( sp->data, SECTOR_SIZE );
+	}
+	synth_field ( data, DATA_FIELD );
+	synth_fill ( 0x00, 3 );
+    }
+
+    synth_fill ( 0x4e, 200 );
+}
+
+/* Turn the bits into deltas the way the emulator would have
+ * recorded them, and the mark bit numbers into delta indices.
+ */
+static void
+synth_deltas ( struct synth_case *cp, struct track_rec *ep, u_short *deltas, int *ndeltas )
+{
+    int marks[2*MAX_TRACK_SECTORS];
+    int last = 0;
+    int now;
+    int n = 0;
+    int m = 0;
+    int i;
+
+    synth_seed = cp->cyl * NUM_HEADS + cp->head;
+
+    for ( i=0; i<synth_nbits; i++ ) {
+	if ( ! synth_bits[i] )
+	    continue;
+	/* Jitter moves each transition, it does not accumulate */
+	now = (int) (i * cp->cell + 0.5) + synth_rand ( cp->jitter );
+	if ( n >= DELTA_SIZE )
+	    error ( "Too many deltas" );
+	/* The first delta is from the index pulse */
+	if ( n == 0 )
+	    deltas[n] = 100;
+	else
+	    deltas[n] = now - last;
+	last = now;
+	if ( m < synth_nmarks && synth_marks[m] == i )
+	    marks[m++] = n;
+	n++;
+    }
+    *ndeltas = n;
+
+    for ( i=0; i<ep->nsec; i++ ) {
+	if ( ep->sec[i].hdr_mark != -1 )
+	    ep->sec[i].hdr_mark = marks[ep->sec[i].hdr_mark];
+	if ( ep->sec[i].data_mark != -1 )
+	    ep->sec[i].data_mark = marks[ep->sec[i].data_mark];
+    }
+}
+
+/* Returns the number of differences, and says what they are */
+static int
+track_compare ( char *name, struct track_rec *ep, struct track_rec *tp )
+{
+    struct sector_rec *es, *ts;
+    int bad = 0;
+    int i;
+
+    if ( ep->nsec != tp->nsec ) {
+	printf ( "%s: expected %d sectors, found %d\n", name, ep->nsec, tp->nsec );
+	return 1;
+    }
+
+    for ( i=0; i<ep->nsec; i++ ) {
+	es = &ep->sec[i];
+	ts = &tp->sec[i];
+	if ( es->hdr_mark != ts->hdr_mark || es->data_mark != ts->data_mark ) {
+	    printf ( "%s: sector %d marks %d %d, expected %d %d\n", name, i,
+		ts->hdr_mark, ts->data_mark, es->hdr_mark, es->data_mark );
+	    bad++;
+	}
+	if ( es->cyl != ts->cyl || es->head != ts->head || es->sector != ts->sector ) {
+	    printf ( "%s: sector %d CHS %d %d %d, expected %d %d %d\n", name, i,
+		ts->cyl, ts->head, ts->sector, es->cyl, es->head, es->sector );
+	    bad++;
+	}
+	if ( es->hdr_ok != ts->hdr_ok || es->data_ok != ts->data_ok ) {
+	    printf ( "%s: sector %d CRC ok %d %d, expected %d %d\n", name, i,
+		ts->hdr_ok, ts->data_ok, es->hdr_ok, es->data_ok );
+	    bad++;
+	}
+	if ( es->sum != ts->sum ) {
+	    printf ( "%s: sector %d data %08x, expected %08x\n", name, i, ts->sum, es->sum );
+	    bad++;
+	}
+    }
+
+    return bad;
+}
+
+static double
+time_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+/* Decode a track, check it, then decode it over and over
+ * for a while to see how fast we are.
+ */
+static int
+test_one ( FILE *rf, char *name, struct track_rec *ep, int resync )
+{
+    static struct track_rec got;
+    double start, elapsed;
+    int bad;
+    int reps;
+
+    mfm_decode_track ( deltas, ndeltas, &got, resync );
+    bad = track_compare ( name, ep, &got );
+
+    reps = 0;
+    start = time_now ();
+    do {
+	mfm_decode_track ( deltas, ndeltas, &got, resync );
+	reps++;
+	elapsed = time_now () - start;
+    } while ( elapsed < 0.05 );
+
+    fprintf ( rf, "%-16s %s %6d deltas %3d sectors %8.1f us/track %7.2f Mdeltas/s\n",
+	name, bad ? "FAIL" : "ok  ", ndeltas, got.nsec,
+	elapsed * 1.0e6 / reps, (double) ndeltas * reps / elapsed / 1.0e6 );
+    printf ( "%-16s %s\n", name, bad ? "FAIL" : "ok" );
+
+    return bad;
+}
+
+/* Golden files hold what we found on real tracks, one line
+ * per sector in the same terms as struct sector_rec:
+ *
+ *  track <cyl> <head>
+ *  <hdr_mark> <data_mark> <cyl> <head> <sector> <hdr_ok> <data_ok> <sum>
+ *  end
+ */
+void
+mfm_write_golden ( char *gpath, int cyl, int head )
+{
+    struct track_rec *tp = &cur_track;
+    struct sector_rec *sp;
+    FILE *gf;
+    int i;
+
+    gf = fopen ( gpath, "a" );
+    if ( ! gf )
+	error ( "cannot open golden file" );
+
+    mfm_decode_track ( deltas, ndeltas, tp, cyl > CYLINDER_LIMIT );
+
+    fprintf ( gf, "track %d %d\n", cyl, head );
+    for ( i=0; i<tp->nsec; i++ ) {
+	sp = &tp->sec[i];
+	fprintf ( gf, "%d %d %d %d %d %d %d %08x\n", sp->hdr_mark, sp->data_mark,
+	    sp->cyl, sp->head, sp->sector, sp->hdr_ok, sp->data_ok, sp->sum );
+    }
+    fprintf ( gf, "end\n" );
+
+    fclose ( gf );
+    printf ( "Golden record for %d:%d -- %d sectors\n", cyl, head, tp->nsec );
+}
+
+static int
+test_golden ( FILE *rf, char *gpath )
+{
+    static struct track_rec exp;
+    struct sector_rec *sp;
+    char line[128];
+    char name[64];
+    FILE *gf;
+    int cyl, head;
+    int bad = 0;
+
+    gf = fopen ( gpath, "r" );
+    if ( ! gf )
+	error ( "cannot open golden file" );
+
+    while ( fgets ( line, sizeof(line), gf ) ) {
+	if ( sscanf ( line, "track %d %d", &cyl, &head ) == 2 ) {
+	    exp.nsec = 0;
+	    continue;
+	}
+	if ( strncmp ( line, "end", 3 ) == 0 ) {
+	    sprintf ( name, "real_%d_%d", cyl, head );
+	    tran_read_deltas ( tran_path, cyl, head, deltas, &ndeltas );
+	    bad += test_one ( rf, name, &exp, cyl > CYLINDER_LIMIT );
+	    continue;
+	}
+	sp = new_sector ( &exp );
+	if ( ! sp || sscanf ( line, "%d %d %d %d %d %d %d %x", &sp->hdr_mark, &sp->data_mark,
+		&sp->cyl, &sp->head, &sp->sector, &sp->hdr_ok, &sp->data_ok, &sp->sum ) != 8 )
+	    error ( "bad line in golden file" );
+    }
+
+    fclose ( gf );
+    return bad;
+}
+
+/* Run salvage the way extraction does, through mfm_process_track.
+ * A clean track teaches us where the sectors are, then a track
+ * on the next head with one bad header must have that sector
+ * placed by position and written where it belongs.
+ */
+static int
+test_salvage ( FILE *rf )
+{
+    static struct synth_case good =
+	{ "learn",	310, 6, 3, SYNTH_CELL, -1, -1, -1, -1, -1, 1 };
+    static struct synth_case hurt =
+	{ "salvage_place", 310, 7, 3, SYNTH_CELL, -1, 4, -1, -1, -1, 1 };
+    static struct track_rec exp;
+    u_char buf[SECTOR_SIZE];
+    FILE *tf;
+    off_t block;
+    int save_fd;
+    int bad = 0;
+
+    tf = tmpfile ();
+    if ( ! tf )
+	error ( "cannot make a scratch image" );
+    save_fd = image_fd;
+    image_fd = fileno ( tf );
+    memset ( sec_count, 0, sizeof(sec_count) );
+    num_salvaged = 0;
+
+    synth_track ( &good, &exp );
+    synth_deltas ( &good, &exp, deltas, &ndeltas );
+    mfm_process_track ( good.cyl, good.head, deltas, ndeltas );
+
+    synth_track ( &hurt, &exp );
+    synth_deltas ( &hurt, &exp, deltas, &ndeltas );
+    mfm_process_track ( hurt.cyl, hurt.head, deltas, ndeltas );
+
+    if ( num_salvaged != 1 ) {
+	printf ( "%s: %d sectors salvaged, expected 1\n", hurt.name, num_salvaged );
+	bad++;
+    }
+
+    block = ((off_t) hurt.cyl * NUM_HEADS + hurt.head) * NUM_SECTORS + hurt.bad_header;
+    if ( pread ( image_fd, buf, SECTOR_SIZE, block * SECTOR_SIZE ) != SECTOR_SIZE ||
+	    memcmp ( buf, exp.sec[hurt.bad_header].data, SECTOR_SIZE ) != 0 ) {
+	printf ( "%s: sector %d not written where it belongs\n", hurt.name, hurt.bad_header );
+	bad++;
+    }
+
+    fclose ( tf );
+    image_fd = save_fd;
+    memset ( sec_count, 0, sizeof(sec_count) );
+    num_salvaged = 0;
+
+    fprintf ( rf, "%-16s %s\n", hurt.name, bad ? "FAIL" : "ok  " );
+    printf ( "%-16s %s\n", hurt.name, bad ? "FAIL" : "ok" );
+
+    return bad;
+}
+
+/* Known answers for crc_bytes, so a wrong polynomial or init
+ * cannot hide behind the synthetic tracks (which use the same code).
+ * The check string is the usual "123456789".  The header CRC is
+ * CRC-16/CCITT-FALSE, MPEG-2 is there to check 32 bit operation,
+ * and the data CRC value was worked out separately by long division.
+ */
+static struct crc_case {
+    char *name;
+    u_int64 init;
+    u_int64 poly;
+    int bits;
+    u_int64 crc;
+} crc_cases[] = {
+    { "crc_header", HEADER_CRC_INIT, HEADER_CRC_POLY, HEADER_CRC_BITS, 0x29b1 },
+    { "crc_mpeg2", 0xffffffff, 0x04c11db7, 32, 0x0376e6e7 },
+    { "crc_data", DATA_CRC_INIT, DATA_CRC_POLY, DATA_CRC_BITS, 0xd83940b8 },
+};
+
+#define NUM_CRC	(sizeof(crc_cases) / sizeof(crc_cases[0]))
+
+static int
+test_crc ( FILE *rf )
+{
+    static u_char check[] = "123456789";
+    struct crc_case *cp;
+    u_int64 crc;
+    int bad = 0;
+    int i;
+
+    for ( i=0; i<NUM_CRC; i++ ) {
+	cp = &crc_cases[i];
+	crc = crc_bytes ( check, 9, cp->init, cp->poly, cp->bits );
+	fprintf ( rf, "%-16s %s got %08llx want %08llx\n", cp->name,
+	    crc == cp->crc ? "ok  " : "FAIL", (unsigned long long) crc, (unsigned long long) cp->crc );
+	printf ( "%-16s %s\n", cp->name, crc == cp->crc ? "ok" : "FAIL" );
+	if ( crc != cp->crc )
+	    bad++;
+    }
+
+    return bad;
+}
+
+int
+mfm_self_test ( char *rpath, char *gpath )
+{
+    static struct track_rec exp;
+    struct synth_case *cp;
+    FILE *rf;
+    int bad = 0;
+    int i;
+
+    rf = fopen ( rpath, "w" );
+    if ( ! rf )
+	error ( "cannot open results file" );
+
+    bad += test_crc ( rf );
+
+    for ( i=0; i<NUM_SYNTH; i++ ) {
+	cp = &synth_cases[i];
+	synth_track ( cp, &exp );
+	synth_deltas ( cp, &exp, deltas, &ndeltas );
+	bad += test_one ( rf, cp->name, &exp, cp->resync );
+    }
+
+    bad += test_salvage ( rf );
+
+    if ( gpath )
+	bad += test_golden ( rf, gpath );
+
+    fclose ( rf );
+
+    if ( bad )
+	printf ( "Self test: %d problems (see %s)\n", bad, rpath );
+    else
+	printf ( "Self test passed (see %s)\n", rpath );
+
+    return bad;
 }
 
 /* -------------------------------------------------------- */
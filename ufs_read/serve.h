@@ -0,0 +1,54 @@
+/* serve.h
+ *
+ * What ufs_read --serve and ufs_query say to each other
+ * over a unix socket.  Both ends are on the same machine,
+ * so everything is in native byte order.
+ *
+ * The client sends a serve_req with the path right behind it,
+ * the server answers with a serve_rep and len bytes of data.
+ * A connection can carry any number of requests, one at a time.
+ */
+
+#define SERVE_STAT	1	/* one serve_stat */
+#define SERVE_READDIR	2	/* a serve_stat (with name) per entry */
+#define SERVE_READ	3	/* the bytes */
+#define SERVE_FIND	4	/* null terminated paths */
+
+#define SERVE_MAX_PATH	1024
+#define SERVE_MAX_READ	(1024 * 1024)
+
+/* part is -1 to pick the partition from the path (a path under
+ * /usr is in b), the way the cat and ls commands do it.
+ * A non zero inode is used instead of the path, part must be given.
+ * For find the path is the directory to start in, a null, and
+ * then a pattern (as for the shell) the names are matched against.
+ */
+struct serve_req {
+	int op;
+	int part;
+	u_int inode;
+	u_int offset;		/* read, in bytes */
+	u_int count;		/* read, at most SERVE_MAX_READ */
+	u_int len;		/* of the path */
+};
+
+/* error is 0, or an errno (ENOENT, ENOTDIR ...) and no data */
+struct serve_rep {
+	int error;
+	u_int len;
+};
+
+struct serve_stat {
+	u_int inode;
+	int part;
+	int mode;
+	int nlink;
+	int uid;
+	int gid;
+	int size;
+	int rdev;		/* major << 8 | minor, for special files */
+	u_int atime;
+	u_int mtime;
+	u_int ctime;
+	char name[DIRSIZ+2];	/* readdir only */
+};
@@ -0,0 +1,140 @@
+/* sha256.c
+ *
+ * SHA-256 (FIPS 180-4), a plain C version.
+ * Nothing clever, the copying is what takes the time.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const u_int k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x,n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define S0(x)	(ROR(x,2) ^ ROR(x,13) ^ ROR(x,22))
+#define S1(x)	(ROR(x,6) ^ ROR(x,11) ^ ROR(x,25))
+#define s0(x)	(ROR(x,7) ^ ROR(x,18) ^ ((x) >> 3))
+#define s1(x)	(ROR(x,17) ^ ROR(x,19) ^ ((x) >> 10))
+
+/* Do one 64 byte block */
+static void
+sha256_block ( u_int *state, const u_char *p )
+{
+	u_int w[64];
+	u_int a, b, c, d, e, f, g, h;
+	u_int t1, t2;
+	int i;
+
+	for ( i=0; i<16; i++ )
+	    w[i] = p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+	for ( ; i<64; i++ )
+	    w[i] = s1(w[i-2]) + w[i-7] + s0(w[i-15]) + w[i-16];
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for ( i=0; i<64; i++ ) {
+	    t1 = h + S1(e) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+	    t2 = S0(a) + ((a & b) ^ (a & c) ^ (b & c));
+	    h = g; g = f; f = e;
+	    e = d + t1;
+	    d = c; c = b; b = a;
+	    a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void
+sha256_init ( struct sha256 *sp )
+{
+	sp->state[0] = 0x6a09e667;
+	sp->state[1] = 0xbb67ae85;
+	sp->state[2] = 0x3c6ef372;
+	sp->state[3] = 0xa54ff53a;
+	sp->state[4] = 0x510e527f;
+	sp->state[5] = 0x9b05688c;
+	sp->state[6] = 0x1f83d9ab;
+	sp->state[7] = 0x5be0cd19;
+	sp->count = 0;
+	sp->nbuf = 0;
+}
+
+void
+sha256_update ( struct sha256 *sp, const void *data, size_t len )
+{
+	const u_char *p = data;
+	int n;
+
+	sp->count += len;
+
+	if ( sp->nbuf ) {
+	    n = 64 - sp->nbuf;
+	    if ( n > len )
+		n = len;
+	    memcpy ( &sp->buf[sp->nbuf], p, n );
+	    sp->nbuf += n;
+	    p += n;
+	    len -= n;
+	    if ( sp->nbuf < 64 )
+		return;
+	    sha256_block ( sp->state, sp->buf );
+	    sp->nbuf = 0;
+	}
+
+	/* Whole blocks straight from the caller */
+	while ( len >= 64 ) {
+	    sha256_block ( sp->state, p );
+	    p += 64;
+	    len -= 64;
+	}
+
+	memcpy ( sp->buf, p, len );
+	sp->nbuf = len;
+}
+
+void
+sha256_final ( struct sha256 *sp, u_char *digest )
+{
+	unsigned long long bits;
+	int i;
+
+	bits = sp->count * 8;
+
+	sp->buf[sp->nbuf++] = 0x80;
+	if ( sp->nbuf > 56 ) {
+	    memset ( &sp->buf[sp->nbuf], 0, 64 - sp->nbuf );
+	    sha256_block ( sp->state, sp->buf );
+	    sp->nbuf = 0;
+	}
+	memset ( &sp->buf[sp->nbuf], 0, 56 - sp->nbuf );
+	for ( i=0; i<8; i++ )
+	    sp->buf[56+i] = bits >> (56 - 8*i);
+	sha256_block ( sp->state, sp->buf );
+
+	for ( i=0; i<8; i++ ) {
+	    digest[4*i] = sp->state[i] >> 24;
+	    digest[4*i+1] = sp->state[i] >> 16;
+	    digest[4*i+2] = sp->state[i] >> 8;
+	    digest[4*i+3] = sp->state[i];
+	}
+}
@@ -0,0 +1,20 @@
+/* sha256.h
+ *
+ * SHA-256 (FIPS 180-4), just enough for ufs_read to
+ * checksum the files as it copies them.
+ */
+
+#include <sys/types.h>
+
+#define SHA256_LEN	32
+
+struct sha256 {
+	u_int state[8];
+	unsigned long long count;	/* bytes so far */
+	u_char buf[64];
+	int nbuf;
+};
+
+void sha256_init ( struct sha256 * );
+void sha256_update ( struct sha256 *, const void *, size_t );
+void sha256_final ( struct sha256 *, u_char * );
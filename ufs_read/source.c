@@ -0,0 +1,784 @@
+/* source.c
+ *
+ * Where the blocks of a disk image come from.
+ *
+ * A plain image is mapped if it can be (or read in whole from
+ * a pipe), and then nothing here is in the way.  Otherwise blocks
+ * are read in aligned groups and kept in a block cache that all
+ * the sources (and all the copier threads) share.
+ *
+ * A gzipped image is read the way zlib's zran example does it:
+ * one pass at open notes an access point every GZ_SPAN bytes
+ * of image (where it is in the gzip file, and the 32K window
+ * inflate needs to start there), after that a group is had by
+ * inflating from the nearest point before it.  So only the parts
+ * of the image that are looked at get inflated, and there is never
+ * a 22M copy of it, in memory or on disk.
+ *
+ * The sector log is what callan.py writes as it reads the disk
+ * over the serial line, the monitor on the Callan sends
+ *
+ *   CHS = 13 7 7  0
+ *
+ * (cylinder, head, sector and the controller status in hex)
+ * and then the sector as 16 lines of 32 hex bytes.
+ * We note where each sector is in the log and put it together
+ * when it is asked for.  If a sector was read more than once,
+ * the last good read wins.  Sectors never read are zeros.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zlib.h>
+
+#include "ufs.h"
+#include "source.h"
+
+/* ----------------------------- */
+/* The block cache */
+
+#define CACHE_BYTES	(4 * 1024 * 1024)
+#define CACHE_HASH	256
+
+struct cache_ent {
+	struct cache_ent *next;		/* hash chain */
+	struct source *src;
+	u_int group;
+	int len;			/* bytes in data */
+	unsigned long used;		/* cache_clock when last used */
+	u_char *data;
+};
+
+static struct cache_ent *cache_hash[CACHE_HASH];
+static struct cache_ent **cache_ents;	/* all of them, to find the oldest */
+static int cache_count;
+static int cache_max;
+static long cache_bytes;
+static unsigned long cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CACHE_SLOT(src,group)	((((unsigned long) (src) >> 4) + (group)) % CACHE_HASH)
+
+static struct cache_ent *
+cache_find ( struct source *src, u_int group )
+{
+	struct cache_ent *cp;
+
+	for ( cp = cache_hash[CACHE_SLOT(src,group)]; cp; cp = cp->next )
+	    if ( cp->src == src && cp->group == group )
+		return cp;
+	return NULL;
+}
+
+static void
+cache_drop ( int index )
+{
+	struct cache_ent *cp;
+	struct cache_ent **pp;
+
+	cp = cache_ents[index];
+	for ( pp = &cache_hash[CACHE_SLOT(cp->src,cp->group)]; *pp != cp; pp = &(*pp)->next )
+	    ;
+	*pp = cp->next;
+	cache_ents[index] = cache_ents[--cache_count];
+	cache_bytes -= cp->len;
+	free ( cp->data );
+	free ( cp );
+}
+
+/* Make room by throwing out whatever was used longest ago */
+static void
+cache_add ( struct source *src, u_int group, u_char *data, int len )
+{
+	struct cache_ent *cp;
+	int old;
+	int i;
+
+	while ( cache_count && cache_bytes + len > CACHE_BYTES ) {
+	    old = 0;
+	    for ( i = 1; i < cache_count; i++ )
+		if ( cache_ents[i]->used < cache_ents[old]->used )
+		    old = i;
+	    cache_drop ( old );
+	}
+
+	if ( cache_count == cache_max ) {
+	    cache_max = cache_max ? cache_max * 2 : 256;
+	    cache_ents = realloc ( cache_ents, cache_max * sizeof(struct cache_ent *) );
+	}
+	cp = malloc ( sizeof(struct cache_ent) );
+	if ( ! cache_ents || ! cp )
+	    error ( "out of memory for the block cache" );
+
+	cp->src = src;
+	cp->group = group;
+	cp->len = len;
+	cp->used = ++cache_clock;
+	cp->data = data;
+	cp->next = cache_hash[CACHE_SLOT(src,group)];
+	cache_hash[CACHE_SLOT(src,group)] = cp;
+	cache_ents[cache_count++] = cp;
+	cache_bytes += len;
+}
+
+/* Copy n blocks, starting first blocks into a group, to buf.
+ * The group is read without holding the lock, so the other
+ * threads can get at what is cached meanwhile.  Two threads may
+ * read the same group, the second one to finish drops its copy.
+ */
+static void
+cache_get ( struct source *src, u_int group, u_char *buf, int first, int n )
+{
+	struct cache_ent *cp;
+	u_char *data;
+	int len;
+
+	pthread_mutex_lock ( &cache_lock );
+	cp = cache_find ( src, group );
+	if ( cp ) {
+	    cp->used = ++cache_clock;
+	    memcpy ( buf, &cp->data[first*BSIZE], n * BSIZE );
+	    pthread_mutex_unlock ( &cache_lock );
+	    return;
+	}
+	pthread_mutex_unlock ( &cache_lock );
+
+	len = src->run * BSIZE;
+	data = malloc ( len );
+	if ( ! data )
+	    error ( "out of memory for the block cache" );
+	if ( src->read ( src, data, group * src->run, src->run ) )
+	    error ( "cannot read image" );
+	memcpy ( buf, &data[first*BSIZE], n * BSIZE );
+
+	pthread_mutex_lock ( &cache_lock );
+	if ( cache_find ( src, group ) )
+	    free ( data );
+	else
+	    cache_add ( src, group, data, len );
+	pthread_mutex_unlock ( &cache_lock );
+}
+
+/* Read count blocks, starting at block, into buf.
+ * The caller has made sure they are inside the image.
+ */
+void
+source_read ( struct source *src, u_char *buf, u_int block, int count )
+{
+	int first;
+	int n;
+
+	if ( src->base ) {
+	    memcpy ( buf, &src->base[(off_t) block * BSIZE], count * BSIZE );
+	    return;
+	}
+
+	while ( count > 0 ) {
+	    first = block % src->run;
+	    n = src->run - first;
+	    if ( n > count )
+		n = count;
+	    cache_get ( src, block / src->run, buf, first, n );
+	    buf += n * BSIZE;
+	    block += n;
+	    count -= n;
+	}
+}
+
+/* A group at the end of the image can run past it,
+ * the backends fill that part with zeros.
+ * Returns how many bytes are really there.
+ */
+static int
+clip_read ( struct source *src, u_char *buf, u_int block, int count )
+{
+	off_t pos;
+	int len;
+
+	pos = (off_t) block * BSIZE;
+	len = count * BSIZE;
+	if ( pos + len <= src->size )
+	    return len;
+	if ( pos >= src->size )
+	    len = 0;
+	else
+	    len = src->size - pos;
+	memset ( &buf[len], 0, count * BSIZE - len );
+	return len;
+}
+
+/* ----------------------------- */
+/* A plain image */
+
+#define RAW_RUN		64
+
+static int
+raw_read ( struct source *src, u_char *buf, u_int block, int count )
+{
+	off_t pos;
+	int len;
+	int n;
+
+	pos = (off_t) block * BSIZE;
+	len = clip_read ( src, buf, block, count );
+	while ( len > 0 ) {
+	    n = pread ( src->fd, buf, len, pos );
+	    if ( n <= 0 )
+		return -1;
+	    buf += n;
+	    pos += n;
+	    len -= n;
+	}
+	return 0;
+}
+
+static void
+raw_close ( struct source *src )
+{
+	if ( src->base )
+	    munmap ( (void *) src->base, src->size );
+	close ( src->fd );
+}
+
+/* Normally we just map the whole thing.  If that fails because
+ * the image is bigger than we can map, we read blocks as needed.
+ */
+static void
+raw_open ( struct source *src, int fd, off_t size )
+{
+	void *buf;
+
+	src->kind = "image";
+	src->fd = fd;
+	src->size = size;
+	src->run = RAW_RUN;
+	src->read = raw_read;
+	src->close = raw_close;
+
+	buf = mmap ( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+	if ( buf == MAP_FAILED ) {
+	    printf ( "Cannot map image (%s), using pread\n", strerror ( errno ) );
+	    return;
+	}
+	madvise ( buf, size, MADV_WILLNEED );
+	src->base = buf;
+}
+
+/* A pipe, or something like it, we read it all in */
+static void
+pipe_open ( struct source *src, int fd )
+{
+	u_char *buf;
+	off_t max;
+	off_t len;
+	int n;
+
+	len = 0;
+	max = 1024 * 1024;
+	buf = malloc ( max );
+	for ( ;; ) {
+	    if ( len == max ) {
+		max *= 2;
+		buf = realloc ( buf, max );
+	    }
+	    if ( ! buf )
+		error ( "out of memory reading image" );
+	    n = read ( fd, &buf[len], max - len );
+	    if ( n < 0 )
+		error ( "cannot read image" );
+	    if ( n == 0 )
+		break;
+	    len += n;
+	}
+
+	src->kind = "image";
+	src->size = len;
+	src->base = buf;
+}
+
+/* ----------------------------- */
+/* A gzipped image */
+
+#define GZ_SPAN		(256 * 1024)	/* image bytes between access points */
+#define GZ_WIN		32768
+#define GZ_IN		16384
+
+struct gz_point {
+	off_t out;		/* where in the image */
+	off_t in;		/* where in the gzip file */
+	int bits;		/* of the byte before in, that go with this point */
+	u_char *window;		/* the 32K of image before out */
+};
+
+struct gz_index {
+	int fd;
+	struct gz_point *points;
+	int count;
+	int max;
+};
+
+static void
+gz_point ( struct gz_index *gp, int bits, off_t in, off_t out, int left, u_char *window )
+{
+	struct gz_point *pp;
+
+	if ( gp->count == gp->max ) {
+	    gp->max = gp->max ? gp->max * 2 : 64;
+	    gp->points = realloc ( gp->points, gp->max * sizeof(struct gz_point) );
+	}
+	if ( ! gp->points )
+	    error ( "out of memory for the gzip index" );
+
+	pp = &gp->points[gp->count++];
+	pp->out = out;
+	pp->in = in;
+	pp->bits = bits;
+	pp->window = malloc ( GZ_WIN );
+	if ( ! pp->window )
+	    error ( "out of memory for the gzip index" );
+
+	/* window is circular, left is how much of it inflate has not filled */
+	if ( left )
+	    memcpy ( pp->window, window + GZ_WIN - left, left );
+	if ( left < GZ_WIN )
+	    memcpy ( pp->window + left, window, GZ_WIN - left );
+}
+
+/* Inflate the whole thing once (throwing it away) to find
+ * the access points.  With Z_BLOCK inflate stops at the end of
+ * each deflate block, which is the only place we can start again.
+ * Several gzip members one after another (pigz, or files cat'ed
+ * together) are one image.  Returns the size of the image.
+ */
+static off_t
+gz_index ( struct gz_index *gp )
+{
+	z_stream strm;
+	u_char input[GZ_IN];
+	u_char *window;
+	off_t totin, totout;
+	off_t last;
+	int fresh;
+	int ret;
+	int n;
+
+	window = calloc ( 1, GZ_WIN );
+	memset ( &strm, 0, sizeof(strm) );
+	if ( ! window || inflateInit2 ( &strm, 47 ) != Z_OK )
+	    error ( "cannot set up inflate" );
+
+	totin = totout = last = 0;
+	fresh = 1;
+	for ( ;; ) {
+	    if ( strm.avail_in == 0 ) {
+		n = read ( gp->fd, input, GZ_IN );
+		if ( n < 0 )
+		    error ( "cannot read image" );
+		if ( n == 0 )
+		    break;
+		strm.next_in = input;
+		strm.avail_in = n;
+	    }
+	    if ( strm.avail_out == 0 ) {
+		strm.next_out = window;
+		strm.avail_out = GZ_WIN;
+	    }
+
+	    totin += strm.avail_in;
+	    totout += strm.avail_out;
+	    ret = inflate ( &strm, Z_BLOCK );
+	    totin -= strm.avail_in;
+	    totout -= strm.avail_out;
+
+	    /* Junk (zero padding, say) after the last member */
+	    if ( ret == Z_DATA_ERROR && fresh )
+		break;
+	    if ( ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR )
+		error ( "bad gzip data in image" );
+	    if ( ret == Z_STREAM_END ) {
+		inflateReset ( &strm );
+		fresh = 1;
+		continue;
+	    }
+	    fresh = 0;
+
+	    if ( (strm.data_type & 128) && ! (strm.data_type & 64) &&
+		    (totout == 0 || totout - last >= GZ_SPAN) ) {
+		gz_point ( gp, strm.data_type & 7, totin, totout, strm.avail_out, window );
+		last = totout;
+	    }
+	}
+
+	if ( ! fresh )
+	    printf ( "The gzip image is cut short\n" );
+
+	inflateEnd ( &strm );
+	free ( window );
+	return totout;
+}
+
+/* Start at the last access point at or before the group,
+ * and inflate until we get to it, throwing away what comes
+ * before.  The points are in a raw deflate stream, so when
+ * one member ends we skip its trailer and let inflate read the
+ * next header itself.
+ */
+static int
+gz_read ( struct source *src, u_char *buf, u_int block, int count )
+{
+	struct gz_index *gp = src->priv;
+	struct gz_point *pp;
+	z_stream strm;
+	u_char *input;
+	off_t pos, in;
+	off_t skip;
+	int len, got;
+	int raw;
+	int lo, hi, mid;
+	int avail;
+	int ret;
+	int n;
+	u_char c;
+
+	pos = (off_t) block * BSIZE;
+	len = clip_read ( src, buf, block, count );
+	if ( len == 0 )
+	    return 0;
+
+	lo = 0;
+	hi = gp->count - 1;
+	while ( lo < hi ) {
+	    mid = (lo + hi + 1) / 2;
+	    if ( gp->points[mid].out <= pos )
+		lo = mid;
+	    else
+		hi = mid - 1;
+	}
+	pp = &gp->points[lo];
+
+	input = malloc ( GZ_IN );
+	memset ( &strm, 0, sizeof(strm) );
+	if ( ! input || inflateInit2 ( &strm, -15 ) != Z_OK )
+	    error ( "cannot set up inflate" );
+
+	in = pp->in;
+	if ( pp->bits ) {
+	    if ( pread ( gp->fd, &c, 1, in - 1 ) != 1 )
+		goto fail;
+	    inflatePrime ( &strm, pp->bits, c >> (8 - pp->bits) );
+	}
+	inflateSetDictionary ( &strm, pp->window, GZ_WIN );
+	raw = 1;
+
+	skip = pos - pp->out;
+	got = 0;
+	while ( got < len ) {
+	    if ( skip > 0 ) {
+		strm.next_out = buf;
+		strm.avail_out = skip < len ? skip : len;
+	    } else {
+		strm.next_out = buf + got;
+		strm.avail_out = len - got;
+	    }
+	    if ( strm.avail_in == 0 ) {
+		n = pread ( gp->fd, input, GZ_IN, in );
+		if ( n <= 0 )
+		    goto fail;
+		in += n;
+		strm.next_in = input;
+		strm.avail_in = n;
+	    }
+
+	    avail = strm.avail_out;
+	    ret = inflate ( &strm, Z_NO_FLUSH );
+	    avail -= strm.avail_out;
+	    if ( skip > 0 )
+		skip -= avail;
+	    else
+		got += avail;
+
+	    if ( ret == Z_STREAM_END ) {
+		in -= strm.avail_in;
+		if ( raw )
+		    in += 8;
+		strm.avail_in = 0;
+		inflateReset2 ( &strm, 31 );
+		raw = 0;
+	    } else if ( ret != Z_OK && ret != Z_BUF_ERROR )
+		goto fail;
+	}
+
+	inflateEnd ( &strm );
+	free ( input );
+	return 0;
+
+fail:
+	inflateEnd ( &strm );
+	free ( input );
+	return -1;
+}
+
+static void
+gz_close ( struct source *src )
+{
+	struct gz_index *gp = src->priv;
+	int i;
+
+	for ( i = 0; i < gp->count; i++ )
+	    free ( gp->points[i].window );
+	free ( gp->points );
+	close ( gp->fd );
+	free ( gp );
+}
+
+static void
+gz_open ( struct source *src, int fd, int verbose )
+{
+	struct gz_index *gp;
+
+	gp = calloc ( 1, sizeof(struct gz_index) );
+	if ( ! gp )
+	    error ( "out of memory for the gzip index" );
+	gp->fd = fd;
+
+	src->kind = "gzip";
+	src->size = gz_index ( gp );
+	src->run = GZ_SPAN / BSIZE;
+	src->read = gz_read;
+	src->close = gz_close;
+	src->priv = gp;
+
+	if ( gp->count == 0 )
+	    error ( "nothing in the gzip image" );
+	if ( verbose )
+	    printf ( "gzip image, %lld bytes, %d access points\n",
+		(long long) src->size, gp->count );
+}
+
+/* ----------------------------- */
+/* A sector log */
+
+#define LOG_LINE	256
+#define LOG_TEXT	1200		/* 16 lines of hex, and then some */
+
+struct log_index {
+	int fd;
+	off_t *where;		/* of the hex for each block, 0 if never read */
+	u_char *bad;		/* the last read had a bad status */
+	int nblocks;
+};
+
+static int
+hexval ( int c )
+{
+	if ( c >= 'a' )
+	    return c - 'a' + 10;
+	if ( c >= 'A' )
+	    return c - 'A' + 10;
+	return c - '0';
+}
+
+static int
+log_read ( struct source *src, u_char *buf, u_int block, int count )
+{
+	struct log_index *lp = src->priv;
+	char text[LOG_TEXT+1];
+	char *p, *q;
+	int len;
+	int n;
+	int i;
+
+	for ( i = 0; i < count; i++, block++, buf += BSIZE ) {
+	    memset ( buf, 0, BSIZE );
+	    if ( block >= lp->nblocks || ! lp->where[block] )
+		continue;
+
+	    n = pread ( lp->fd, text, LOG_TEXT, lp->where[block] );
+	    if ( n < 0 )
+		return -1;
+	    text[n] = '\0';
+
+	    /* Take lines of hex until something else comes along
+	     * (the next CHS line, if the sector was cut short).
+	     */
+	    len = 0;
+	    for ( p = text; *p && len < BSIZE; p = q ) {
+		for ( q = p; *q && *q != '\n' && *q != '\r'; q++ )
+		    ;
+		if ( q == p ) {
+		    q++;
+		    continue;
+		}
+		if ( ! *q )
+		    break;
+		while ( p + 1 < q && isxdigit ( p[0] ) && isxdigit ( p[1] ) && len < BSIZE ) {
+		    buf[len++] = hexval ( p[0] ) << 4 | hexval ( p[1] );
+		    p += 2;
+		}
+		if ( p != q )
+		    break;
+	    }
+	}
+	return 0;
+}
+
+static void
+log_close ( struct source *src )
+{
+	struct log_index *lp = src->priv;
+
+	close ( lp->fd );
+	free ( lp->where );
+	free ( lp->bad );
+	free ( lp );
+}
+
+static void
+log_open ( struct source *src, int fd, int verbose )
+{
+	struct log_index *lp;
+	FILE *fp;
+	char line[LOG_LINE];
+	int c, h, s;
+	u_int status;
+	int block;
+	int max_cyl;
+	int reads, bad, missing;
+	int i;
+
+	lp = calloc ( 1, sizeof(struct log_index) );
+	fp = fdopen ( dup ( fd ), "r" );
+	if ( ! lp || ! fp )
+	    error ( "cannot read sector log" );
+	lp->fd = fd;
+
+	max_cyl = -1;
+	reads = 0;
+	while ( fgets ( line, LOG_LINE, fp ) ) {
+	    if ( sscanf ( line, "CHS = %d %d %d %x", &c, &h, &s, &status ) != 4 )
+		continue;
+	    if ( c < 0 || h < 0 || h >= HEADS || s < 0 || s >= SECTORS ) {
+		printf ( "Sector log: no such sector %d %d %d\n", c, h, s );
+		continue;
+	    }
+	    reads++;
+
+	    block = c * CYL_BLOCKS + h * SECTORS + s;
+	    if ( block >= lp->nblocks ) {
+		i = lp->nblocks;
+		lp->nblocks = (c + 16) * CYL_BLOCKS;
+		lp->where = realloc ( lp->where, lp->nblocks * sizeof(off_t) );
+		lp->bad = realloc ( lp->bad, lp->nblocks );
+		if ( ! lp->where || ! lp->bad )
+		    error ( "out of memory for the sector log" );
+		memset ( &lp->where[i], 0, (lp->nblocks - i) * sizeof(off_t) );
+		memset ( &lp->bad[i], 0, lp->nblocks - i );
+	    }
+	    if ( c > max_cyl )
+		max_cyl = c;
+
+	    /* Don't let a bad read spoil a good one */
+	    if ( status && lp->where[block] && ! lp->bad[block] )
+		continue;
+	    lp->where[block] = ftello ( fp );
+	    lp->bad[block] = status != 0;
+	}
+	fclose ( fp );
+
+	if ( max_cyl < 0 )
+	    error ( "nothing in the sector log" );
+
+	src->kind = "log";
+	src->size = (off_t) (max_cyl + 1) * CYL_BLOCKS * BSIZE;
+	src->run = SECTORS;
+	src->read = log_read;
+	src->close = log_close;
+	src->priv = lp;
+
+	bad = missing = 0;
+	for ( i = 0; i < (max_cyl + 1) * CYL_BLOCKS; i++ ) {
+	    if ( ! lp->where[i] )
+		missing++;
+	    else if ( lp->bad[i] )
+		bad++;
+	}
+	if ( verbose )
+	    printf ( "Sector log: %d reads, %d cylinders, %d sectors bad, %d never read\n",
+		reads, max_cyl + 1, bad, missing );
+}
+
+/* ----------------------------- */
+
+/* Look at the first few bytes to see what we have.
+ * "-" is stdin, which has to be a plain image.
+ */
+struct source *
+source_open ( char *path, int verbose )
+{
+	struct source *src;
+	struct stat st;
+	u_char magic[8];
+	int fd;
+
+	src = calloc ( 1, sizeof(struct source) );
+	if ( ! src )
+	    error ( "out of memory" );
+	src->fd = -1;
+
+	if ( strcmp ( path, "-" ) == 0 )
+	    fd = 0;
+	else
+	    fd = open ( path, O_RDONLY );
+	if ( fd < 0 )
+	    error ( "could not open disk image" );
+
+	if ( fstat ( fd, &st ) < 0 )
+	    error ( "could not stat disk image" );
+
+	if ( ! S_ISREG ( st.st_mode ) ) {
+	    pipe_open ( src, fd );
+	    return src;
+	}
+
+	memset ( magic, 0, sizeof(magic) );
+	if ( pread ( fd, magic, sizeof(magic), 0 ) < 0 )
+	    error ( "cannot read image" );
+
+	if ( magic[0] == 0x1f && magic[1] == 0x8b )
+	    gz_open ( src, fd, verbose );
+	else if ( magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd )
+	    error ( "zstd images are not handled, recompress it with gzip" );
+	else if ( memcmp ( magic, "CHS = ", 6 ) == 0 )
+	    log_open ( src, fd, verbose );
+	else
+	    raw_open ( src, fd, st.st_size );
+
+	return src;
+}
+
+void
+source_close ( struct source *src )
+{
+	int i;
+
+	pthread_mutex_lock ( &cache_lock );
+	for ( i = 0; i < cache_count; )
+	    if ( cache_ents[i]->src == src )
+		cache_drop ( i );
+	    else
+		i++;
+	pthread_mutex_unlock ( &cache_lock );
+
+	if ( src->close )
+	    src->close ( src );
+	free ( src );
+}
@@ -0,0 +1,38 @@
+/* source.h
+ *
+ * Where the blocks of a disk image come from.
+ * A plain image file, a gzipped one, or the log of sectors
+ * that callan.py read over the serial line.
+ * Block numbers here are from the start of the disk.
+ */
+
+#include <sys/types.h>
+
+struct source {
+	char *kind;		/* "image", "gzip", "log" */
+	off_t size;		/* bytes, as if it were a plain image */
+
+	/* The whole image in memory (mapped, or read from a pipe),
+	 * if we have it, otherwise NULL and blocks go through the cache.
+	 */
+	const u_char *base;
+
+	/* A plain image file, so copy_file_range can be used on it.
+	 * -1 for the others.
+	 */
+	int fd;
+
+	/* Blocks are read (and cached) in aligned groups of this many */
+	int run;
+
+	/* Read count blocks from block, 0 if all went well */
+	int (*read) ( struct source *, u_char *, u_int, int );
+	void (*close) ( struct source * );
+	void *priv;
+};
+
+struct source *source_open ( char *, int );
+void source_read ( struct source *, u_char *, u_int, int );
+void source_close ( struct source * );
+
+void error ( char * );
@@ -0,0 +1,124 @@
+/* ufs.h
+ *
+ * The V7 filesystem as it sits on the Callan disk,
+ * shared by ufs_read and ufs_mkfs.
+ * Everything on the disk is big endian.
+ */
+
+typedef unsigned char u_char;
+typedef unsigned short u_short;
+typedef unsigned int u_int;
+
+#define BSIZE		512
+
+/* 8 heads and 17 sectors */
+#define HEADS		8
+#define SECTORS		17
+#define CYL_BLOCKS	(HEADS * SECTORS)
+
+/* From:
+ *  include/sys/filsys.h
+ *  include/sys/param.h
+ *  include/sys/types.h
+ *  include/sys/ino.h
+
+ */
+
+/* ino_t conflicts with linux headers */
+typedef	unsigned short	xino_t;     	/* i-node number */
+typedef	unsigned int	xoff_t;
+typedef	unsigned int	xtime_t;
+
+/* These are in core "caches" not relevant to us.
+ * but they do take up space in the super block
+ */
+#define NICFREE 50
+#define NICINOD 100             /* number of superblock inodes */
+
+/* Don't ask me what inode 1 is for.
+ * No doubt 0 is reserved for "nobody home here"
+ */
+#define ROOT_INO	2
+
+/* Note that in these ancient days, the super block had no magic number.
+ * You just had to know where it was.
+ */
+struct __attribute__((__packed__)) super
+{
+    u_short	isize;
+    u_int	fsize;	/* size in blocks */
+    u_short	nfree;
+    u_int	free[NICFREE];
+    u_short	ninode;
+    xino_t	inode[NICINOD];
+    u_int	stuff;
+    xtime_t	time;
+    u_int	tfree;	/* free blocks in all */
+    xino_t	tinode;	/* free inodes in all */
+    char	_extra[512];
+};
+
+/* This is 64 bytes, so you can fit 8 of these in a block.
+ */
+struct __attribute__((__packed__)) dinode
+{
+        unsigned short  di_mode;        /* mode and type of file */
+        short   di_nlink;       /* number of links to file */
+        short   di_uid;         /* owner's user id */
+        short   di_gid;         /* owner's group id */
+        xoff_t   di_size;        /* number of bytes in file */
+        u_char    di_addr[40];    /* disk block addresses */
+        xtime_t  di_atime;       /* time last accessed */
+        xtime_t  di_mtime;       /* time last modified */
+        xtime_t  di_ctime;       /* time created */
+};
+
+#define INODES_PER_BLOCK	(BSIZE / sizeof (struct dinode))
+
+/* We get 13 addresses of 3 bytes each (and an extra byte) */
+
+/* modes - in octal of all things, but I am too lazy to
+ * convert to text, and I might make errors.
+ */
+#define IFMT    0170000         /* type of file */
+#define         IFDIR   0040000 /* directory */
+#define         IFCHR   0020000 /* character special */
+#define         IFBLK   0060000 /* block special */
+#define         IFREG   0100000 /* regular */
+#define         IFMPC   0030000 /* multiplexed char special */
+#define         IFMPB   0070000 /* multiplexed block special */
+#define ISUID   04000           /* set user id on execution */
+#define ISGID   02000           /* set group id on execution */
+#define ISVTX   01000           /* save swapped text even after use */
+#define IREAD   0400            /* read, write, execute permissions */
+#define IWRITE  0200
+#define IEXEC   0100
+
+/* I nodes begin at block 2 in the filesystem.
+ */
+#define INODE_OFFSET	2
+
+/* These were the days!  14 byte filename limits.
+ *  note that there is no guarantee of a null terminator.
+ * So directory entries were 16 bytes
+ *  and you could get 32 of them in a block
+ */
+#define DIRSIZ  14
+struct  direct
+{
+        xino_t   d_ino;
+        char    d_name[DIRSIZ];
+};
+
+#define DIRECT_PER_BLOCK	(BSIZE / sizeof(struct direct))
+
+/* The only disk inode stores disk addresses in 3 bytes */
+#define NUM_INODE_ADDR		13
+#define BYTES_INODE_ADDR	(NUM_INODE_ADDR * 3)
+
+/* The first 10 addresses are data blocks, then come the
+ * single, double, and triple indirect blocks.
+ * An indirect block holds 128 four byte addresses.
+ */
+#define NDADDR			10
+#define NINDIR			(BSIZE / sizeof(u_int))
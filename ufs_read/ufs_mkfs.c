@@ -0,0 +1,1038 @@
+/* ufs_mkfs.c
+ *
+ * ufs_mkfs - build a V7 filesystem image (the kind ufs_read reads)
+ * from a directory tree, or from a tar archive.
+ *
+ * ufs_mkfs [-b blocks] [-i inodes] [-c cyl] [-p n] image dir|file.tar
+ *
+ *  -b  size of the filesystem in blocks (default: what it takes,
+ *      plus a tenth, rounded up to whole cylinders)
+ *  -i  how many inodes (default: what it takes, plus a quarter)
+ *  -c  write it into an existing disk image as a partition
+ *      starting at this cylinder, rather than as an image by itself
+ *  -p  strip this many leading names off the paths in a tar archive
+ *      (ufs_read -o puts everything under root/ or usr/)
+ *
+ * Everything is laid out to be read straight through.  The blocks
+ * go down in the order a walk of the tree reads them: a directory,
+ * the files in it, then its subdirectories, one after another.
+ * Each file is contiguous, with every indirect block just ahead of
+ * the blocks it maps.  The inodes of one directory are numbered
+ * together, so they share inode blocks.  Blocks that are all zeros
+ * are left as holes.
+ *
+ * The image is put together in memory and goes out in one write.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <arpa/inet.h>
+
+#include "ufs.h"
+
+/* One file, directory or device in the tree we are building */
+struct node {
+	char name[DIRSIZ+1];
+	char *full;		/* the name before it was cut, if it was */
+	int mode;
+	int uid;
+	int gid;
+	int rdev;		/* major << 8 | minor, devices */
+	time_t atime;
+	time_t mtime;
+	u_int size;
+	u_char *data;		/* contents of a regular file */
+	struct node *link;	/* a hard link, to this node */
+	struct node *parent;
+	struct node *kids;	/* directory contents, in order */
+	struct node *last;
+	struct node *next;
+	int nlink;
+	int ino;
+	u_int addr[NUM_INODE_ADDR];
+};
+
+static struct node *root;
+
+static u_char *img;		/* the filesystem, NULL while we just count */
+static u_int next_block;
+static int next_ino;
+static time_t newest;		/* goes in the superblock */
+
+static int strip;
+
+static const u_char zero_block[BSIZE];
+
+void error ( char * );
+
+static struct node *
+new_node ( struct node *parent, char *name, int mode )
+{
+	struct node *np;
+
+	np = calloc ( 1, sizeof(struct node) );
+	if ( ! np )
+	    error ( "out of memory" );
+	if ( strlen ( name ) > DIRSIZ ) {
+	    printf ( "Name cut to %d characters: %s\n", DIRSIZ, name );
+	    np->full = strdup ( name );
+	}
+	strncpy ( np->name, name, DIRSIZ );
+	np->mode = mode;
+	np->parent = parent;
+
+	if ( parent ) {
+	    if ( parent->last )
+		parent->last->next = np;
+	    else
+		parent->kids = np;
+	    parent->last = np;
+	}
+	return np;
+}
+
+static struct node *
+find_kid ( struct node *dp, char *name )
+{
+	struct node *np;
+
+	for ( np = dp->kids; np; np = np->next )
+	    if ( strncmp ( np->name, name, DIRSIZ ) == 0 )
+		return np;
+	return NULL;
+}
+
+static void
+set_times ( struct node *np, time_t atime, time_t mtime )
+{
+	np->atime = atime;
+	np->mtime = mtime;
+	if ( mtime > newest )
+	    newest = mtime;
+}
+
+/* ----------------------------- */
+/* From a directory tree */
+
+/* Files with several links, so we can find the first one again */
+struct host_link {
+	dev_t dev;
+	ino_t ino;
+	struct node *np;
+	struct host_link *next;
+};
+
+static struct host_link *host_links;
+
+static u_char *
+read_file ( char *path, u_int size )
+{
+	u_char *buf;
+	int fd;
+	int n;
+	u_int got;
+
+	if ( ! size )
+	    return NULL;
+	buf = malloc ( size );
+	if ( ! buf )
+	    error ( "out of memory for file" );
+
+	fd = open ( path, O_RDONLY );
+	if ( fd < 0 ) {
+	    printf ( "Cannot open: %s\n", path );
+	    error ( "cannot read file" );
+	}
+	for ( got = 0; got < size; got += n ) {
+	    n = read ( fd, &buf[got], size - got );
+	    if ( n <= 0 ) {
+		printf ( "Cannot read: %s\n", path );
+		error ( "cannot read file" );
+	    }
+	}
+	close ( fd );
+	return buf;
+}
+
+/* The whole of a file, for a tar archive */
+static u_char *
+read_file_all ( char *path, struct stat *stp )
+{
+	if ( stat ( path, stp ) ) {
+	    printf ( "Cannot stat: %s\n", path );
+	    error ( "cannot read file" );
+	}
+	return read_file ( path, stp->st_size );
+}
+
+static void read_dir ( struct node *, char * );
+
+static void
+add_host ( struct node *dp, char *path, char *name )
+{
+	struct host_link *hp;
+	struct node *np;
+	struct stat st;
+
+	if ( lstat ( path, &st ) ) {
+	    printf ( "Cannot stat: %s\n", path );
+	    return;
+	}
+
+	/* Names in a host directory are all different, until they
+	 * are cut to DIRSIZ.  Two entries with one name would make
+	 * a mess of the directory, so the first one wins.
+	 */
+	if ( find_kid ( dp, name ) ) {
+	    printf ( "Name is the same as another when cut to %d characters, skipped: %s\n", DIRSIZ, path );
+	    return;
+	}
+
+	if ( S_ISREG ( st.st_mode ) && st.st_nlink > 1 ) {
+	    for ( hp = host_links; hp; hp = hp->next )
+		if ( hp->dev == st.st_dev && hp->ino == st.st_ino ) {
+		    np = new_node ( dp, name, hp->np->mode );
+		    np->link = hp->np;
+		    return;
+		}
+	}
+
+	if ( S_ISDIR ( st.st_mode ) ) {
+	    np = new_node ( dp, name, IFDIR | (st.st_mode & 07777) );
+	} else if ( S_ISREG ( st.st_mode ) ) {
+	    if ( st.st_size > 0x7fffffff ) {
+		printf ( "Too big for V7, skipped: %s\n", path );
+		return;
+	    }
+	    np = new_node ( dp, name, IFREG | (st.st_mode & 07777) );
+	    np->size = st.st_size;
+	    np->data = read_file ( path, np->size );
+	} else if ( S_ISCHR ( st.st_mode ) || S_ISBLK ( st.st_mode ) ) {
+	    np = new_node ( dp, name, (S_ISCHR ( st.st_mode ) ? IFCHR : IFBLK) | (st.st_mode & 07777) );
+	    np->rdev = (major ( st.st_rdev ) & 0xff) << 8 | (minor ( st.st_rdev ) & 0xff);
+	} else {
+	    /* V7 has no symlinks, and pipes don't live in the filesystem */
+	    printf ( "Skipped (not a file, directory or device): %s\n", path );
+	    return;
+	}
+
+	np->uid = st.st_uid;
+	np->gid = st.st_gid;
+	set_times ( np, st.st_atime, st.st_mtime );
+
+	if ( S_ISREG ( st.st_mode ) && st.st_nlink > 1 ) {
+	    hp = malloc ( sizeof(struct host_link) );
+	    if ( ! hp )
+		error ( "out of memory" );
+	    hp->dev = st.st_dev;
+	    hp->ino = st.st_ino;
+	    hp->np = np;
+	    hp->next = host_links;
+	    host_links = hp;
+	}
+
+	if ( S_ISDIR ( st.st_mode ) )
+	    read_dir ( np, path );
+}
+
+/* Sorted by name, so the same tree always makes the same image */
+static void
+read_dir ( struct node *dp, char *path )
+{
+	struct dirent **list;
+	char *sub;
+	int n;
+	int i;
+
+	n = scandir ( path, &list, NULL, alphasort );
+	if ( n < 0 ) {
+	    printf ( "Cannot read directory: %s\n", path );
+	    return;
+	}
+
+	for ( i=0; i<n; i++ ) {
+	    if ( strcmp ( list[i]->d_name, "." ) && strcmp ( list[i]->d_name, ".." ) ) {
+		sub = malloc ( strlen ( path ) + strlen ( list[i]->d_name ) + 2 );
+		if ( ! sub )
+		    error ( "out of memory" );
+		sprintf ( sub, "%s/%s", path, list[i]->d_name );
+		add_host ( dp, sub, list[i]->d_name );
+		free ( sub );
+	    }
+	    free ( list[i] );
+	}
+	free ( list );
+}
+
+/* ----------------------------- */
+/* From a tar archive (ustar, with pax or GNU long names,
+ * and GNU sparse 1.0 files, which is what ufs_read -o writes)
+ */
+
+#define TAR_PATH	1024
+
+static long
+tar_num ( const char *p, int len )
+{
+	long val = 0;
+
+	while ( len > 0 && (*p == ' ' || *p == '0') ) {
+	    p++;
+	    len--;
+	}
+	while ( len > 0 && *p >= '0' && *p <= '7' ) {
+	    val = val * 8 + *p++ - '0';
+	    len--;
+	}
+	return val;
+}
+
+/* Set when tar_lookup gives up on a name that is cut to DIRSIZ
+ * and comes out the same as one an earlier entry made.
+ */
+static int name_clash;
+
+/* Find the node for a path, making directories on the way.
+ * Returns NULL for the top (after stripping), which is the root,
+ * and for a clash (the first one wins, as in add_host).
+ */
+static struct node *
+tar_lookup ( char *tar_path, int make_last, int mode )
+{
+	char path[TAR_PATH];
+	struct node *dp;
+	struct node *np;
+	char *name;
+	char *p;
+	int n;
+
+	name_clash = 0;
+	strcpy ( path, tar_path );
+
+	/* Leading "/" and "./" mean nothing here */
+	name = path;
+	while ( *name == '/' || (name[0] == '.' && name[1] == '/') )
+	    name += (*name == '/') ? 1 : 2;
+	for ( n = 0; n < strip && *name; n++ ) {
+	    p = strchr ( name, '/' );
+	    name = p ? p + 1 : name + strlen ( name );
+	}
+
+	dp = root;
+	np = NULL;
+	for ( name = strtok ( name, "/" ); name; name = p ) {
+	    p = strtok ( NULL, "/" );
+	    if ( strcmp ( name, "." ) == 0 )
+		continue;
+	    np = find_kid ( dp, name );
+	    if ( np && strcmp ( np->full ? np->full : np->name, name ) != 0 ) {
+		printf ( "Name is the same as another when cut to %d characters, skipped: %s\n",
+		    DIRSIZ, tar_path );
+		name_clash = 1;
+		return NULL;
+	    }
+	    if ( p ) {
+		if ( ! np )
+		    np = new_node ( dp, name, IFDIR | 0755 );
+		if ( (np->mode & IFMT) != IFDIR )
+		    return NULL;
+		dp = np;
+		np = NULL;
+		continue;
+	    }
+	    if ( ! np && make_last )
+		np = new_node ( dp, name, mode );
+	    break;
+	}
+
+	return np;
+}
+
+/* The data of a GNU sparse 1.0 file starts with a map in decimal:
+ * the number of pieces, then the offset and size of each, padded
+ * out to a block.  The pieces follow, one after another.
+ */
+static u_char *
+tar_sparse ( u_char *data, long len, u_int realsize )
+{
+	u_char *buf;
+	long *map;
+	char *p;
+	long off;
+	int count;
+	int i;
+
+	buf = calloc ( 1, realsize ? realsize : 1 );
+	if ( ! buf )
+	    error ( "out of memory for sparse file" );
+
+	p = (char *) data;
+	count = strtol ( p, &p, 10 );
+	if ( count < 0 || count > len / 2 )
+	    error ( "bad sparse map in tar archive" );
+	map = malloc ( (2 * count + 1) * sizeof(long) );
+	if ( ! map )
+	    error ( "out of memory for sparse map" );
+	for ( i=0; i<2*count; i++ )
+	    map[i] = strtol ( p, &p, 10 );
+	if ( *p == '\n' )
+	    p++;
+	off = p - (char *) data;
+	off = (off + BSIZE - 1) / BSIZE * BSIZE;
+
+	for ( i=0; i<count; i++ ) {
+	    if ( map[2*i] < 0 || map[2*i+1] < 0 || map[2*i] + map[2*i+1] > realsize ||
+		    off + map[2*i+1] > len )
+		error ( "bad sparse map in tar archive" );
+	    memcpy ( &buf[map[2*i]], &data[off], map[2*i+1] );
+	    off += map[2*i+1];
+	}
+
+	free ( map );
+	return buf;
+}
+
+/* What pax (or GNU long name) headers told us about the next entry */
+
+struct tar_ext {
+	char path[TAR_PATH];
+	char link[TAR_PATH];
+	char sparse_name[TAR_PATH];
+	long realsize;
+	long size;
+	long mtime;
+	long atime;
+	long uid;
+	long gid;
+};
+
+static void
+ext_clear ( struct tar_ext *xp )
+{
+	xp->path[0] = xp->link[0] = xp->sparse_name[0] = '\0';
+	xp->realsize = xp->size = xp->mtime = xp->atime = -1;
+	xp->uid = xp->gid = -1;
+}
+
+static void
+ext_string ( char *to, char *from, long len )
+{
+	if ( len >= TAR_PATH )
+	    len = TAR_PATH - 1;
+	memcpy ( to, from, len );
+	to[len] = '\0';
+}
+
+/* Records are "len key=value\n" */
+static void
+pax_parse ( char *p, long len, struct tar_ext *xp )
+{
+	char *end = p + len;
+	char *key;
+	char *val;
+	char *q;
+	long vlen;
+	long n;
+
+	while ( p < end ) {
+	    n = strtol ( p, &q, 10 );
+	    if ( n <= 0 || p + n > end || *q != ' ' )
+		break;
+	    key = q + 1;
+	    val = memchr ( key, '=', p + n - key );
+	    if ( ! val )
+		break;
+	    *val++ = '\0';
+	    vlen = p + n - 1 - val;
+
+	    if ( strcmp ( key, "path" ) == 0 )
+		ext_string ( xp->path, val, vlen );
+	    else if ( strcmp ( key, "linkpath" ) == 0 )
+		ext_string ( xp->link, val, vlen );
+	    else if ( strcmp ( key, "GNU.sparse.name" ) == 0 )
+		ext_string ( xp->sparse_name, val, vlen );
+	    else if ( strcmp ( key, "GNU.sparse.realsize" ) == 0 )
+		xp->realsize = atol ( val );
+	    else if ( strcmp ( key, "size" ) == 0 )
+		xp->size = atol ( val );
+	    else if ( strcmp ( key, "mtime" ) == 0 )
+		xp->mtime = atol ( val );
+	    else if ( strcmp ( key, "atime" ) == 0 )
+		xp->atime = atol ( val );
+	    else if ( strcmp ( key, "uid" ) == 0 )
+		xp->uid = atol ( val );
+	    else if ( strcmp ( key, "gid" ) == 0 )
+		xp->gid = atol ( val );
+	    p += n;
+	}
+}
+
+static void
+tar_entry ( u_char *hp, u_char *data, long size, struct tar_ext *xp )
+{
+	struct node *np;
+	struct node *target;
+	char name[TAR_PATH];
+	char link[TAR_PATH];
+	time_t mtime;
+	int type;
+	int mode;
+
+	if ( xp->sparse_name[0] )
+	    strcpy ( name, xp->sparse_name );
+	else if ( xp->path[0] )
+	    strcpy ( name, xp->path );
+	else if ( memcmp ( &hp[257], "ustar", 5 ) == 0 && hp[345] )
+	    snprintf ( name, sizeof(name), "%.155s/%.100s", &hp[345], hp );
+	else
+	    snprintf ( name, sizeof(name), "%.100s", hp );
+
+	if ( xp->link[0] )
+	    strcpy ( link, xp->link );
+	else
+	    snprintf ( link, sizeof(link), "%.100s", &hp[157] );
+
+	type = hp[156];
+	mode = tar_num ( (char *) &hp[100], 8 ) & 07777;
+	mtime = xp->mtime >= 0 ? xp->mtime : tar_num ( (char *) &hp[136], 12 );
+
+	switch ( type ) {
+	case '5':
+	    np = tar_lookup ( name, 1, IFDIR | mode );
+	    if ( name_clash )
+		return;
+	    if ( ! np )
+		np = root;
+	    if ( (np->mode & IFMT) != IFDIR ) {
+		printf ( "Not a directory, skipped: %s\n", name );
+		return;
+	    }
+	    np->mode = IFDIR | mode;
+	    break;
+
+	case '0':
+	case '\0':
+	case '7':
+	    np = tar_lookup ( name, 1, IFREG | mode );
+	    if ( name_clash )
+		return;
+	    if ( ! np || (np->mode & IFMT) == IFDIR ) {
+		printf ( "Cannot make file: %s\n", name );
+		return;
+	    }
+	    np->mode = IFREG | mode;
+	    np->link = NULL;
+	    if ( xp->sparse_name[0] && xp->realsize >= 0 ) {
+		np->size = xp->realsize;
+		np->data = tar_sparse ( data, size, np->size );
+	    } else {
+		np->size = size;
+		np->data = size ? data : NULL;
+	    }
+	    break;
+
+	case '1':
+	    target = tar_lookup ( link, 0, 0 );
+	    if ( name_clash )
+		return;
+	    while ( target && target->link )
+		target = target->link;
+	    if ( ! target || (target->mode & IFMT) == IFDIR ) {
+		printf ( "Link to nothing we have, skipped: %s -> %s\n", name, link );
+		return;
+	    }
+	    np = tar_lookup ( name, 1, target->mode );
+	    if ( name_clash || ! np || np == target )
+		return;
+	    np->mode = target->mode;
+	    np->link = target;
+	    return;
+
+	case '3':
+	case '4':
+	    np = tar_lookup ( name, 1, (type == '3' ? IFCHR : IFBLK) | mode );
+	    if ( name_clash )
+		return;
+	    if ( ! np ) {
+		printf ( "Cannot make device: %s\n", name );
+		return;
+	    }
+	    np->mode = (type == '3' ? IFCHR : IFBLK) | mode;
+	    np->rdev = (tar_num ( (char *) &hp[329], 8 ) & 0xff) << 8 |
+		(tar_num ( (char *) &hp[337], 8 ) & 0xff);
+	    break;
+
+	default:
+	    /* V7 has no symlinks (type 2), or fifos */
+	    printf ( "Skipped (tar type %c): %s\n", type, name );
+	    return;
+	}
+
+	np->uid = xp->uid >= 0 ? xp->uid : tar_num ( (char *) &hp[108], 8 );
+	np->gid = xp->gid >= 0 ? xp->gid : tar_num ( (char *) &hp[116], 8 );
+	set_times ( np, xp->atime >= 0 ? xp->atime : mtime, mtime );
+}
+
+/* The archive is read into memory whole, file data stays right there */
+static void
+read_tar ( char *path )
+{
+	struct tar_ext x;
+	struct stat st;
+	u_char *tar;
+	u_char *hp;
+	long size;
+	long pos;
+	int type;
+
+	tar = read_file_all ( path, &st );
+
+	ext_clear ( &x );
+	for ( pos = 0; pos + BSIZE <= st.st_size; ) {
+	    hp = &tar[pos];
+	    if ( memcmp ( hp, zero_block, BSIZE ) == 0 )
+		break;
+
+	    type = hp[156];
+	    size = tar_num ( (char *) &hp[124], 12 );
+	    if ( x.size >= 0 && type != 'x' )
+		size = x.size;
+	    if ( pos + BSIZE + size > st.st_size )
+		error ( "tar archive is cut short" );
+
+	    if ( type == 'x' ) {
+		pax_parse ( (char *) &tar[pos + BSIZE], size, &x );
+	    } else if ( type == 'L' ) {
+		ext_string ( x.path, (char *) &tar[pos + BSIZE], strnlen ( (char *) &tar[pos + BSIZE], size ) );
+	    } else if ( type == 'K' ) {
+		ext_string ( x.link, (char *) &tar[pos + BSIZE], strnlen ( (char *) &tar[pos + BSIZE], size ) );
+	    } else if ( type != 'g' ) {
+		tar_entry ( hp, &tar[pos + BSIZE], size, &x );
+		ext_clear ( &x );
+	    }
+
+	    /* hard links and such have no data, whatever size says */
+	    if ( type == '1' || type == '2' || type == '3' || type == '4' || type == '5' )
+		size = 0;
+	    pos += BSIZE + (size + BSIZE - 1) / BSIZE * BSIZE;
+	}
+}
+
+/* ----------------------------- */
+/* Laying it out */
+
+static struct node *
+inode_of ( struct node *np )
+{
+	while ( np->link )
+	    np = np->link;
+	return np;
+}
+
+/* Inode numbers in the order of the walk, all the entries in a
+ * directory get theirs together.  Also the link counts.
+ */
+static void
+number ( struct node *dp )
+{
+	struct node *np;
+
+	for ( np = dp->kids; np; np = np->next ) {
+	    if ( np->link ) {
+		inode_of ( np )->nlink++;
+		continue;
+	    }
+	    np->ino = next_ino++;
+	    np->nlink++;
+	    if ( (np->mode & IFMT) == IFDIR ) {
+		np->nlink++;		/* its "." */
+		dp->nlink++;		/* its ".." */
+	    }
+	}
+
+	for ( np = dp->kids; np; np = np->next )
+	    if ( ! np->link && (np->mode & IFMT) == IFDIR )
+		number ( np );
+}
+
+static int
+has_data ( u_char *data, u_int size, int lbn, int count )
+{
+	u_int off;
+	int len;
+
+	if ( ! data )
+	    return 0;
+	for ( ; count > 0; lbn++, count-- ) {
+	    off = lbn * BSIZE;
+	    if ( off >= size )
+		break;
+	    len = size - off < BSIZE ? size - off : BSIZE;
+	    if ( memcmp ( &data[off], zero_block, len ) )
+		return 1;
+	}
+	return 0;
+}
+
+static u_int
+data_block ( u_char *data, u_int size, int lbn )
+{
+	u_int block;
+	u_int off;
+	int len;
+
+	if ( ! has_data ( data, size, lbn, 1 ) )
+	    return 0;
+
+	block = next_block++;
+	if ( img ) {
+	    off = lbn * BSIZE;
+	    len = size - off < BSIZE ? size - off : BSIZE;
+	    memcpy ( &img[block * BSIZE], &data[off], len );
+	}
+	return block;
+}
+
+/* An indirect block goes down first, then what it maps.
+ * One that would map nothing but holes isn't needed.
+ */
+static u_int
+place_indir ( u_char *data, u_int size, int *lbn, int nblocks, int level )
+{
+	u_int addr[NINDIR];
+	u_int block;
+	int span;
+	int i;
+
+	for ( span = 1, i = 0; i < level; i++ )
+	    span *= NINDIR;
+	if ( ! has_data ( data, size, *lbn, span ) ) {
+	    *lbn += span;
+	    return 0;
+	}
+
+	block = next_block++;
+	memset ( addr, 0, sizeof(addr) );
+	for ( i=0; i<NINDIR && *lbn < nblocks; i++ ) {
+	    if ( level == 1 )
+		addr[i] = data_block ( data, size, (*lbn)++ );
+	    else
+		addr[i] = place_indir ( data, size, lbn, nblocks, level-1 );
+	}
+
+	if ( img )
+	    for ( i=0; i<NINDIR; i++ )
+		((u_int *) &img[block * BSIZE])[i] = htonl ( addr[i] );
+	return block;
+}
+
+static void
+place ( struct node *np, u_char *data, u_int size )
+{
+	int nblocks;
+	int lbn;
+	int i;
+
+	memset ( np->addr, 0, sizeof(np->addr) );
+	nblocks = (size + BSIZE - 1) / BSIZE;
+
+	lbn = 0;
+	for ( i=0; i<NDADDR && lbn < nblocks; i++ )
+	    np->addr[i] = data_block ( data, size, lbn++ );
+	for ( i=0; i<3 && lbn < nblocks; i++ )
+	    np->addr[NDADDR+i] = place_indir ( data, size, &lbn, nblocks, i+1 );
+}
+
+static void
+place_dir ( struct node *dp )
+{
+	struct direct *dir;
+	struct node *np;
+	int count;
+	int i;
+
+	count = 2;
+	for ( np = dp->kids; np; np = np->next )
+	    count++;
+
+	dir = calloc ( count, sizeof(struct direct) );
+	if ( ! dir )
+	    error ( "out of memory for directory" );
+	dir[0].d_ino = htons ( dp->ino );
+	strcpy ( dir[0].d_name, "." );
+	dir[1].d_ino = htons ( dp->parent ? dp->parent->ino : dp->ino );
+	strcpy ( dir[1].d_name, ".." );
+	i = 2;
+	for ( np = dp->kids; np; np = np->next ) {
+	    dir[i].d_ino = htons ( inode_of ( np )->ino );
+	    strncpy ( dir[i].d_name, np->name, DIRSIZ );
+	    i++;
+	}
+
+	dp->size = count * sizeof(struct direct);
+	place ( dp, (u_char *) dir, dp->size );
+	free ( dir );
+}
+
+/* A directory, then the files in it, then its subdirectories */
+static void
+lay_out ( struct node *dp )
+{
+	struct node *np;
+
+	place_dir ( dp );
+	for ( np = dp->kids; np; np = np->next )
+	    if ( ! np->link && (np->mode & IFMT) == IFREG )
+		place ( np, np->data, np->size );
+	for ( np = dp->kids; np; np = np->next )
+	    if ( ! np->link && (np->mode & IFMT) == IFDIR )
+		lay_out ( np );
+}
+
+static void
+put_inode ( struct node *np )
+{
+	struct dinode *dp;
+	u_int addr;
+	int i;
+
+	dp = &((struct dinode *) &img[INODE_OFFSET * BSIZE])[np->ino - 1];
+	dp->di_mode = htons ( np->mode );
+	dp->di_nlink = htons ( np->nlink );
+	dp->di_uid = htons ( np->uid );
+	dp->di_gid = htons ( np->gid );
+	dp->di_atime = htonl ( np->atime );
+	dp->di_mtime = htonl ( np->mtime );
+	dp->di_ctime = htonl ( np->mtime );
+
+	if ( (np->mode & IFMT) == IFCHR || (np->mode & IFMT) == IFBLK ) {
+	    dp->di_size = 0;
+	    np->addr[0] = np->rdev;
+	} else
+	    dp->di_size = htonl ( np->size );
+
+	for ( i=0; i<NUM_INODE_ADDR; i++ ) {
+	    addr = np->addr[i];
+	    dp->di_addr[3*i] = addr >> 16;
+	    dp->di_addr[3*i+1] = addr >> 8;
+	    dp->di_addr[3*i+2] = addr;
+	}
+}
+
+static void
+put_inodes ( struct node *dp )
+{
+	struct node *np;
+
+	for ( np = dp->kids; np; np = np->next ) {
+	    if ( np->link )
+		continue;
+	    put_inode ( np );
+	    if ( (np->mode & IFMT) == IFDIR )
+		put_inodes ( np );
+	}
+}
+
+/* The free list, so that blocks get handed out lowest first.
+ * The kernel takes free[--nfree], and when it gets to free[0]
+ * it reads the next 50 from that block (then hands it out too).
+ * So each bunch goes in backwards, and the link to the next bunch
+ * is the block right after it.
+ */
+static void
+free_list ( struct super *sp, u_int first, u_int fsize )
+{
+	u_int list[NICFREE];
+	u_int *lp;
+	u_int block;
+	int n;
+	int i;
+
+	lp = NULL;
+	block = first;
+	for ( ;; ) {
+	    n = fsize - block < NICFREE - 1 ? fsize - block : NICFREE - 1;
+	    memset ( list, 0, sizeof(list) );
+	    for ( i=0; i<n; i++ )
+		list[n-i] = block + i;
+	    block += n;
+	    list[0] = block < fsize ? block++ : 0;
+
+	    if ( ! lp ) {
+		sp->nfree = htons ( n + 1 );
+		for ( i=0; i<NICFREE; i++ )
+		    sp->free[i] = htonl ( list[i] );
+	    } else {
+		lp[0] = htonl ( n + 1 );
+		for ( i=0; i<NICFREE; i++ )
+		    lp[i+1] = htonl ( list[i] );
+	    }
+
+	    if ( ! list[0] )
+		break;
+	    lp = (u_int *) &img[list[0] * BSIZE];
+	}
+}
+
+/* ----------------------------- */
+
+static void
+write_image ( char *path, int cyl, u_int fsize )
+{
+	off_t pos;
+	size_t left;
+	ssize_t n;
+	u_char *p;
+	int fd;
+
+	if ( cyl >= 0 )
+	    fd = open ( path, O_WRONLY | O_CREAT, 0644 );
+	else
+	    fd = open ( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 )
+	    error ( "cannot create image" );
+
+	pos = cyl >= 0 ? (off_t) cyl * CYL_BLOCKS * BSIZE : 0;
+	p = img;
+	for ( left = (size_t) fsize * BSIZE; left > 0; left -= n ) {
+	    n = pwrite ( fd, p, left, pos );
+	    if ( n <= 0 )
+		error ( "cannot write image" );
+	    p += n;
+	    pos += n;
+	}
+	if ( close ( fd ) )
+	    error ( "cannot write image" );
+}
+
+static void
+usage ( void )
+{
+	fprintf ( stderr, "Usage: ufs_mkfs [-b blocks] [-i inodes] [-c cyl] [-p n] image dir|file.tar\n" );
+	exit ( 1 );
+}
+
+int
+main ( int argc, char **argv )
+{
+	struct super *sp;
+	struct stat st;
+	u_int fsize = 0;
+	u_int need;
+	int inodes = 0;
+	int used;
+	int isize;
+	int cyl = -1;
+	int i;
+
+	argc--;
+	argv++;
+
+	for ( ; argc > 0 && argv[0][0] == '-' && argv[0][1]; argc--, argv++ ) {
+	    if ( argc < 2 )
+		usage ();
+	    if ( strcmp ( argv[0], "-b" ) == 0 )
+		fsize = atoi ( argv[1] );
+	    else if ( strcmp ( argv[0], "-i" ) == 0 )
+		inodes = atoi ( argv[1] );
+	    else if ( strcmp ( argv[0], "-c" ) == 0 )
+		cyl = atoi ( argv[1] );
+	    else if ( strcmp ( argv[0], "-p" ) == 0 )
+		strip = atoi ( argv[1] );
+	    else
+		usage ();
+	    argc--;
+	    argv++;
+	}
+	if ( argc != 2 )
+	    usage ();
+
+	root = new_node ( NULL, "", IFDIR | 0755 );
+	if ( stat ( argv[1], &st ) )
+	    error ( "cannot find the tree to copy" );
+	if ( S_ISDIR ( st.st_mode ) ) {
+	    root->mode = IFDIR | (st.st_mode & 07777);
+	    root->uid = st.st_uid;
+	    root->gid = st.st_gid;
+	    set_times ( root, st.st_atime, st.st_mtime );
+	    read_dir ( root, argv[1] );
+	} else
+	    read_tar ( argv[1] );
+
+	/* Inode 1 was for bad blocks, it stays empty */
+	next_ino = ROOT_INO;
+	root->ino = next_ino++;
+	root->nlink = 2;
+	number ( root );
+	used = next_ino - 1;
+
+	if ( ! inodes )
+	    inodes = used + used / 4 + 16;
+	inodes = (inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+	if ( inodes < used )
+	    error ( "not enough inodes" );
+	if ( inodes > 65535 )
+	    error ( "too many inodes for V7" );
+	isize = INODE_OFFSET + inodes / INODES_PER_BLOCK;
+
+	/* Once just to count, then for real */
+	next_block = isize;
+	lay_out ( root );
+	need = next_block;
+
+	if ( ! fsize ) {
+	    fsize = need + need / 10;
+	    fsize = (fsize + CYL_BLOCKS - 1) / CYL_BLOCKS * CYL_BLOCKS;
+	}
+	if ( fsize < need ) {
+	    printf ( "Needs %u blocks\n", need );
+	    error ( "filesystem too small" );
+	}
+	if ( fsize >= (1 << 24) )
+	    error ( "too big for 3 byte block addresses" );
+
+	img = calloc ( fsize, BSIZE );
+	if ( ! img )
+	    error ( "out of memory for image" );
+
+	next_block = isize;
+	lay_out ( root );
+	put_inode ( root );
+	put_inodes ( root );
+
+	sp = (struct super *) &img[BSIZE];
+	sp->isize = htons ( isize );
+	sp->fsize = htonl ( fsize );
+	free_list ( sp, need, fsize );
+	sp->ninode = 0;
+	for ( i = used + 1; i <= inodes && sp->ninode < NICINOD; i++ )
+	    sp->inode[sp->ninode++] = htons ( i );
+	sp->ninode = htons ( sp->ninode );
+	sp->time = htonl ( newest );
+	sp->tfree = htonl ( fsize - need );
+	sp->tinode = htons ( inodes - used );
+
+	write_image ( argv[0], cyl, fsize );
+
+	printf ( "%s: %u blocks (%u cylinders), %d inodes (%d used), %u blocks used, %u free\n",
+	    argv[0], fsize, (fsize + CYL_BLOCKS - 1) / CYL_BLOCKS, inodes, used - 1,
+	    need - isize, fsize - need );
+	if ( cyl >= 0 )
+	    printf ( "Written at cylinder %d (block %d)\n", cyl, cyl * CYL_BLOCKS );
+	return 0;
+}
+
+void
+error ( char *msg )
+{
+	fprintf ( stderr, "Error: %s\n", msg );
+	exit ( 1 );
+}
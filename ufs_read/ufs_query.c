@@ -0,0 +1,375 @@
+/* ufs_query.c
+ *
+ * ufs_query - ask a ufs_read --serve about the image it has open.
+ *
+ * ufs_query [-s socket] [-p part] stat|ls|cat|find args
+ *
+ *  stat path ...		inode, mode, owner, size and times
+ *  ls [-l] [-a] [path ...]	like the ls command in ufs_read
+ *  cat path ...
+ *  find path [pattern]		everything under path (whose name matches)
+ *
+ * The socket is ufs_read.sock unless -s says otherwise.  Without -p
+ * a path under /usr is in partition b, anything else in a.
+ * See serve.h for what goes over the socket.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ufs.h"
+#include "serve.h"
+
+static int sock;
+static int part = -1;
+
+void
+error ( char *msg )
+{
+	fprintf ( stderr, "Error: %s\n", msg );
+	exit ( 1 );
+}
+
+static void
+usage ( void )
+{
+	fprintf ( stderr, "Usage: ufs_query [-s socket] [-p part] stat|ls|cat|find args\n" );
+	exit ( 1 );
+}
+
+static void
+read_all ( void *buf, int n )
+{
+	int s;
+
+	while ( n > 0 ) {
+	    s = read ( sock, buf, n );
+	    if ( s <= 0 )
+		error ( "lost the server" );
+	    buf = (char *) buf + s;
+	    n -= s;
+	}
+}
+
+static void
+write_all ( const void *buf, int n )
+{
+	int s;
+
+	while ( n > 0 ) {
+	    s = write ( sock, buf, n );
+	    if ( s <= 0 )
+		error ( "lost the server" );
+	    buf = (const char *) buf + s;
+	    n -= s;
+	}
+}
+
+/* Send one request and wait for the answer.
+ * The data (if any) is in a buffer that the next call reuses.
+ * Returns 0 or the errno from the server.
+ */
+static int
+ask ( int op, int inode, int ipart, u_int off, u_int count, char *path, int plen, u_char **datap, int *lenp )
+{
+	static u_char *data;
+	static int max;
+	struct serve_req req;
+	struct serve_rep rep;
+
+	if ( plen > SERVE_MAX_PATH )
+	    return ENAMETOOLONG;
+
+	req.op = op;
+	req.part = inode ? ipart : part;
+	req.inode = inode;
+	req.offset = off;
+	req.count = count;
+	req.len = plen;
+	write_all ( &req, sizeof(req) );
+	write_all ( path, plen );
+
+	read_all ( &rep, sizeof(rep) );
+	if ( rep.len > max ) {
+	    max = rep.len;
+	    data = realloc ( data, max );
+	    if ( ! data )
+		error ( "out of memory" );
+	}
+	read_all ( data, rep.len );
+
+	if ( datap )
+	    *datap = data;
+	if ( lenp )
+	    *lenp = rep.len;
+	return rep.error;
+}
+
+static int
+complain ( char *path, int err )
+{
+	fprintf ( stderr, "%s: %s\n", path, strerror ( err ) );
+	return 1;
+}
+
+static int
+get_stat ( char *path, struct serve_stat *sp )
+{
+	u_char *data;
+	int err;
+
+	err = ask ( SERVE_STAT, 0, 0, 0, 0, path, strlen ( path ), &data, NULL );
+	if ( ! err )
+	    memcpy ( sp, data, sizeof(*sp) );
+	return err;
+}
+
+static void
+mode_string ( char *buf, int mode )
+{
+	static char *rwx = "rwxrwxrwx";
+	int i;
+
+	switch ( mode & IFMT ) {
+	    case IFDIR: buf[0] = 'd'; break;
+	    case IFCHR: buf[0] = 'c'; break;
+	    case IFBLK: buf[0] = 'b'; break;
+	    case IFMPC:
+	    case IFMPB: buf[0] = 'm'; break;
+	    default: buf[0] = '-'; break;
+	}
+
+	for ( i=0; i<9; i++ )
+	    buf[i+1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+
+	if ( mode & ISUID )
+	    buf[3] = (mode & IEXEC) ? 's' : 'S';
+	if ( mode & ISGID )
+	    buf[6] = (mode & (IEXEC>>3)) ? 's' : 'S';
+	if ( mode & ISVTX )
+	    buf[9] = (mode & (IEXEC>>6)) ? 't' : 'T';
+	buf[10] = '\0';
+}
+
+static void
+ls_one ( struct serve_stat *sp, char *name, int lflag )
+{
+	char mode[12];
+	char date[32];
+	time_t t;
+	int type;
+
+	if ( ! lflag ) {
+	    printf ( "%s\n", name );
+	    return;
+	}
+
+	mode_string ( mode, sp->mode );
+	t = sp->mtime;
+	strftime ( date, sizeof(date), "%b %e %H:%M %Y", localtime ( &t ) );
+
+	type = sp->mode & IFMT;
+	if ( type == IFCHR || type == IFBLK || type == IFMPC || type == IFMPB )
+	    printf ( "%s %2d %3d %3d %4d,%3d %s %s\n", mode, sp->nlink, sp->uid, sp->gid,
+		(sp->rdev >> 8) & 0xff, sp->rdev & 0xff, date, name );
+	else
+	    printf ( "%s %2d %3d %3d %8d %s %s\n", mode, sp->nlink, sp->uid, sp->gid,
+		sp->size, date, name );
+}
+
+static int
+ls_compare ( const void *a, const void *b )
+{
+	return strcmp ( ((struct serve_stat *) a)->name, ((struct serve_stat *) b)->name );
+}
+
+static int
+do_ls ( char *path, int lflag, int aflag )
+{
+	struct serve_stat st;
+	struct serve_stat *list;
+	u_char *data;
+	int len;
+	int err;
+	int n, i;
+
+	if ( err = get_stat ( path, &st ) )
+	    return complain ( path, err );
+	if ( (st.mode & IFMT) != IFDIR ) {
+	    ls_one ( &st, path, lflag );
+	    return 0;
+	}
+
+	if ( err = ask ( SERVE_READDIR, st.inode, st.part, 0, 0, path, strlen ( path ), &data, &len ) )
+	    return complain ( path, err );
+
+	list = malloc ( len + 1 );
+	if ( ! list )
+	    error ( "out of memory" );
+	memcpy ( list, data, len );
+	n = len / sizeof(struct serve_stat);
+	qsort ( list, n, sizeof(struct serve_stat), ls_compare );
+
+	for ( i=0; i<n; i++ )
+	    if ( aflag || list[i].name[0] != '.' )
+		ls_one ( &list[i], list[i].name, lflag );
+	free ( list );
+	return 0;
+}
+
+static int
+do_stat ( char *path )
+{
+	struct serve_stat st;
+	char mode[12];
+	char date[32];
+	time_t t;
+	int err;
+
+	if ( err = get_stat ( path, &st ) )
+	    return complain ( path, err );
+
+	mode_string ( mode, st.mode );
+	printf ( "%s: inode %d in %c, %s (%06o), %d links, uid %d gid %d, %d bytes\n",
+	    path, st.inode, 'a' + st.part, mode, st.mode, st.nlink, st.uid, st.gid, st.size );
+	t = st.mtime;
+	strftime ( date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime ( &t ) );
+	printf ( "  modified %s", date );
+	t = st.atime;
+	strftime ( date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime ( &t ) );
+	printf ( ", accessed %s", date );
+	t = st.ctime;
+	strftime ( date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime ( &t ) );
+	printf ( ", changed %s\n", date );
+	return 0;
+}
+
+static int
+do_cat ( char *path )
+{
+	struct serve_stat st;
+	u_char *data;
+	u_int off;
+	int len;
+	int err;
+
+	if ( err = get_stat ( path, &st ) )
+	    return complain ( path, err );
+
+	for ( off = 0; off < st.size; off += len ) {
+	    err = ask ( SERVE_READ, st.inode, st.part, off, SERVE_MAX_READ, path, 0, &data, &len );
+	    if ( err )
+		return complain ( path, err );
+	    if ( len == 0 )
+		break;
+	    fwrite ( data, 1, len, stdout );
+	}
+	return 0;
+}
+
+static int
+do_find ( char *path, char *pattern )
+{
+	char buf[SERVE_MAX_PATH+1];
+	u_char *data;
+	char *p;
+	int plen;
+	int len;
+	int err;
+
+	plen = strlen ( path );
+	if ( plen + strlen ( pattern ) + 1 > SERVE_MAX_PATH )
+	    return complain ( path, ENAMETOOLONG );
+	strcpy ( buf, path );
+	strcpy ( &buf[plen+1], pattern );
+
+	err = ask ( SERVE_FIND, 0, 0, 0, 0, buf, plen + 1 + strlen ( pattern ), &data, &len );
+	if ( err )
+	    return complain ( path, err );
+
+	for ( p = (char *) data; p < (char *) data + len; p += strlen ( p ) + 1 )
+	    printf ( "%s\n", p );
+	return 0;
+}
+
+int
+main ( int argc, char **argv )
+{
+	struct sockaddr_un addr;
+	char *sock_path = "ufs_read.sock";
+	char *cmd;
+	int lflag = 0;
+	int aflag = 0;
+	int npath = 0;
+	int rv = 0;
+	int i;
+	char *p;
+
+	argc--;
+	argv++;
+
+	for ( ; argc > 0 && argv[0][0] == '-'; argc--, argv++ ) {
+	    if ( argc < 2 )
+		usage ();
+	    if ( strcmp ( argv[0], "-s" ) == 0 )
+		sock_path = argv[1];
+	    else if ( strcmp ( argv[0], "-p" ) == 0 )
+		part = argv[1][0] - 'a';
+	    else
+		usage ();
+	    argc--;
+	    argv++;
+	}
+	if ( argc < 1 )
+	    usage ();
+	cmd = argv[0];
+
+	memset ( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	if ( strlen ( sock_path ) >= sizeof(addr.sun_path) )
+	    error ( "socket path is too long" );
+	strcpy ( addr.sun_path, sock_path );
+	sock = socket ( AF_UNIX, SOCK_STREAM, 0 );
+	if ( sock < 0 || connect ( sock, (struct sockaddr *) &addr, sizeof(addr) ) < 0 )
+	    error ( "cannot reach the server (is ufs_read --serve running?)" );
+
+	if ( strcmp ( cmd, "find" ) == 0 ) {
+	    if ( argc < 2 || argc > 3 )
+		usage ();
+	    return do_find ( argv[1], argc > 2 ? argv[2] : "" );
+	}
+
+	for ( i=1; i<argc; i++ ) {
+	    if ( argv[i][0] == '-' && strcmp ( cmd, "ls" ) == 0 ) {
+		for ( p = &argv[i][1]; *p; p++ ) {
+		    if ( *p == 'l' )
+			lflag = 1;
+		    else if ( *p == 'a' )
+			aflag = 1;
+		}
+		continue;
+	    }
+
+	    npath++;
+	    if ( strcmp ( cmd, "stat" ) == 0 )
+		rv |= do_stat ( argv[i] );
+	    else if ( strcmp ( cmd, "ls" ) == 0 )
+		rv |= do_ls ( argv[i], lflag, aflag );
+	    else if ( strcmp ( cmd, "cat" ) == 0 )
+		rv |= do_cat ( argv[i] );
+	    else
+		usage ();
+	}
+
+	/* ls with no path lists the top */
+	if ( strcmp ( cmd, "ls" ) == 0 && npath == 0 )
+	    rv |= do_ls ( "/", lflag, aflag );
+
+	return rv;
+}
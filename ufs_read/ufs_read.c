@@ -25,14 +25,13 @@
  *  We really don't need (or even want) the special files themselves.
  *
  * links - what do we do here?
- *  I intend to convert hard links to symbolic links.
- *  The way to do this is to keep an eye open for a link count
- *  that is not "1".  The first time it is encountered, just
- *  copy the file contents like any other, but add an entry to
- *  a table.  This table will be searched for all such subsequent
- *  encounters, and when it finds the contents already have been
- *  copied, it will make the symbolic link.  This means that the
- *  first link encountered will become the "hard name".
+ *  We keep an eye open for a link count that is not "1".
+ *  The first time it is encountered, just copy the file contents
+ *  like any other, but add an entry to a table.  This table is
+ *  searched for all such subsequent encounters, and when it finds
+ *  the contents already have been copied, it makes a hard link
+ *  (or a link entry in a tar archive).  The first link encountered
+ *  gets the data, the others are links to it.
  *
  * -----------------------------------------------
  *
@@ -72,6 +71,11 @@
  *  Blocks 12512-17407  swap		 36 cylinders, 4896 blocks
  *  Blocks 17408-43519  partition "b"	192 cylinders, 26112 blocks
  *
+ * These days we don't need the notes, we find the partitions by
+ * looking for a superblock at the start of each cylinder (see
+ * find_parts).  That finds the same two, and would work for some
+ * other V7 disk image.
+ *
  * There are 304 files on the root partition.
  * There are 1810 files on the usr partition.
  * 
@@ -79,6 +83,7 @@
  * be removed soon after extraction.
  */
 
+#define _GNU_SOURCE	/* for copy_file_range */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -86,153 +91,90 @@
 #include <fcntl.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 //#include <endian.h>
 #include <arpa/inet.h>
 
-typedef unsigned char u_char;
-typedef unsigned short u_short;
-typedef unsigned int u_int;
-
-char *disk_path = "callan.img";
-
-int disk_fd;
-
-#define BSIZE		512
-
-#define OFFSET_A	136
-#define SIZE_A		12376
-#define LIMIT_A		20000
-
-#define OFFSET_B	17408
-#define SIZE_B		26112
-#define LIMIT_B		24208
-
-void error ( char * );
-void dump_fs ( char *, int, int, int );
-
-/* ----------------------------- */
-/* Data structures */
-
-/* From:
- *  include/sys/filsys.h
- *  include/sys/param.h
- *  include/sys/types.h
- *  include/sys/ino.h
+#include "ufs.h"
+#include "sha256.h"
+#include "source.h"
+#include "serve.h"
 
+/* On x86 we can byte swap a block (and unpack the 3 byte inode
+ * addresses) with pshufb, if the cpu has it.  See simd_init.
  */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_SIMD
+#endif
 
-/* ino_t conflicts with linux headers */
-typedef	unsigned short	xino_t;     	/* i-node number */
-typedef	unsigned int	xoff_t;
-typedef	unsigned int	xtime_t;
+char *disk_path = "callan.img";
 
-/* These are in core "caches" not relevant to us.
- * but they do take up space in the super block
- */
-#define NICFREE 50
-#define NICINOD 100             /* number of superblock inodes */
+/* The image, a plain one, gzipped, or a sector log */
+static struct source *disk;
 
-/* Don't ask me what inode 1 is for.
- * No doubt 0 is reserved for "nobody home here"
+/* Cylinders past 305 could not be read on the Callan disk,
+ * blocks out there in any partition are suspect.  That is only
+ * true of the Callan, so the cutoff is used when the image is
+ * its size (320 cylinders), or when -g gives one for some other
+ * image (-g 0 for none).  Otherwise a partition's limit is its size.
  */
-#define ROOT_INO	2
+#define CALLAN_BLOCKS	(320 * CYL_BLOCKS)
+#define CALLAN_GOOD	306
 
-/* Note that in these ancient days, the super block had no magic number.
- * You just had to know where it was.
- */
-struct __attribute__((__packed__)) super
-{
-    u_short	isize;
-    u_int	fsize;	/* size in blocks */
-    u_short	nfree;
-    u_int	free[NICFREE];
-    u_short	ninode;
-    xino_t	inode[NICINOD];
-    u_int	stuff;
-    xtime_t	time;
-    char	_extra[512];
-};
+int good_cyls = -1;
 
-/* This is 64 bytes, so you can fit 8 of these in a block.
+/* The partitions we found on the disk, a, b, ... in order.
  */
-struct __attribute__((__packed__)) dinode
-{
-        unsigned short  di_mode;        /* mode and type of file */
-        short   di_nlink;       /* number of links to file */
-        short   di_uid;         /* owner's user id */
-        short   di_gid;         /* owner's group id */
-        xoff_t   di_size;        /* number of bytes in file */
-        u_char    di_addr[40];    /* disk block addresses */
-        xtime_t  di_atime;       /* time last accessed */
-        xtime_t  di_mtime;       /* time last modified */
-        xtime_t  di_ctime;       /* time created */
-};
+#define MAX_PARTS	8
 
-#define INODES_PER_BLOCK	(BSIZE / sizeof (struct dinode))
+struct partition {
+	int offset;
+	int size;
+	int limit;	/* blocks at or past this are suspect */
+	char dir[16];	/* where we extract it */
+};
 
-/* We get 13 addresses of 3 bytes each (and an extra byte) */
+struct partition parts[MAX_PARTS];
+int num_parts;
 
-/* modes - in octal of all things, but I am too lazy to
- * convert to text, and I might make errors.
- */
-#define IFMT    0170000         /* type of file */
-#define         IFDIR   0040000 /* directory */
-#define         IFCHR   0020000 /* character special */
-#define         IFBLK   0060000 /* block special */
-#define         IFREG   0100000 /* regular */
-#define         IFMPC   0030000 /* multiplexed char special */
-#define         IFMPB   0070000 /* multiplexed block special */
-#define ISUID   04000           /* set user id on execution */
-#define ISGID   02000           /* set group id on execution */
-#define ISVTX   01000           /* save swapped text even after use */
-#define IREAD   0400            /* read, write, execute permissions */
-#define IWRITE  0200
-#define IEXEC   0100
+void error ( char * );
+void dump_fs ( char *, int, int, int );
+void open_fs ( int, int, int );
+void find_parts ( void );
+int run_command ( int, char **, int );
+int diff_images ( char *, int );
 
-/* I nodes begin at block 2 in the filesystem.
- */
-#define INODE_OFFSET	2
+/* Set to 0 when we are just looking at a file or two */
+int verbose = 1;
 
-/* These were the days!  14 byte filename limits.
- *  note that there is no guarantee of a null terminator.
- * So directory entries were 16 bytes
- *  and you could get 32 of them in a block
- */
-#define DIRSIZ  14
-struct  direct
-{
-        xino_t   d_ino;
-        char    d_name[DIRSIZ];
-};
+/* ----------------------------- */
+/* Data structures, the ones on the disk are in ufs.h */
 
 struct mem_direct {
     int		inode;
     char	name[16];
 };
 
-
-#define DIRECT_PER_BLOCK	(BSIZE / sizeof(struct direct))
-
-/* The only disk inode stores disk addresses in 3 bytes */
-#define NUM_INODE_ADDR		13
-#define BYTES_INODE_ADDR	(NUM_INODE_ADDR * 3)
-
 /* We scanned the filesystem and found the biggest file is
  * on the second filesystem.
  * It is ./tmp/floppy_image of size 630784 bytes.
  * This requires 1232 blocks.
- * When I "fix" the inode (convert the disk data structure
- * to an in-memory data structure).  I expand the indirect
- * and double indirect blocks, so that I have just
- * a simple linear list.
- * No files exist on this disk that require a triple
- * indirect block.
+ * I used to expand the indirect and double indirect blocks
+ * into a simple linear list of 1600 addresses when "fixing"
+ * the inode.  Now the 13 addresses are kept as is and bmap()
+ * looks up a block when somebody actually wants it.
+ * A zero from bmap is a hole in the file.
  */
-
-#define MAX_INODE_ADDR		1600
-
 struct mem_inode
 {
         int   mode;        /* mode and type of file */
@@ -240,13 +182,30 @@ struct mem_inode
         int   uid;         /* owner's user id */
         int   gid;         /* owner's group id */
         int   size;        /* number of bytes in file */
-        // u_int   addr[NUM_INODE_ADDR];
-        u_int   addr[MAX_INODE_ADDR];
-	int bcount;
+        u_int   addr[NUM_INODE_ADDR];
+	int bcount;		/* blocks in the file (by size) */
+	int number;		/* inode number */
+	char *path;		/* for BAD BLOCK messages */
         time_t  atime;       /* time last accessed */
         time_t  mtime;       /* time last modified */
         time_t  ctime;       /* time created */
-	struct dinode orig;	/* XXX copy */
+};
+
+/* The whole inode table gets decoded into an array of these
+ * when we start on a filesystem.  All 13 addresses are kept
+ * as they are (zeros included), indirect blocks are not expanded.
+ */
+struct core_inode
+{
+	int	mode;
+	int	nlink;
+	int	uid;
+	int	gid;
+	int	size;
+	u_int	addr[NUM_INODE_ADDR];
+	time_t	atime;
+	time_t	mtime;
+	time_t	ctime;
 };
 
 
@@ -260,6 +219,10 @@ static int num_files;
 
 struct super sb;
 
+/* Indexed by inode number, entry 0 is not used */
+static struct core_inode *itable;
+static int num_inodes;
+
 /* ----------------------------- */
 /* ----------------------------- */
 
@@ -271,14 +234,45 @@ disk_offset ( int a_off, int a_size, int a_limit )
     limit = a_limit;
 }
 
+/* Get the image ready for disk_block().
+ * See source.c for the kinds of image we can read.
+ */
 void
-disk_read ( u_char *buf, int num )
+disk_open ( char *path )
 {
-    int block;
+    disk = source_open ( path, verbose );
+}
 
-    block = offset + num;
-    lseek ( disk_fd, block*BSIZE, SEEK_SET );
-    read ( disk_fd, buf, BSIZE );
+/* Return a pointer to a block in the current partition.
+ * When the image is mapped, this points right into it.
+ * Otherwise it is one of a ring of buffers (filled from
+ * the block cache), and it stays good
+ * until NUM_PREAD more blocks have been asked for
+ * (by the same thread, each copier thread has its own ring).
+ */
+#define NUM_PREAD	16
+
+const u_char *
+disk_block ( int num )
+{
+    static __thread u_char pread_buf[NUM_PREAD][BSIZE];
+    static __thread int pread_next;
+    static u_char zero_block[BSIZE];
+    off_t pos;
+    u_char *buf;
+
+    pos = (off_t) (offset + num) * BSIZE;
+    if ( num < 0 || pos + BSIZE > disk->size ) {
+	printf ( "Block %d is beyond the end of the image\n", num );
+	return zero_block;
+    }
+
+    if ( disk->base )
+	return &disk->base[pos];
+
+    buf = pread_buf[pread_next++ % NUM_PREAD];
+    source_read ( disk, buf, offset + num, 1 );
+    return buf;
 }
 
 #define CHOP	32
@@ -301,11 +295,8 @@ block_dump ( u_char *buf, int n )
 void
 block_show ( int block )
 {
-    u_char buf[BSIZE];
-
     printf ( "Block %d (%08x) ------------ -----------\n", block, block );
-    disk_read ( buf, block );
-    block_dump ( buf, BSIZE );
+    block_dump ( (u_char *) disk_block ( block ), BSIZE );
 }
 
 /* ----------------------------- */
@@ -352,49 +343,190 @@ f_sfix ( u_short val )
 
 /* While the disk addresses within the inode use 3 bytes each,
  * the addresses in indirect blocks are 4 byte objects.
+ * The block is in the (read only) image, so we fix a copy.
+ *
+ * Both of these get done in bulk, so there are vector versions
+ * for x86 along with the plain ones.  simd_init picks which
+ * to use, once, before any threads get going.
  */
-void
-fix_addr_block ( u_char *buf )
+static void
+swap_block_plain ( u_int *addr, const u_char *buf )
 {
-	u_int *ip;
-	u_int *ep;
+	const u_int *ip;
+	const u_int *ep;
 
-	ip = (u_int *) buf;
-	ep = (u_int *) &buf[BSIZE];
+	ip = (const u_int *) buf;
+	ep = (const u_int *) &buf[BSIZE];
 	for ( ; ip<ep; ip++ )
-	    if ( *ip )
-		ifix(ip);
+	    *addr++ = f_ifix ( *ip );
+}
+
+/* All 13 of them, from the 39 bytes in the disk inode */
+static void
+unpack_addr_plain ( u_int *addr, const u_char *u )
+{
+	int i;
+
+	for ( i=0; i<NUM_INODE_ADDR; i++, u += 3 )
+	    addr[i] = u[0]<<16 | u[1]<<8 | u[2];
+}
+
+#ifdef X86_SIMD
+__attribute__((target("ssse3")))
+static void
+swap_block_ssse3 ( u_int *addr, const u_char *buf )
+{
+	__m128i mask;
+	__m128i v;
+	int i;
+
+	mask = _mm_set_epi8 ( 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3 );
+	for ( i=0; i<BSIZE; i += 16 ) {
+	    v = _mm_loadu_si128 ( (const __m128i *) &buf[i] );
+	    _mm_storeu_si128 ( (__m128i *) &addr[i/4], _mm_shuffle_epi8 ( v, mask ) );
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+swap_block_avx2 ( u_int *addr, const u_char *buf )
+{
+	__m256i mask;
+	__m256i v;
+	int i;
+
+	mask = _mm256_set_epi8 ( 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+				 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3 );
+	for ( i=0; i<BSIZE; i += 32 ) {
+	    v = _mm256_loadu_si256 ( (const __m256i *) &buf[i] );
+	    _mm256_storeu_si256 ( (__m256i *) &addr[i/4], _mm256_shuffle_epi8 ( v, mask ) );
+	}
+}
+
+/* Four addresses (12 bytes) per shuffle, with a zero top byte.
+ * The three loads read bytes 0-39, di_addr has 40 of them.
+ */
+__attribute__((target("ssse3")))
+static void
+unpack_addr_ssse3 ( u_int *addr, const u_char *u )
+{
+	__m128i mask;
+	__m128i v;
+	int i;
+
+	mask = _mm_set_epi8 ( -1,9,10,11, -1,6,7,8, -1,3,4,5, -1,0,1,2 );
+	for ( i=0; i<12; i += 4 ) {
+	    v = _mm_loadu_si128 ( (const __m128i *) &u[i*3] );
+	    _mm_storeu_si128 ( (__m128i *) &addr[i], _mm_shuffle_epi8 ( v, mask ) );
+	}
+	u += 12 * 3;
+	addr[12] = u[0]<<16 | u[1]<<8 | u[2];
 }
+#endif
+
+static void (*swap_block) ( u_int *, const u_char * ) = swap_block_plain;
+static void (*unpack_addr) ( u_int *, const u_char * ) = unpack_addr_plain;
 
 void
-expand_indir ( int block, u_int *addr, int *count, int level )
+simd_init ( void )
 {
-	u_char buf[BSIZE];
-	u_int *ip;
-	u_int *ep;
+#ifdef X86_SIMD
+	__builtin_cpu_init ();
+	if ( __builtin_cpu_supports ( "ssse3" ) ) {
+	    swap_block = swap_block_ssse3;
+	    unpack_addr = unpack_addr_ssse3;
+	}
+	if ( __builtin_cpu_supports ( "avx2" ) )
+	    swap_block = swap_block_avx2;
+#endif
+}
 
-	disk_read ( buf, block );
-	fix_addr_block ( buf );
+void
+fix_addr_block ( u_int *addr, const u_char *buf )
+{
+	swap_block ( addr, buf );
+}
 
-	if ( level == 2 ) {
-	    ip = (u_int *) buf;
-	    ep = (u_int *) &buf[BSIZE];
-	    for ( ; ip<ep; ip++ )
-		if ( *ip )
-		    expand_indir ( *ip, addr, count, 1 );
+/* A small cache of indirect blocks, already byte swapped.
+ * Indexed by block number, so there is no searching.
+ * Block zero is never an indirect block, so an empty
+ * slot (block 0) never matches.
+ * Every thread gets its own cache, and new threads start empty.
+ */
+#define INDIR_CACHE	16
+
+struct indir_slot {
+	u_int block;
+	u_int addr[NINDIR];
+};
+
+static __thread struct indir_slot indir_cache[INDIR_CACHE];
+
+static void
+indir_flush ( void )
+{
+	memset ( indir_cache, 0, sizeof(indir_cache) );
+}
+
+static const u_int *
+get_indir ( u_int block )
+{
+	struct indir_slot *sp;
+
+	sp = &indir_cache[block % INDIR_CACHE];
+	if ( sp->block != block ) {
+	    fix_addr_block ( sp->addr, disk_block ( block ) );
+	    sp->block = block;
+	}
+	return sp->addr;
+}
+
+/* Map a logical block in a file to a disk block.
+ * Returns 0 for a hole (or a block past the end of the file).
+ */
+u_int
+bmap ( struct mem_inode *mp, int lbn )
+{
+	u_int block;
+	int span;
+	int level;
+	int i;
+
+	if ( lbn < 0 || lbn >= mp->bcount )
+	    return 0;
+
+	if ( lbn < NDADDR ) {
+	    block = mp->addr[lbn];
 	} else {
-	    ip = (u_int *) buf;
-	    ep = (u_int *) &buf[BSIZE];
-	    for ( ; ip<ep; ip++ )
-		if ( *ip ) {
-		    addr[*count] = *ip;
-		    (*count)++;
-		}
+	    /* Figure out how many levels of indirection */
+	    lbn -= NDADDR;
+	    span = NINDIR;
+	    for ( level = 1; level <= 3; level++ ) {
+		if ( lbn < span )
+		    break;
+		lbn -= span;
+		span *= NINDIR;
+	    }
+	    if ( level > 3 )
+		return 0;
+
+	    block = mp->addr[NDADDR + level - 1];
+	    for ( ; block && level > 0; level-- ) {
+		span /= NINDIR;
+		i = lbn / span;
+		lbn %= span;
+		block = get_indir ( block ) [i];
+	    }
 	}
+
+	if ( block >= (u_int) limit && mp->path )
+	    printf ( "BAD BLOCK: %d in %s\n", block, mp->path );
+
+	return block;
 }
 
 void
-fix_direct ( struct mem_direct *dp, struct direct *diskp )
+fix_direct ( struct mem_direct *dp, const struct direct *diskp )
 {
 	dp->inode = f_sfix ( diskp->d_ino );
 	strncpy ( dp->name, diskp->d_name, 14 );
@@ -405,13 +537,11 @@ fix_direct ( struct mem_direct *dp, struct direct *diskp )
 void
 show_as_dir ( int block )
 {
-	u_char buf[BSIZE];
 	struct mem_direct mem_dir;
-	struct direct *ddp;
+	const struct direct *ddp;
 	int i;
 
-	disk_read ( buf, block );
-	ddp = (struct direct *) buf;
+	ddp = (const struct direct *) disk_block ( block );
 
 	for ( i=0; i<DIRECT_PER_BLOCK; i++ ) {
 	    fix_direct ( &mem_dir, &ddp[i] );
@@ -420,40 +550,24 @@ show_as_dir ( int block )
 }
 
 void
-fix_inode ( struct mem_inode *mp, struct dinode *dp, char *path, int debug )
-{
-	u_char *u;
-	u_int ind_block = 0;
-	u_int dind_block = 0;
-	u_int tind_block = 0;
-	u_int addr;
-	int bcount;
+fix_inode ( struct mem_inode *mp, const struct core_inode *cp, char *path, int debug )
+{
+	u_int block;
 	int i;
 
-	// printf ( "Start fix inode\n" );
+	mp->mode = cp->mode;
+	mp->nlink = cp->nlink;
+	mp->uid = cp->uid;
+	mp->gid = cp->gid;
+	mp->size = cp->size;
 
-	mp->mode = f_sfix ( dp->di_mode );
-	mp->nlink = f_sfix ( dp->di_nlink );
-	mp->uid = f_sfix ( dp->di_uid );
-	mp->gid = f_sfix ( dp->di_gid );
-	mp->size = f_ifix ( dp->di_size );
+	mp->atime = cp->atime;
+	mp->mtime = cp->mtime;
+	mp->ctime = cp->ctime;
 
-	mp->atime = dp->di_atime;
-	mp->mtime = dp->di_mtime;
-	mp->ctime = dp->di_ctime;
-
-	bcount = 0;
-	for ( i=0; i<BYTES_INODE_ADDR; i += 3 ) {
-	    u = &dp->di_addr[i];
-	    addr = u[0]<<16 | u[1]<<8 | u[2];
-	    if ( addr )
-		mp->addr[bcount++] = addr;
-	}
-
-	/* Premature, except for special files.
-	 * (which should have one block value set)
-	 */
-	mp->bcount = bcount;
+	for ( i=0; i<NUM_INODE_ADDR; i++ )
+	    mp->addr[i] = cp->addr[i];
+	mp->path = path;
 
 	/* Only directories and regular files have block lists.
 	 * Pipes don't exist in the filesystem.
@@ -461,79 +575,99 @@ fix_inode ( struct mem_inode *mp, struct dinode *dp, char *path, int debug )
 	 * and it contains the major/minor numbers.
 	 */
 	if ( ((mp->mode & IFMT) != IFDIR ) &&
-	    ((mp->mode & IFMT) != IFREG ) )
+	    ((mp->mode & IFMT) != IFREG ) ) {
+		mp->bcount = 0;
 		return;
-
-	if ( bcount > 10 )
-	    ind_block = mp->addr[10];
-	if ( bcount > 11 )
-	    dind_block = mp->addr[11];
-	if ( bcount > 12 )
-	    tind_block = mp->addr[12];
-
-	if ( tind_block ) {
-	    printf ( "Triple indirect block -- we cannot handle these yet\n" );
-	    error ( "Triple indirect block -- we cannot handle these yet\n" );
 	}
 
-	/* Now, forget any indirect blocks */
-	if ( bcount > 10 )
-	    bcount = 10;
-
-	if ( ind_block )
-	    expand_indir (  ind_block, mp->addr, &bcount, 1 );
-	if ( dind_block )
-	    expand_indir (  dind_block, mp->addr, &bcount, 2 );
-
-	mp->bcount = bcount;
+	mp->bcount = (mp->size + BSIZE - 1) / BSIZE;
 
 	if ( debug ) {
 	    printf ( "Block addresses for inode for %s\n", path );
-	    for ( i=0; i<bcount; i++ ) {
-		printf ( "%5d: %9d\n", i, mp->addr[i] );
+	    for ( i=0; i<mp->bcount; i++ ) {
+		printf ( "%5d: %9d\n", i, bmap ( mp, i ) );
 	    }
 	    printf ( "Blocks as directory entries\n" );
-	    for ( i=0; i<bcount; i++ ) {
-		show_as_dir ( mp->addr[i] );
+	    for ( i=0; i<mp->bcount; i++ ) {
+		if ( block = bmap ( mp, i ) )
+		    show_as_dir ( block );
 	    }
 	}
+}
 
-	/* Now scan for blocks in the bad region */
-	if ( ! path )
-	    return;
+/* Byte swap one disk inode into the in core table.
+ */
+void
+decode_inode ( struct core_inode *cp, const struct dinode *dp )
+{
+	cp->mode = f_sfix ( dp->di_mode );
+	cp->nlink = f_sfix ( dp->di_nlink );
+	cp->uid = f_sfix ( dp->di_uid );
+	cp->gid = f_sfix ( dp->di_gid );
+	cp->size = f_ifix ( dp->di_size );
 
-	for ( i=0; i<bcount; i++ ) {
-	    // printf ( "Check %d %d \n", mp->addr[i], limit );
-	    if ( mp->addr[i] > limit )
-		printf ( "BAD BLOCK: %d in %s\n", mp->addr[i], path );
-	}
+	unpack_addr ( cp->addr, dp->di_addr );
 
-	// printf ( "end fix inode\n" );
+	cp->atime = (u_int) f_ifix ( dp->di_atime );
+	cp->mtime = (u_int) f_ifix ( dp->di_mtime );
+	cp->ctime = (u_int) f_ifix ( dp->di_ctime );
 }
 
+/* Read every inode block once, and decode all of them.
+ * The inode blocks run from block 2 up to (not including) sb.isize.
+ * After this, an inode lookup is just itable[inode].
+ */
 void
-get_inode ( struct mem_inode *mp, int inode, char *path, int debug )
+load_inodes ( void )
 {
-    struct dinode iblock[INODES_PER_BLOCK];
+    const struct dinode *dp;
+    struct core_inode *cp;
     int block;
-    int index;
+    int i;
+
+    free ( itable );
+    itable = calloc ( num_inodes + 1, sizeof(struct core_inode) );
+    if ( ! itable )
+	error ( "out of memory for inodes" );
 
     /* It is surprising, but indeed, inode 0 is not stored in the list.
-     * So this subtraction is essential.
+     * So the first one on disk is inode 1.
      */
-    block = INODE_OFFSET + (inode-1) / INODES_PER_BLOCK;
-    index = (inode-1) % INODES_PER_BLOCK;
+    cp = &itable[1];
+    for ( block = INODE_OFFSET; block < sb.isize; block++ ) {
+	dp = (const struct dinode *) disk_block ( block );
+	for ( i=0; i<INODES_PER_BLOCK; i++ )
+	    decode_inode ( cp++, &dp[i] );
+    }
 
-    // printf ( "Fetching inode %d -- block %d, index %d\n", inode, block, index );
-    // block_show ( block );
+    printf ( "Loaded %d inodes\n", num_inodes );
+}
 
-    disk_read ( (u_char *) iblock, block );
-    fix_inode ( mp, &iblock[index], path, debug );
+void
+get_inode ( struct mem_inode *mp, int inode, char *path, int debug )
+{
+    static struct core_inode bogus;
+    struct core_inode core;
+    const struct dinode *dp;
+
+    if ( inode < 1 || inode > num_inodes ) {
+	printf ( "Bad inode number %d for %s\n", inode, path ? path : "?" );
+	fix_inode ( mp, &bogus, path, debug );
+	mp->number = inode;
+	return;
+    }
 
-    /* structure copy */
-    mp->orig = iblock[index];
+    /* Without the table, just go read the one inode */
+    if ( ! itable ) {
+	dp = (const struct dinode *) disk_block ( INODE_OFFSET + (inode-1) / INODES_PER_BLOCK );
+	decode_inode ( &core, &dp[(inode-1) % INODES_PER_BLOCK] );
+	fix_inode ( mp, &core, path, debug );
+	mp->number = inode;
+	return;
+    }
 
-    // printf ( "IPB = %d\n", INODES_PER_BLOCK );
+    fix_inode ( mp, &itable[inode], path, debug );
+    mp->number = inode;
 }
 
 #ifdef notdef
@@ -569,70 +703,71 @@ XX    }
 XX}
 #endif
 
-/*
- * dp - the directory entry that is fetched.
- * mp - the inode of the directory being scanned.
- * entry - the index of the directory entry that is wanted.
+/* Iterate over the entries in a directory.
+ * Each directory block is read (and all of its entries fixed)
+ * just once, then the entries are handed out one by one.
+ * The entries past the end of the directory (by size) are ignored.
  *
- * This does read a disk block for every directory entry.
- * This avoids keeping state and allows recursion without
- *  undue complications.
+ * Entries with a zero inode are returned too.  The unlink call
+ * simply clears the inode value in the directory and valid entries
+ * may follow, so the caller must skip them.
  */
-int
-get_dir_entry ( struct mem_direct *dp, struct mem_inode *mp, int entry )
-{
-    int index;
-    int bindex;
-    u_char dir_block[BSIZE];
-    struct direct *dbp;
-
-    index = entry % DIRECT_PER_BLOCK;
-    bindex = entry / DIRECT_PER_BLOCK;
-    // printf ( "index %d of %d\n", index, DIRECT_PER_BLOCK );
+struct dir_iter {
+    struct mem_inode *mp;
+    int entry;		/* next entry in the directory */
+    int nent;		/* how many entries the directory has */
+    int cur;		/* which block is in ents */
+    struct mem_direct ents[DIRECT_PER_BLOCK];
+};
 
-#ifdef notdef
-    if ( bindex >= 10 )
-	error ( "whoaa -- dir needs an indirect block" );
+void
+dir_open ( struct dir_iter *dp, struct mem_inode *mp )
+{
+    dp->mp = mp;
+    dp->entry = 0;
+    dp->nent = mp->size / sizeof(struct direct);
+    dp->cur = -1;
+}
 
-    /* This was a terrible bug after I modified fix_inode to
-     * expand the block list and bcount became the end indicator
-     * rather than a zero pointer flagging the end of
-     * the list.  Note the warning comment below
-     */
-    /* We are done when we hit a zero block pointer.
-     * (or when we run out of block pointers).
-     * See above for running out of block pointers
-     * XXXX - someday we may have a big list due to
-     * indirect blocks and will need to know how big
-     * that list is.
-     */
-    if ( ! mp->addr[bindex] )
-	return 0;
-#endif
+/* Pick up again at some entry, the block gets read on the next call */
+void
+dir_seek ( struct dir_iter *dp, int entry )
+{
+    dp->entry = entry;
+}
 
-    if ( bindex >= mp->bcount )
-	return 0;
+struct mem_direct *
+dir_next ( struct dir_iter *dp )
+{
+    const struct direct *dbp;
+    u_int block;
+    int bindex;
+    int index;
+    int i;
 
-    // printf ( "Read block %d (%d) for directory entries\n", mp->addr[bindex], bindex );
+    if ( dp->entry >= dp->nent )
+	return NULL;
 
-    disk_read ( dir_block, mp->addr[bindex] );
-    dbp = (struct direct *) dir_block;
-    fix_direct ( dp, &dbp[index] );
+    index = dp->entry % DIRECT_PER_BLOCK;
+    bindex = dp->entry / DIRECT_PER_BLOCK;
 
-#ifdef WRONG
-    /* It is wrong to stop on the first zero inode.
-     * directory blocks may be sprinkled with entries
-     * that have the inode value zeroed.
-     * The unlink call simply clears the inode value
-     * in the directory and valid entries may follow.
-     * So we should return the zero entries and the
-     * caller must ignore them.
-     */
-    if ( ! dp->inode )
-	return 0;
-#endif
+    if ( bindex != dp->cur ) {
+	if ( bindex >= dp->mp->bcount )
+	    return NULL;
+	dp->cur = bindex;
+	block = bmap ( dp->mp, bindex );
+	if ( ! block ) {
+	    /* A hole in a directory, nothing in it */
+	    memset ( dp->ents, 0, sizeof(dp->ents) );
+	} else {
+	    dbp = (const struct direct *) disk_block ( block );
+	    for ( i=0; i<DIRECT_PER_BLOCK; i++ )
+		fix_direct ( &dp->ents[i], &dbp[i] );
+	}
+    }
 
-    return 1;
+    dp->entry++;
+    return &dp->ents[index];
 }
 
 /* Inode 1 looks like this (whatever it is)
@@ -727,343 +862,3773 @@ XX}
 #define IEXEC   0100
 #endif
 
-void
-copy_file ( struct mem_inode *mp, char *local_path )
+/* Give the file (or directory, by path) the times from the inode */
+static void
+set_times ( int fd, char *path, struct mem_inode *mp )
 {
-	u_char buf[BSIZE];
-	int i;
-	int fd;
-	mode_t perms;
-	int full_count;
-	int xcount;
-	int blocks;
-	int rem;
-
-	xcount = (mp->size + BSIZE - 1) / BSIZE;
-	if ( xcount != mp->bcount )
-	    printf ( "bcount fishy for %s -- %d %d\n", local_path, xcount, mp->bcount );
+	struct timespec ts[2];
+
+	ts[0].tv_sec = mp->atime;
+	ts[0].tv_nsec = 0;
+	ts[1].tv_sec = mp->mtime;
+	ts[1].tv_nsec = 0;
+
+	if ( path ) {
+	    if ( utimensat ( AT_FDCWD, path, ts, 0 ) )
+		printf ( "Cannot set times: %s\n", path );
+	} else
+	    futimens ( fd, ts );
+}
 
-	/* bytes in last block */
-	blocks = mp->size / BSIZE;
-	rem = mp->size - blocks*BSIZE;
+/* Holes in a file read back as zeros */
+static const u_char zero_block[BSIZE];
 
-	full_count = mp->bcount - 1;
-	if ( rem == 0 )
-	    full_count++;
+static int
+zero_data ( const u_char *buf, int len )
+{
+	return memcmp ( buf, zero_block, len ) == 0;
+}
 
-	// if ( rem == 0 ) {
-	//    printf ( "%s last block zero\n", local_path );
-	//    error ( "last block zero" );
-	// }
-	    
-	perms = mp->mode & 0777;
-	// printf ( "%12s  perms = %o\n", local_path, perms );
+/* With -m, every regular file gets a SHA-256 of its contents,
+ * taken from the same data as it is copied (so no extra reads
+ * of the image), and a line in the manifest file:
+ *   hash inode size mode uid gid mtime blocks path
+ * where blocks is a hash of the block list (see blocks_hash).
+ * The lines are sorted by path so two manifests can be diffed.
+ * copy_hash is set while a file is being copied.
+ */
+char *manifest_path;
+static __thread struct sha256 *copy_hash;
+
+struct man_ent {
+	char *path;
+	int inode;
+	int size;
+	int mode;
+	int uid;
+	int gid;
+	time_t mtime;
+	unsigned long long blocks;
+	int hashed;
+	u_char hash[SHA256_LEN];
+};
 
-	fd = creat ( local_path, perms );
-	if ( fd < 0 ) {
-	    printf ( "Cannot create: %s\n", local_path );
-	    error ( "cannot create file" );
-	}
+static struct man_ent *man_ents;
+static int man_count;
+static int man_max;
+static pthread_mutex_t man_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	//printf ( "Copy %d blocks for %s\n", mp->bcount, local_path );
+/* The block addresses of a file, boiled down (FNV-1a).
+ * Cheap, no data is read, just the indirect blocks.
+ */
+static unsigned long long
+blocks_hash ( struct mem_inode *mp )
+{
+	unsigned long long h;
+	char *path;
+	u_int block;
+	int i;
 
-	for ( i=0; i<full_count; i++ ) {
-	    //printf ( "Copy block %d: %d\n", i, mp->addr[i] );
-	    disk_read ( buf, mp->addr[i] );
-	    write ( fd, buf, BSIZE );
-	}
+	/* Any bad blocks have been complained about already */
+	path = mp->path;
+	mp->path = NULL;
 
-	/* Only write part of this */
-	if ( rem ) {
-	    // printf ( "Copy block %d: %d (%d bytes)\n", full_count, mp->addr[full_count], rem );
-	    disk_read ( buf, mp->addr[full_count] );
-	    write ( fd, buf, rem );
+	h = 0xcbf29ce484222325ULL;
+	for ( i=0; i<mp->bcount; i++ ) {
+	    block = bmap ( mp, i );
+	    h = (h ^ block) * 0x100000001b3ULL;
 	}
 
-	close ( fd );
+	mp->path = path;
+	return h;
 }
 
+/* Links to a file already copied don't get a hash of their own,
+ * they get it from the first name when the manifest is written.
+ */
 void
-enter_dir ( char *path )
+manifest_add ( char *path, struct mem_inode *mp, u_char *hash )
 {
-    int s;
+	struct man_ent *ep;
+	unsigned long long blocks;
 
-    s = chdir ( path );
-    if ( s ) {
-	printf ( "cannot enter: %s\n", path );
-	error ( "Cannot enter directory" );
-    }
+	blocks = blocks_hash ( mp );
+
+	pthread_mutex_lock ( &man_lock );
+	if ( man_count == man_max ) {
+	    man_max = man_max ? man_max * 2 : 1024;
+	    man_ents = realloc ( man_ents, man_max * sizeof(struct man_ent) );
+	    if ( ! man_ents )
+		error ( "out of memory for manifest" );
+	}
+	ep = &man_ents[man_count++];
+	ep->path = strdup ( path );
+	ep->inode = mp->number;
+	ep->size = mp->size;
+	ep->mode = mp->mode;
+	ep->uid = mp->uid;
+	ep->gid = mp->gid;
+	ep->mtime = mp->mtime;
+	ep->blocks = blocks;
+	ep->hashed = hash != NULL;
+	if ( hash )
+	    memcpy ( ep->hash, hash, SHA256_LEN );
+	pthread_mutex_unlock ( &man_lock );
 }
 
+static int
+man_by_inode ( const void *a, const void *b )
+{
+	const struct man_ent *ea = a;
+	const struct man_ent *eb = b;
 
-/* If I cared a lot about doing this "right", I would build a table
- * of name and inode and match up inode numbers and create symbolic
- * links (probably).  I decide that it is too much work, and I am lazy
- * and so I just print out the information here.  You can grep these
- * lines and fairly easily fix things by hand if you wan to.
- */
-void
-file_link ( int count, int inode, char *path )
+	if ( ea->inode != eb->inode )
+	    return ea->inode - eb->inode;
+	return eb->hashed - ea->hashed;
+}
+
+static int
+man_by_path ( const void *a, const void *b )
 {
-    printf ( "FLINK: (count: %d) %d %s\n", count, inode, path );
+	return strcmp ( ((const struct man_ent *) a)->path,
+	    ((const struct man_ent *) b)->path );
 }
 
-/* This spits out a line for every regular file showing
- * uid, gid, and possibly setuid status.
- */
 void
-file_stuff ( char *path, struct mem_inode *ip )
+manifest_write ( void )
 {
-    int uid, gid;
-    int is_setuid, is_setgid;
+	struct man_ent *ep;
+	FILE *fp;
+	int i;
+	int j;
 
-    uid = ip->uid;
-    gid = ip->gid;
+	if ( ! manifest_path )
+	    return;
 
-    is_setgid = (ip->mode & ISGID) ? 'G' : '-';
-    is_setuid = (ip->mode & ISUID) ? 'U' : '-';
+	/* Hashed entry first for each inode, then the links */
+	qsort ( man_ents, man_count, sizeof(struct man_ent), man_by_inode );
+	for ( i=1; i<man_count; i++ ) {
+	    ep = &man_ents[i];
+	    if ( ! ep->hashed && ep[-1].inode == ep->inode && ep[-1].hashed ) {
+		memcpy ( ep->hash, ep[-1].hash, SHA256_LEN );
+		ep->hashed = 1;
+	    }
+	}
+	qsort ( man_ents, man_count, sizeof(struct man_ent), man_by_path );
+
+	fp = fopen ( manifest_path, "w" );
+	if ( ! fp )
+	    error ( "cannot create manifest" );
+
+	for ( i=0; i<man_count; i++ ) {
+	    ep = &man_ents[i];
+	    if ( ep->hashed )
+		for ( j=0; j<SHA256_LEN; j++ )
+		    fprintf ( fp, "%02x", ep->hash[j] );
+	    else
+		fprintf ( fp, "-" );
+	    fprintf ( fp, " %d %d %06o %d %d %ld %016llx %s\n", ep->inode, ep->size,
+		ep->mode, ep->uid, ep->gid, (long) ep->mtime, ep->blocks, ep->path );
+	    free ( ep->path );
+	}
 
-    printf ( "FILE: %36s %2d %2d %c%c\n", path, uid, gid, is_setuid, is_setgid );
+	if ( fclose ( fp ) )
+	    error ( "cannot write manifest" );
+	printf ( "Manifest: %d files in %s\n", man_count, manifest_path );
+	man_count = 0;
+}
+
+static void
+hash_begin ( struct sha256 *hp )
+{
+	if ( ! manifest_path )
+	    return;
+	sha256_init ( hp );
+	copy_hash = hp;
+}
+
+static void
+hash_end ( char *path, struct mem_inode *mp )
+{
+	u_char digest[SHA256_LEN];
+
+	if ( ! copy_hash )
+	    return;
+	sha256_final ( copy_hash, digest );
+	copy_hash = NULL;
+	manifest_add ( path, mp, digest );
+}
+
+/* Holes don't get copied, but they count in the hash */
+static void
+hash_zeros ( int n )
+{
+	int len;
+
+	if ( ! copy_hash )
+	    return;
+	while ( n > 0 ) {
+	    len = n < BSIZE ? n : BSIZE;
+	    sha256_update ( copy_hash, zero_block, len );
+	    n -= len;
+	}
+}
+
+/* Most files were laid down on a fresh disk and are mostly
+ * contiguous.  So we copy runs of adjacent blocks with one
+ * big write rather than a write per block.
+ */
+#define MAX_RUN		256		/* blocks, when not mapped */
+
+/* Set while copy_sparse is writing a file, so that blocks
+ * of zeros are seeked over rather than written.
+ */
+static __thread int copy_seek;
+
+static void
+write_bytes ( int fd, const u_char *buf, int n )
+{
+	int s;
+
+	while ( n > 0 ) {
+	    s = write ( fd, buf, n );
+	    if ( s <= 0 )
+		error ( "cannot write file" );
+	    buf += s;
+	    n -= s;
+	}
+}
+
+/* fd -1 writes nothing, the data just gets hashed (see hash_image).
+ * When seeking, buf starts on a block boundary in the file.
+ */
+static void
+put_bytes ( int fd, const u_char *buf, int n )
+{
+	int len;
+	int zero;
+
+	if ( fd < 0 )
+	    return;
+	if ( ! copy_seek ) {
+	    write_bytes ( fd, buf, n );
+	    return;
+	}
+
+	/* Gather blocks of data, or of zeros, into one write or seek */
+	while ( n > 0 ) {
+	    zero = zero_data ( buf, n < BSIZE ? n : BSIZE );
+	    for ( len = BSIZE; len < n; len += BSIZE )
+		if ( zero_data ( &buf[len], n - len < BSIZE ? n - len : BSIZE ) != zero )
+		    break;
+	    if ( len > n )
+		len = n;
+	    if ( ! zero )
+		write_bytes ( fd, buf, len );
+	    else if ( lseek ( fd, len, SEEK_CUR ) < 0 )
+		error ( "cannot seek in file" );
+	    buf += len;
+	    n -= len;
+	}
+}
+
+static void
+put_zeros ( int fd, int n )
+{
+	int len;
+
+	while ( n > 0 ) {
+	    len = n < BSIZE ? n : BSIZE;
+	    put_bytes ( fd, zero_block, len );
+	    n -= len;
+	}
+}
+
+/* Copy bytes starting at a disk block.
+ * Straight out of the mapping if we have one, otherwise
+ * let the kernel move the data with copy_file_range,
+ * and if it won't (or the image is gzipped or a sector log),
+ * read it through the block cache.
+ * When hashing, or looking for blocks of zeros to leave
+ * as holes, the data has to come through us, so no
+ * copy_file_range.
+ */
+static void
+put_run ( int fd, u_int block, int n )
+{
+	static __thread u_char run_buf[MAX_RUN * BSIZE];
+	const u_char *buf;
+	loff_t pos;
+	ssize_t s;
+	int skip;
+	int len;
+
+	pos = (loff_t) (offset + block) * BSIZE;
+
+	/* Running off the end, let disk_block complain */
+	if ( pos + n > disk->size ) {
+	    while ( n > 0 ) {
+		len = n < BSIZE ? n : BSIZE;
+		buf = disk_block ( block++ );
+		put_bytes ( fd, buf, len );
+		if ( copy_hash )
+		    sha256_update ( copy_hash, buf, len );
+		n -= len;
+	    }
+	    return;
+	}
+
+	if ( disk->base ) {
+	    put_bytes ( fd, &disk->base[pos], n );
+	    if ( copy_hash )
+		sha256_update ( copy_hash, &disk->base[pos], n );
+	    return;
+	}
+
+	while ( n > 0 && ! copy_hash && ! copy_seek && disk->fd >= 0 && fd >= 0 ) {
+	    s = copy_file_range ( disk->fd, &pos, fd, NULL, n, 0 );
+	    if ( s <= 0 )
+		break;
+	    n -= s;
+	}
+
+	/* copy_file_range may have stopped part way into a block */
+	while ( n > 0 ) {
+	    skip = pos % BSIZE;
+	    len = n < sizeof(run_buf) - skip ? n : sizeof(run_buf) - skip;
+	    source_read ( disk, run_buf, pos / BSIZE, (skip + len + BSIZE - 1) / BSIZE );
+	    put_bytes ( fd, &run_buf[skip], len );
+	    if ( copy_hash )
+		sha256_update ( copy_hash, &run_buf[skip], len );
+	    pos += len;
+	    n -= len;
+	}
+}
+
+/* Write len bytes of a file, starting at off (a block boundary) to fd
+ */
+static void
+copy_range ( int fd, struct mem_inode *mp, int off, int len )
+{
+	int i;
+	u_int block;
+	u_int next;
+	int left;
+	int bytes;
+	int last;
+	int n;
+
+	/* Find runs of adjacent blocks (or of holes).
+	 * The last block may only be partly used.
+	 */
+	left = len;
+	last = (off + len + BSIZE - 1) / BSIZE;
+	i = off / BSIZE;
+	block = bmap ( mp, i );
+	next = 0;
+	for ( ; i<last; i += n ) {
+	    for ( n=1; i+n < last; n++ ) {
+		next = bmap ( mp, i+n );
+		if ( next != (block ? block + n : 0) )
+		    break;
+	    }
+
+	    bytes = n * BSIZE;
+	    if ( bytes > left )
+		bytes = left;
+	    // printf ( "Copy run %d: %d (%d bytes)\n", i, block, bytes );
+
+	    if ( block ) {
+		put_run ( fd, block, bytes );
+	    } else {
+		put_zeros ( fd, bytes );
+		hash_zeros ( bytes );
+	    }
+
+	    left -= bytes;
+	    block = next;
+	}
+}
+
+/* Write the whole contents of a file to fd (zeros for holes)
+ */
+void
+copy_data ( int fd, struct mem_inode *mp )
+{
+	copy_range ( fd, mp, 0, mp->size );
+}
+
+/* A piece of a file that has data in it, in bytes */
+struct extent {
+	int offset;
+	int len;
+};
+
+/* Find the parts of a file that are not holes.  A block with
+ * address 0 is a hole, and so is a block full of zeros (nobody
+ * reading the file can tell the difference).
+ * The tar code needs this up front for the sparse map.
+ * Returns how many extents there are, *extp gets malloc'd.
+ */
+int
+file_extents ( struct mem_inode *mp, struct extent **extp )
+{
+	struct extent *ext = NULL;
+	char *path;
+	u_int block;
+	int max = 0;
+	int n = 0;
+	int off;
+	int len;
+	int i;
+
+	/* copy_range will complain about bad blocks, not us */
+	path = mp->path;
+	mp->path = NULL;
+
+	for ( i=0; i<mp->bcount; i++ ) {
+	    off = i * BSIZE;
+	    len = mp->size - off;
+	    if ( len > BSIZE )
+		len = BSIZE;
+
+	    block = bmap ( mp, i );
+	    if ( ! block || zero_data ( disk_block ( block ), len ) )
+		continue;
+
+	    if ( n && ext[n-1].offset + ext[n-1].len == off ) {
+		ext[n-1].len += len;
+		continue;
+	    }
+
+	    if ( n == max ) {
+		max = max ? max * 2 : 8;
+		ext = realloc ( ext, max * sizeof(struct extent) );
+		if ( ! ext )
+		    error ( "out of memory for extents" );
+	    }
+	    ext[n].offset = off;
+	    ext[n].len = len;
+	    n++;
+	}
+
+	mp->path = path;
+	*extp = ext;
+	return n;
+}
+
+/* Write a file leaving holes, we just seek over the empty parts
+ * (no block, or a block of zeros) as the data goes by.
+ */
+static void
+copy_sparse ( int fd, struct mem_inode *mp, char *path )
+{
+	copy_seek = 1;
+	copy_range ( fd, mp, 0, mp->size );
+	copy_seek = 0;
+
+	/* In case it ends with a hole */
+	if ( ftruncate ( fd, mp->size ) )
+	    printf ( "Cannot set size of %s\n", path );
+}
+
+/* With -u (it needs -m), the manifest from the last run tells
+ * us what is already out there.  A file is left alone if its inode,
+ * size, mode and block list are the same as last time and its data
+ * in the image still hashes the same (a few sectors in the image
+ * may have been fixed since).  A file the last manifest doesn't
+ * have (the run was stopped partway) is left alone if it has the
+ * right size and time, and the local copy hashes the same.
+ */
+int update;
+static int num_unchanged;
+
+struct old_ent {
+	struct old_ent *next;
+	char *path;
+	int inode;
+	int size;
+	int mode;
+	unsigned long long blocks;
+	u_char hash[SHA256_LEN];
+};
+
+#define OLD_HASH	1024
+
+static struct old_ent *old_table[OLD_HASH];
+
+static int
+old_hash ( char *path )
+{
+	u_int h;
+
+	h = 0;
+	while ( *path )
+	    h = h * 31 + (u_char) *path++;
+	return h % OLD_HASH;
+}
+
+static struct old_ent *
+old_lookup ( char *path )
+{
+	struct old_ent *op;
+
+	for ( op = old_table[old_hash ( path )]; op; op = op->next )
+	    if ( strcmp ( op->path, path ) == 0 )
+		return op;
+	return NULL;
+}
+
+static int
+unhex ( u_char *hash, char *str )
+{
+	int i;
+	u_int x;
+
+	for ( i=0; i<SHA256_LEN; i++ ) {
+	    if ( sscanf ( &str[2*i], "%2x", &x ) != 1 )
+		return 1;
+	    hash[i] = x;
+	}
+	return 0;
+}
+
+void
+manifest_read ( void )
+{
+	struct old_ent *op;
+	char line[512];
+	char hash[80];
+	FILE *fp;
+	int count;
+	int len;
+	int h;
+
+	fp = fopen ( manifest_path, "r" );
+	if ( ! fp ) {
+	    printf ( "No manifest %s yet, checking files by size and time\n", manifest_path );
+	    return;
+	}
+
+	count = 0;
+	while ( fgets ( line, sizeof(line), fp ) ) {
+	    line[strcspn ( line, "\n" )] = '\0';
+	    op = malloc ( sizeof(struct old_ent) );
+	    if ( ! op )
+		error ( "out of memory for manifest" );
+	    if ( sscanf ( line, "%70s %d %d %o %*d %*d %*d %llx %n", hash,
+		    &op->inode, &op->size, &op->mode, &op->blocks, &len ) != 5 ||
+		    strlen ( hash ) != 2 * SHA256_LEN || unhex ( op->hash, hash ) ) {
+		free ( op );
+		continue;
+	    }
+	    op->path = strdup ( &line[len] );
+	    h = old_hash ( op->path );
+	    op->next = old_table[h];
+	    old_table[h] = op;
+	    count++;
+	}
+	fclose ( fp );
+	printf ( "Manifest %s has %d files\n", manifest_path, count );
+}
+
+/* Once the copiers are done with it */
+void
+manifest_free ( void )
+{
+	struct old_ent *op;
+	int h;
+
+	for ( h=0; h<OLD_HASH; h++ ) {
+	    while ( op = old_table[h] ) {
+		old_table[h] = op->next;
+		free ( op->path );
+		free ( op );
+	    }
+	}
+}
+
+/* What the file in the image hashes to, without writing it anywhere */
+static void
+hash_image ( struct mem_inode *mp, u_char *digest )
+{
+	struct sha256 sh;
+
+	sha256_init ( &sh );
+	copy_hash = &sh;
+	copy_range ( -1, mp, 0, mp->size );
+	copy_hash = NULL;
+	sha256_final ( &sh, digest );
+}
+
+static int
+hash_local ( char *path, u_char *digest )
+{
+	u_char buf[16 * BSIZE];
+	struct sha256 sh;
+	int fd;
+	int n;
+
+	fd = open ( path, O_RDONLY );
+	if ( fd < 0 )
+	    return 1;
+	sha256_init ( &sh );
+	while ( (n = read ( fd, buf, sizeof(buf) )) > 0 )
+	    sha256_update ( &sh, buf, n );
+	close ( fd );
+	if ( n < 0 )
+	    return 1;
+	sha256_final ( &sh, digest );
+	return 0;
+}
+
+/* Is the local copy already right?  If so, digest is its hash */
+static int
+file_current ( struct mem_inode *mp, char *path, u_char *digest )
+{
+	struct old_ent *op;
+	struct stat st;
+	u_char local[SHA256_LEN];
+
+	if ( stat ( path, &st ) || ! S_ISREG ( st.st_mode ) || st.st_size != mp->size )
+	    return 0;
+
+	op = old_lookup ( path );
+	if ( op ) {
+	    if ( op->inode != mp->number || op->size != mp->size ||
+		    op->mode != mp->mode || op->blocks != blocks_hash ( mp ) )
+		return 0;
+	    hash_image ( mp, digest );
+	    return memcmp ( digest, op->hash, SHA256_LEN ) == 0;
+	}
+
+	if ( st.st_mtime != mp->mtime || hash_local ( path, local ) )
+	    return 0;
+	hash_image ( mp, digest );
+	return memcmp ( digest, local, SHA256_LEN ) == 0;
+}
+
+void
+copy_file ( struct mem_inode *mp, char *local_path )
+{
+	struct sha256 sh;
+	u_char digest[SHA256_LEN];
+	int fd;
+	mode_t perms;
+
+	if ( update && file_current ( mp, local_path, digest ) ) {
+	    __atomic_fetch_add ( &num_unchanged, 1, __ATOMIC_RELAXED );
+	    manifest_add ( local_path, mp, digest );
+	    set_times ( -1, local_path, mp );
+	    return;
+	}
+
+	perms = mp->mode & 0777;
+	// printf ( "%12s  perms = %o\n", local_path, perms );
+
+	/* The old copy may be read only, or have the wrong mode,
+	 * creat would fail on the one and keep the other.
+	 */
+	if ( update )
+	    unlink ( local_path );
+
+	fd = creat ( local_path, perms );
+	if ( fd < 0 ) {
+	    printf ( "Cannot create: %s\n", local_path );
+	    error ( "cannot create file" );
+	}
+
+	//printf ( "Copy %d blocks for %s\n", mp->bcount, local_path );
+	hash_begin ( &sh );
+	copy_sparse ( fd, mp, local_path );
+	hash_end ( local_path, mp );
+
+	set_times ( fd, NULL, mp );
+	close ( fd );
+}
+
+/* The walker hands regular files off to a pool of copier threads.
+ * It makes each directory itself before queueing anything in it,
+ * and it remembers the directories so their times can be set
+ * once everything is copied (copying into them changes them).
+ * With num_copiers of 0 the walker just copies the files itself.
+ */
+int num_copiers = 4;
+
+#define MAX_COPIERS	64
+#define COPY_RING	64
+
+struct copy_job {
+	struct mem_inode inode;
+	char path[256];
+};
+
+static struct copy_job copy_ring[COPY_RING];
+static int copy_put;		/* jobs queued by the walker */
+static int copy_got;		/* jobs taken by copiers */
+static int copy_quit;
+
+static pthread_t copy_threads[MAX_COPIERS];
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t copy_cond = PTHREAD_COND_INITIALIZER;
+
+static void *
+copier ( void *arg )
+{
+	struct copy_job job;
+
+	for ( ;; ) {
+	    pthread_mutex_lock ( &copy_lock );
+	    while ( copy_got == copy_put && ! copy_quit )
+		pthread_cond_wait ( &copy_cond, &copy_lock );
+	    if ( copy_got == copy_put ) {
+		pthread_mutex_unlock ( &copy_lock );
+		return NULL;
+	    }
+	    job = copy_ring[copy_got % COPY_RING];
+	    copy_got++;
+	    pthread_cond_broadcast ( &copy_cond );
+	    pthread_mutex_unlock ( &copy_lock );
+
+	    job.inode.path = job.path;
+	    copy_file ( &job.inode, job.path );
+	}
+}
+
+void
+copy_start ( void )
+{
+	int i;
+
+	if ( num_copiers > MAX_COPIERS )
+	    num_copiers = MAX_COPIERS;
+
+	/* Default stack size, glibc carves the thread buffers
+	 * (run_buf and friends, over 128K) out of the stack.
+	 */
+	copy_put = copy_got = 0;
+	copy_quit = 0;
+	for ( i=0; i<num_copiers; i++ )
+	    if ( pthread_create ( &copy_threads[i], NULL, copier, NULL ) )
+		error ( "cannot start copier thread" );
+}
+
+void
+copy_queue ( struct mem_inode *mp, char *path )
+{
+	struct copy_job *jp;
+
+	if ( num_copiers < 1 ) {
+	    copy_file ( mp, path );
+	    return;
+	}
+
+	pthread_mutex_lock ( &copy_lock );
+	while ( copy_put - copy_got >= COPY_RING )
+	    pthread_cond_wait ( &copy_cond, &copy_lock );
+	jp = &copy_ring[copy_put % COPY_RING];
+	jp->inode = *mp;
+	strcpy ( jp->path, path );
+	copy_put++;
+	pthread_cond_broadcast ( &copy_cond );
+	pthread_mutex_unlock ( &copy_lock );
+}
+
+/* Wait for the copiers to drain the queue and exit */
+void
+copy_finish ( void )
+{
+	int i;
+
+	pthread_mutex_lock ( &copy_lock );
+	copy_quit = 1;
+	pthread_cond_broadcast ( &copy_cond );
+	pthread_mutex_unlock ( &copy_lock );
+
+	for ( i=0; i<num_copiers; i++ )
+	    pthread_join ( copy_threads[i], NULL );
+}
+
+struct dir_time {
+	char *path;
+	struct mem_inode inode;
+};
+
+static struct dir_time *dir_times;
+static int num_dirs;
+static int max_dirs;
+
+void
+dir_remember ( char *path, struct mem_inode *mp )
+{
+	if ( num_dirs == max_dirs ) {
+	    max_dirs = max_dirs ? max_dirs * 2 : 256;
+	    dir_times = realloc ( dir_times, max_dirs * sizeof(struct dir_time) );
+	    if ( ! dir_times )
+		error ( "out of memory for directories" );
+	}
+	dir_times[num_dirs].path = strdup ( path );
+	dir_times[num_dirs].inode = *mp;
+	num_dirs++;
+}
+
+/* Deepest first, though it does not really matter */
+void
+dir_set_times ( void )
+{
+	struct dir_time *dp;
+
+	while ( num_dirs > 0 ) {
+	    dp = &dir_times[--num_dirs];
+	    set_times ( -1, dp->path, &dp->inode );
+	    free ( dp->path );
+	}
+}
+
+/* Hard links.  A hash table from inode number to the
+ * first path we used for it.  Only inodes with nlink > 1 go in.
+ */
+#define LINK_HASH	256
+
+struct link_ent {
+	struct link_ent *next;
+	int inode;
+	char *path;
+};
+
+static struct link_ent *link_hash[LINK_HASH];
+
+/* Return the path this inode was first written as,
+ * or NULL (and remember this path) if this is the first time.
+ */
+char *
+link_lookup ( int inode, char *path )
+{
+	struct link_ent *lp;
+	int h;
+
+	h = inode % LINK_HASH;
+	for ( lp = link_hash[h]; lp; lp = lp->next )
+	    if ( lp->inode == inode )
+		return lp->path;
+
+	lp = malloc ( sizeof(struct link_ent) );
+	if ( ! lp )
+	    error ( "out of memory for links" );
+	lp->inode = inode;
+	lp->path = strdup ( path );
+	lp->next = link_hash[h];
+	link_hash[h] = lp;
+	return NULL;
+}
+
+void
+link_clear ( void )
+{
+	struct link_ent *lp;
+	int h;
+
+	for ( h=0; h<LINK_HASH; h++ ) {
+	    while ( lp = link_hash[h] ) {
+		link_hash[h] = lp->next;
+		free ( lp->path );
+		free ( lp );
+	    }
+	}
+}
+
+/* Instead of a tree of files, we can write a tar archive
+ * (to a file or to stdout) in the same single pass.
+ * This keeps what a tree of files on linux loses: owners,
+ * setuid bits, special files, and hard links.
+ * Plain ustar, with a pax header for any name that won't fit.
+ */
+int tar_fd = -1;
+char *tar_path;
+
+struct __attribute__((__packed__)) tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char _pad[12];
+};
+
+static void
+tar_octal ( char *field, int width, unsigned long val )
+{
+	snprintf ( field, width, "%0*lo", width-1, val );
+}
+
+static void
+tar_pad ( int size )
+{
+	if ( size % BSIZE )
+	    put_zeros ( tar_fd, BSIZE - size % BSIZE );
+}
+
+static void
+tar_write ( struct tar_header *hp )
+{
+	u_char *p;
+	u_int sum;
+	int i;
+
+	memcpy ( hp->magic, "ustar", 6 );
+	memcpy ( hp->version, "00", 2 );
+
+	memset ( hp->chksum, ' ', sizeof(hp->chksum) );
+	p = (u_char *) hp;
+	sum = 0;
+	for ( i=0; i<sizeof(*hp); i++ )
+	    sum += p[i];
+	snprintf ( hp->chksum, sizeof(hp->chksum), "%06o", sum );
+
+	put_bytes ( tar_fd, (u_char *) hp, sizeof(*hp) );
+}
+
+/* One "len key=value\n" record, where len counts itself */
+static int
+pax_record ( char *buf, char *key, char *val )
+{
+	int len;
+	int n;
+
+	n = strlen ( key ) + strlen ( val ) + 3;
+	len = n + 1;
+	while ( len != n + snprintf ( NULL, 0, "%d", len ) )
+	    len++;
+	return sprintf ( buf, "%d %s=%s\n", len, key, val );
+}
+
+/* Put the name in the header, splitting it into prefix and name
+ * if we must.  Returns 0 if it just won't fit.
+ */
+static int
+tar_name ( struct tar_header *hp, char *path )
+{
+	int len;
+	char *p;
+
+	len = strlen ( path );
+	if ( len <= sizeof(hp->name) ) {
+	    strncpy ( hp->name, path, sizeof(hp->name) );
+	    return 1;
+	}
+
+	for ( p = path + len - sizeof(hp->name) - 1; *p; p++ ) {
+	    if ( *p != '/' )
+		continue;
+	    if ( p - path > sizeof(hp->prefix) )
+		return 0;
+	    strncpy ( hp->prefix, path, p - path );
+	    strncpy ( hp->name, p+1, sizeof(hp->name) );
+	    return 1;
+	}
+	return 0;
+}
+
+/* xrec is more pax records to put in the extended header (or NULL)
+ */
+static void
+tar_entry ( char *path, struct mem_inode *mp, int type, int size, char *link, char *xrec )
+{
+	struct tar_header hdr;
+	char pax[1024];
+	int n;
+	int dev;
+
+	memset ( &hdr, 0, sizeof(hdr) );
+
+	n = 0;
+	if ( xrec )
+	    n += sprintf ( pax, "%s", xrec );
+	if ( ! tar_name ( &hdr, path ) ) {
+	    n += pax_record ( &pax[n], "path", path );
+	    strncpy ( hdr.name, path, sizeof(hdr.name) );
+	}
+	if ( link && strlen ( link ) > sizeof(hdr.linkname) )
+	    n += pax_record ( &pax[n], "linkpath", link );
+
+	if ( n ) {
+	    struct tar_header xhdr;
+
+	    memset ( &xhdr, 0, sizeof(xhdr) );
+	    strcpy ( xhdr.name, "PaxHeader" );
+	    tar_octal ( xhdr.mode, sizeof(xhdr.mode), 0644 );
+	    tar_octal ( xhdr.uid, sizeof(xhdr.uid), 0 );
+	    tar_octal ( xhdr.gid, sizeof(xhdr.gid), 0 );
+	    tar_octal ( xhdr.size, sizeof(xhdr.size), n );
+	    tar_octal ( xhdr.mtime, sizeof(xhdr.mtime), mp->mtime );
+	    xhdr.typeflag = 'x';
+	    tar_write ( &xhdr );
+	    put_bytes ( tar_fd, (u_char *) pax, n );
+	    tar_pad ( n );
+	}
+
+	tar_octal ( hdr.mode, sizeof(hdr.mode), mp->mode & 07777 );
+	tar_octal ( hdr.uid, sizeof(hdr.uid), mp->uid );
+	tar_octal ( hdr.gid, sizeof(hdr.gid), mp->gid );
+	tar_octal ( hdr.size, sizeof(hdr.size), size );
+	tar_octal ( hdr.mtime, sizeof(hdr.mtime), mp->mtime );
+	hdr.typeflag = type;
+	if ( link )
+	    strncpy ( hdr.linkname, link, sizeof(hdr.linkname) );
+
+	/* Special files keep major/minor in the first block address */
+	if ( type == '3' || type == '4' ) {
+	    dev = mp->addr[0];
+	    tar_octal ( hdr.devmajor, sizeof(hdr.devmajor), (dev >> 8) & 0xff );
+	    tar_octal ( hdr.devminor, sizeof(hdr.devminor), dev & 0xff );
+	}
+
+	tar_write ( &hdr );
+}
+
+/* See if this inode went into the archive already.
+ * If so, write a link to it and return 1.
+ */
+static int
+tar_link ( char *path, struct mem_inode *mp, int inode )
+{
+	char *first;
+
+	if ( mp->nlink < 2 )
+	    return 0;
+
+	first = link_lookup ( inode, path );
+	if ( ! first )
+	    return 0;
+
+	tar_entry ( path, mp, '1', 0, first, NULL );
+	return 1;
+}
+
+void
+tar_dir ( char *path, struct mem_inode *mp )
+{
+	char name[260];
+
+	sprintf ( name, "%s/", path );
+	tar_entry ( name, mp, '5', 0, NULL, NULL );
+}
+
+/* A file with holes goes in as a GNU sparse file (format 1.0),
+ * which is all done with pax records.  The archive name is
+ * dir/GNUSparseFile.0/name, and the real name is in the records.
+ * The data starts with a map (in decimal text) of the pieces
+ * that follow: a count, then offset and length for each one.
+ */
+static void
+tar_sparse ( char *path, struct mem_inode *mp, struct extent *ext, int n )
+{
+	char xrec[600];
+	char sname[300];
+	char num[16];
+	char *map;
+	char *base;
+	int map_len;
+	int data;
+	int pos;
+	int x;
+	int i;
+
+	data = 0;
+	for ( i=0; i<n; i++ )
+	    data += ext[i].len;
+
+	/* Ending with a hole takes an empty piece at the end */
+	map = malloc ( 32 * (n + 2) + BSIZE );
+	if ( ! map )
+	    error ( "out of memory for sparse map" );
+	if ( n && ext[n-1].offset + ext[n-1].len == mp->size ) {
+	    map_len = sprintf ( map, "%d\n", n );
+	} else {
+	    map_len = sprintf ( map, "%d\n", n + 1 );
+	}
+	for ( i=0; i<n; i++ )
+	    map_len += sprintf ( &map[map_len], "%d\n%d\n", ext[i].offset, ext[i].len );
+	if ( ! n || ext[n-1].offset + ext[n-1].len != mp->size )
+	    map_len += sprintf ( &map[map_len], "%d\n0\n", mp->size );
+	if ( map_len % BSIZE ) {
+	    memset ( &map[map_len], 0, BSIZE - map_len % BSIZE );
+	    map_len += BSIZE - map_len % BSIZE;
+	}
+
+	x = 0;
+	x += pax_record ( &xrec[x], "GNU.sparse.major", "1" );
+	x += pax_record ( &xrec[x], "GNU.sparse.minor", "0" );
+	x += pax_record ( &xrec[x], "GNU.sparse.name", path );
+	sprintf ( num, "%d", mp->size );
+	x += pax_record ( &xrec[x], "GNU.sparse.realsize", num );
+
+	base = strrchr ( path, '/' );
+	if ( base )
+	    sprintf ( sname, "%.*s/GNUSparseFile.0/%s", (int) (base - path), path, base + 1 );
+	else
+	    sprintf ( sname, "GNUSparseFile.0/%s", path );
+
+	tar_entry ( sname, mp, '0', map_len + data, NULL, xrec );
+	put_bytes ( tar_fd, (u_char *) map, map_len );
+	pos = 0;
+	for ( i=0; i<n; i++ ) {
+	    hash_zeros ( ext[i].offset - pos );
+	    copy_range ( tar_fd, mp, ext[i].offset, ext[i].len );
+	    pos = ext[i].offset + ext[i].len;
+	}
+	hash_zeros ( mp->size - pos );
+	tar_pad ( data );
+
+	free ( map );
+}
+
+void
+tar_file ( char *path, struct mem_inode *mp, int inode )
+{
+	struct sha256 sh;
+	struct extent *ext;
+	int data;
+	int n;
+	int i;
+
+	if ( tar_link ( path, mp, inode ) ) {
+	    if ( manifest_path )
+		manifest_add ( path, mp, NULL );
+	    return;
+	}
+
+	n = file_extents ( mp, &ext );
+	data = 0;
+	for ( i=0; i<n; i++ )
+	    data += ext[i].len;
+
+	hash_begin ( &sh );
+	if ( data < mp->size ) {
+	    tar_sparse ( path, mp, ext, n );
+	} else {
+	    tar_entry ( path, mp, '0', mp->size, NULL, NULL );
+	    copy_data ( tar_fd, mp );
+	    tar_pad ( mp->size );
+	}
+	hash_end ( path, mp );
+	free ( ext );
+}
+
+void
+tar_special ( char *path, struct mem_inode *mp, int inode )
+{
+	int type;
+
+	switch ( mp->mode & IFMT ) {
+	    case IFCHR:
+	    case IFMPC:
+		type = '3';
+		break;
+	    case IFBLK:
+	    case IFMPB:
+		type = '4';
+		break;
+	    default:
+		printf ( "Not in the archive (mode %o): %s\n", mp->mode, path );
+		return;
+	}
+
+	if ( tar_link ( path, mp, inode ) )
+	    return;
+
+	tar_entry ( path, mp, type, 0, NULL, NULL );
+}
+
+/* The end of an archive is two zero blocks */
+void
+tar_close ( void )
+{
+	put_zeros ( tar_fd, 2 * BSIZE );
+	close ( tar_fd );
+	link_clear ();
+}
+
+/* A regular file with more than one link.
+ * If we have copied it already, this name will become a hard link
+ * to the first one and we return 1 so it does not get copied again.
+ * The first copy may still be in the hands of a copier thread, so
+ * the links themselves get made by link_finish() at the very end.
+ * We still print a line for each, as we always did.
+ */
+struct link_todo {
+	char *from;
+	char *to;
+};
+
+static struct link_todo *link_todo;
+static int num_todo;
+static int max_todo;
+
+int
+file_link ( int count, int inode, char *path )
+{
+    char *first;
+
+    if ( count < 2 )
+	return 0;
+
+    printf ( "FLINK: (count: %d) %d %s\n", count, inode, path );
+
+    first = link_lookup ( inode, path );
+    if ( ! first )
+	return 0;
+
+    if ( num_todo == max_todo ) {
+	max_todo = max_todo ? max_todo * 2 : 64;
+	link_todo = realloc ( link_todo, max_todo * sizeof(struct link_todo) );
+	if ( ! link_todo )
+	    error ( "out of memory for links" );
+    }
+    link_todo[num_todo].from = first;
+    link_todo[num_todo].to = strdup ( path );
+    num_todo++;
+    return 1;
+}
+
+/* For -u, the link may be there from last time */
+static int
+same_file ( char *a, char *b )
+{
+    struct stat sa, sb;
+
+    if ( stat ( a, &sa ) || stat ( b, &sb ) )
+	return 0;
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+void
+link_finish ( void )
+{
+    struct link_todo *tp;
+    int i;
+
+    for ( i=0; i<num_todo; i++ ) {
+	tp = &link_todo[i];
+	if ( update && same_file ( tp->from, tp->to ) ) {
+	    free ( tp->to );
+	    continue;
+	}
+	if ( update )
+	    unlink ( tp->to );
+	if ( link ( tp->from, tp->to ) )
+	    printf ( "Cannot link %s to %s (%s)\n", tp->to, tp->from, strerror ( errno ) );
+	free ( tp->to );
+    }
+    num_todo = 0;
+    link_clear ();
+}
+
+/* This spits out a line for every regular file showing
+ * uid, gid, and possibly setuid status.
+ */
+void
+file_stuff ( char *path, struct mem_inode *ip )
+{
+    int uid, gid;
+    int is_setuid, is_setgid;
+
+    uid = ip->uid;
+    gid = ip->gid;
+
+    is_setgid = (ip->mode & ISGID) ? 'G' : '-';
+    is_setuid = (ip->mode & ISUID) ? 'U' : '-';
+
+    printf ( "FILE: %36s %2d %2d %c%c\n", path, uid, gid, is_setuid, is_setgid );
 }
 
 /* All special files are in /dev
  * all are owned by root, group 1 ("daemon")
  */
 void
-special ( char *path, struct mem_inode *ip )
+special ( char *path, struct mem_inode *ip )
+{
+    int type;
+    int dev;
+    int major, minor;
+    int i;
+
+    type = '?';
+    if ( ip->mode & IFCHR )
+	type = 'c';
+    if ( ip->mode & IFBLK )
+	type = 'b';
+
+    dev = ip->addr[0];
+
+    major = (dev >> 8)&0xff;
+    minor = dev & 0xff;
+
+    // printf ( "SPECIAL: mode %36s - %08x\n", path, ip->mode );
+    // printf ( "SPECIAL: addr %36s - %08x\n", path, ip->addr[0] );
+
+    printf ( "SPECIAF: %36s %2d %2d\n", path, ip->uid, ip->gid );
+    printf ( "SPECIAL: %36s - mknod %c %2d %2d\n", path, type, major, minor );
+
+    // for ( i=0; i<ip->bcount; i++ )
+	//printf ( "SPECIAL: addr %36s - %2d %08x\n", path, i, ip->addr[i] );
+}
+
+/* With -r, we keep track of the inodes the walk gets to,
+ * and anything allocated that it did not get to is recovered
+ * into lost+found afterwards.
+ */
+int recover;
+static char *reached;
+
+/* Bitmaps, one bit per inode (or block) */
+#define BIT_WORD(b)	((b) / 32)
+#define BIT_MASK(b)	(1u << ((b) % 32))
+
+/* The directories the walk has been into, so that a damaged
+ * image with a directory that leads back to itself can't loop.
+ */
+static u_int *visited;
+
+/* The "frag" command walks the tree like an extraction does, but
+ * instead of copying anything it puts every block of every directory
+ * and file on cylinder/head/sector, and works out what reading them
+ * would cost on the Rodime.  The blocks are taken in the order the
+ * kernel reads them, each indirect block just before the blocks it
+ * maps.  The timing is a rough model: the disk turns at 3600 rpm, a
+ * seek takes a settle time plus so much per cylinder (guesses, for a
+ * stepper drive of the time), and the platter keeps turning during a
+ * seek, so after it we wait for the sector to come around.
+ * The inode reads are left out.
+ */
+int frag_report;
+int frag_list;			/* -l, every file, not just the broken up ones */
+
+#define RPM		3600
+#define SECTOR_MS	(60000.0 / RPM / SECTORS)
+#define SEEK_SETTLE	3.0	/* ms */
+#define SEEK_PER_CYL	0.3	/* ms */
+
+#define FRAG_HIST	12	/* 1, 2, 3-4, 5-8 ... */
+
+struct frag_cost {
+	int blocks;
+	int extents;
+	int seeks;
+	int cyls;		/* cylinders crossed seeking */
+	double ms;
+	u_int first;		/* disk block read first */
+	u_int last;		/* disk block the head just read */
+};
+
+static struct frag_cost frag_walk;	/* the whole walk as one long read */
+static int frag_files;
+static int frag_dirs;
+static int frag_broken;			/* files in more than one piece */
+static int frag_ext_hist[FRAG_HIST];
+static int frag_seek_hist[FRAG_HIST];
+
+static int
+frag_bucket ( int n )
+{
+	int b;
+
+	for ( b = 0; n > 1 && b < FRAG_HIST - 1; b++ )
+	    n = (n + 1) / 2;
+	return b;
+}
+
+/* Read one more block (absolute, on the whole disk) */
+static void
+frag_add ( struct frag_cost *fc, u_int block, int *seek_hist )
+{
+	double ms;
+	double pos;
+	int sect;
+	int cyl;
+
+	if ( fc->blocks++ == 0 ) {
+	    fc->extents = 1;
+	    fc->ms = SECTOR_MS;
+	    fc->first = block;
+	    fc->last = block;
+	    return;
+	}
+
+	if ( block != fc->last + 1 )
+	    fc->extents++;
+
+	ms = 0.0;
+	cyl = block / CYL_BLOCKS - fc->last / CYL_BLOCKS;
+	if ( cyl < 0 )
+	    cyl = -cyl;
+	if ( cyl ) {
+	    ms = SEEK_SETTLE + cyl * SEEK_PER_CYL;
+	    fc->seeks++;
+	    fc->cyls += cyl;
+	    if ( seek_hist )
+		seek_hist[frag_bucket ( cyl )]++;
+	}
+
+	/* Where the platter is now, in sectors, and the wait for ours */
+	pos = fc->last % SECTORS + 1 + ms / SECTOR_MS;
+	sect = block % SECTORS;
+	pos = sect - pos;
+	while ( pos < 0 )
+	    pos += SECTORS;
+	ms += pos * SECTOR_MS + SECTOR_MS;
+
+	fc->ms += ms;
+	fc->last = block;
+}
+
+static void
+frag_block ( struct frag_cost *fc, u_int block )
+{
+	if ( block < sb.isize || block >= sb.fsize )
+	    return;
+	frag_add ( fc, offset + block, NULL );
+	frag_add ( &frag_walk, offset + block, frag_seek_hist );
+}
+
+/* An indirect block, and then what it maps, left is how many
+ * blocks of the file are still to come.
+ */
+static void
+frag_indir ( struct frag_cost *fc, u_int block, int level, int *left )
+{
+	u_int addr[NINDIR];
+	int span;
+	int i;
+
+	if ( block < sb.isize || block >= sb.fsize ) {
+	    for ( span = 1, i = 0; i < level; i++ )
+		span *= NINDIR;
+	    *left -= span;
+	    return;
+	}
+
+	frag_block ( fc, block );
+	memcpy ( addr, get_indir ( block ), sizeof(addr) );
+
+	for ( i=0; i<NINDIR && *left > 0; i++ ) {
+	    if ( level == 1 ) {
+		if ( addr[i] )
+		    frag_block ( fc, addr[i] );
+		(*left)--;
+	    } else
+		frag_indir ( fc, addr[i], level-1, left );
+	}
+}
+
+static void
+frag_entry ( char *path, struct mem_inode *mp )
+{
+	struct frag_cost fc;
+	struct frag_cost ideal;
+	int left;
+	int i;
+
+	/* A file with several links only gets read once
+	 * (directories are in the bitmap already, from the walk)
+	 */
+	if ( (mp->mode & IFMT) == IFREG && mp->number <= num_inodes ) {
+	    if ( visited[BIT_WORD(mp->number)] & BIT_MASK(mp->number) )
+		return;
+	    visited[BIT_WORD(mp->number)] |= BIT_MASK(mp->number);
+	}
+
+	memset ( &fc, 0, sizeof(fc) );
+	left = mp->bcount;
+	for ( i=0; i<NDADDR && left > 0; i++, left-- )
+	    if ( mp->addr[i] )
+		frag_block ( &fc, mp->addr[i] );
+	for ( i=0; i<3 && left > 0; i++ )
+	    frag_indir ( &fc, mp->addr[NDADDR+i], i+1, &left );
+
+	if ( (mp->mode & IFMT) == IFDIR )
+	    frag_dirs++;
+	else
+	    frag_files++;
+	if ( ! fc.blocks )
+	    return;
+
+	frag_ext_hist[frag_bucket ( fc.extents )]++;
+	if ( fc.extents > 1 )
+	    frag_broken++;
+
+	/* The same blocks laid end to end, starting in the same place */
+	memset ( &ideal, 0, sizeof(ideal) );
+	for ( i=0; i<fc.blocks; i++ )
+	    frag_add ( &ideal, fc.first + i, NULL );
+
+	if ( frag_list || fc.extents > 1 )
+	    printf ( "%6d %5d %5d %5d %8.1f %8.1f  %s%s\n", fc.blocks, fc.extents,
+		fc.seeks, fc.cyls, fc.ms, ideal.ms, path,
+		(mp->mode & IFMT) == IFDIR ? "/" : "" );
+}
+
+/* Global: statistics */
+int biggest_size = 0;
+char biggest_path[256];
+
+/* Make one thing we found in a directory (or in lost+found).
+ * Directories just get made here, walk_dir goes into them later.
+ */
+void
+make_entry ( char *ent_path, char *name, int inode, struct mem_inode *mp )
+{
+    int code;
+
+    if ( frag_report ) {
+	if ( (mp->mode & IFMT) == IFREG )
+	    frag_entry ( ent_path, mp );
+	return;
+    }
+
+    // printf ( "mem inode mode = %08x\n", mp->mode );
+    code = ((mp->mode & IFMT) == IFDIR) ? 'D' : 'R';
+
+    printf ( "%5d %c (%d %d) %s\n", inode, code,
+	mp->nlink, mp->size, name );
+
+#ifdef notdef
+#define IFMT    0170000         /* type of file */
+#define         IFDIR   0040000 /* directory */
+#define         IFCHR   0020000 /* character special */
+#define         IFBLK   0060000 /* block special */
+#define         IFREG   0100000 /* regular */
+#define         IFMPC   0030000 /* multiplexed char special */
+#define         IFMPB   0070000 /* multiplexed block special */
+#define ISUID   04000           /* set user id on execution */
+#define ISGID   02000           /* set group id on execution */
+#define ISVTX   01000           /* save swapped text even after use */
+#define IREAD   0400            /* read, write, execute permissions */
+#define IWRITE  0200
+#define IEXEC   0100
+#endif
+    if ( (mp->mode & IFMT) == IFDIR ) {
+	/* make the directory */
+	if ( tar_fd >= 0 )
+	    tar_dir ( ent_path, mp );
+	else if ( mkdir ( ent_path, 0774 ) && ! (update && errno == EEXIST) ) {
+	    printf ( "cannot create: %s\n", ent_path );
+	    error ( "cannot create directory" );
+	}
+	if ( mp->size > biggest_size ) {
+	    biggest_size = mp->size;
+	    strcpy ( biggest_path, ent_path );
+	}
+	// if ( mp->nlink > 1 )
+	    // printf ( "DLINK: %d %s\n", mp->nlink, ent_path );
+    } else if ( (mp->mode & IFMT) == IFREG ) {
+	num_files++;
+	/* regular file */
+	// printf ( "COPY file: %s\n", ent_path );
+	file_stuff ( ent_path, mp );
+	if ( tar_fd >= 0 )
+	    tar_file ( ent_path, mp, inode );
+	else if ( ! file_link ( mp->nlink, inode, ent_path ) )
+	    copy_queue ( mp, ent_path );
+	else if ( manifest_path )
+	    manifest_add ( ent_path, mp, NULL );
+
+	if ( mp->size > biggest_size ) {
+	    biggest_size = mp->size;
+	    strcpy ( biggest_path, ent_path );
+	}
+    } else {
+	/* some kind of special file */
+	// printf ( "SPECIAL: %s\n", ent_path );
+	special ( ent_path, mp );
+	if ( tar_fd >= 0 )
+	    tar_special ( ent_path, mp, inode );
+	if ( mp->nlink > 1 )
+	    printf ( "SLINK: %d %s\n", mp->nlink, ent_path );
+    }
+}
+
+/* The walk keeps its own stack of the directories it is in, rather
+ * than recursing (a corrupt image could be deep enough to run a
+ * thread out of stack).  Each one has the entry to carry on from,
+ * and the length of walk_path up to its name.
+ */
+struct walk_frame {
+	int inode;
+	int entry;
+	int path_len;
+};
+
+static struct walk_frame *walk_stack;
+static int walk_max;
+static char walk_path[256];
+
+/* Make everything in one directory, the first pass.
+ * Subdirectories are made, but not gone into.
+ */
+static void
+walk_entries ( struct mem_inode *dmp )
+{
+    struct mem_inode entry_inode;
+    struct dir_iter iter;
+    struct mem_direct *dirp;
+    char ent_path[256];
+
+    if ( frag_report )
+	frag_entry ( walk_path, dmp );
+    else if ( tar_fd < 0 )
+	dir_remember ( walk_path, dmp );
+
+    dir_open ( &iter, dmp );
+    while ( dirp = dir_next ( &iter ) ) {
+	if ( ! dirp->inode )
+	    continue;
+	if ( strcmp ( dirp->name, "." ) == 0 )
+	    continue;
+	if ( strcmp ( dirp->name, ".." ) == 0 )
+		continue;
+
+	if ( strlen ( walk_path ) + strlen ( dirp->name ) + 2 > sizeof(ent_path) ) {
+	    printf ( "Path too long: %s/%s\n", walk_path, dirp->name );
+	    continue;
+	}
+	sprintf ( ent_path, "%s/%s", walk_path, dirp->name );
+
+	// printf ( "Fetch inode %d for %s\n", dirp->inode, dirp->name );
+	get_inode ( &entry_inode, dirp->inode, ent_path, 0 );
+	if ( reached && dirp->inode <= num_inodes )
+	    reached[dirp->inode] = 1;
+
+	make_entry ( ent_path, dirp->name, dirp->inode, &entry_inode );
+    }
+}
+
+/* Walk the tree under a directory, depth first.
+ * Each directory has its contents made before any of its
+ * subdirectories are gone into (same order as always).
+ */
+void
+walk_dir ( int inode, char *path )
+{
+    struct mem_inode cur_inode;
+    struct mem_inode entry_inode;
+    struct dir_iter iter;
+    struct mem_direct *dirp;
+    struct walk_frame *fp;
+    int depth;
+    int len;
+
+    get_inode ( &cur_inode, inode, path, 0 );
+    if ( (cur_inode.mode & IFMT) != IFDIR )
+	error ( "oops - not a directory" );
+    if ( visited[BIT_WORD(inode)] & BIT_MASK(inode) )
+	return;
+    visited[BIT_WORD(inode)] |= BIT_MASK(inode);
+
+    if ( strlen ( path ) >= sizeof(walk_path) )
+	error ( "path too long" );
+    strcpy ( walk_path, path );
+    walk_entries ( &cur_inode );
+
+    depth = 0;
+    for ( ;; ) {
+	if ( depth == walk_max ) {
+	    walk_max = walk_max ? walk_max * 2 : 32;
+	    walk_stack = realloc ( walk_stack, walk_max * sizeof(struct walk_frame) );
+	    if ( ! walk_stack )
+		error ( "out of memory for walk" );
+	}
+	fp = &walk_stack[depth];
+	fp->inode = inode;
+	fp->entry = 0;
+	fp->path_len = strlen ( walk_path );
+
+	/* Find the next subdirectory, or go back up */
+	for ( ;; ) {
+	    walk_path[fp->path_len] = '\0';
+	    get_inode ( &cur_inode, fp->inode, walk_path, 0 );
+	    dir_open ( &iter, &cur_inode );
+	    dir_seek ( &iter, fp->entry );
+	    while ( dirp = dir_next ( &iter ) ) {
+		if ( ! dirp->inode )
+		    continue;
+		if ( strcmp ( dirp->name, "." ) == 0 )
+		    continue;
+		if ( strcmp ( dirp->name, ".." ) == 0 )
+		    continue;
+		if ( fp->path_len + strlen ( dirp->name ) + 2 > sizeof(walk_path) )
+		    continue;
+
+		get_inode ( &entry_inode, dirp->inode, NULL, 0 );
+		if ( (entry_inode.mode & IFMT) != IFDIR )
+		    continue;
+		if ( dirp->inode > num_inodes )
+		    continue;
+		if ( ! (visited[BIT_WORD(dirp->inode)] & BIT_MASK(dirp->inode)) )
+		    break;
+		printf ( "LOOP: %s/%s is inode %d, already walked\n",
+		    walk_path, dirp->name, dirp->inode );
+	    }
+	    fp->entry = iter.entry;
+	    if ( dirp )
+		break;
+
+	    if ( depth == 0 )
+		return;
+	    fp = &walk_stack[--depth];
+	}
+
+	/* Go down into it */
+	inode = dirp->inode;
+	visited[BIT_WORD(inode)] |= BIT_MASK(inode);
+	len = fp->path_len;
+	sprintf ( &walk_path[len], "/%s", dirp->name );
+	get_inode ( &cur_inode, inode, walk_path, 0 );
+	walk_entries ( &cur_inode );
+	depth++;
+    }
+}
+
+/* Could this inode really be a file?  Leftover junk in the inode
+ * table might have a mode, but its block map will be nonsense.
+ * Only called for the few inodes that are candidates, so it is
+ * fine to read their indirect blocks here.
+ */
+static int
+plausible_indir ( u_int block, int level )
+{
+	u_int buf[NINDIR];
+	int i;
+
+	if ( block < sb.isize || block >= sb.fsize )
+	    return 0;
+	if ( level == 0 )
+	    return 1;
+
+	fix_addr_block ( buf, disk_block ( block ) );
+	for ( i=0; i<NINDIR; i++ )
+	    if ( buf[i] && ! plausible_indir ( buf[i], level-1 ) )
+		return 0;
+	return 1;
+}
+
+static int
+plausible ( struct core_inode *cp )
+{
+	int nblocks;
+	int span;
+	int type;
+	int i;
+
+	type = cp->mode & IFMT;
+	if ( type == IFCHR || type == IFBLK || type == IFMPC || type == IFMPB )
+	    return 1;
+	if ( type != IFDIR && type != IFREG )
+	    return 0;
+
+	if ( cp->size < 0 )
+	    return 0;
+	if ( type == IFDIR && cp->size % sizeof(struct direct) )
+	    return 0;
+	/* Nothing past the end of the file, and no indirect
+	 * blocks that a file this size doesn't need.
+	 */
+	nblocks = (cp->size + BSIZE - 1) / BSIZE;
+	for ( i = nblocks; i < NDADDR; i++ )
+	    if ( cp->addr[i] )
+		return 0;
+	nblocks -= NDADDR;
+	span = NINDIR;
+	for ( i=0; i<3; i++ ) {
+	    if ( nblocks <= 0 && cp->addr[NDADDR+i] )
+		return 0;
+	    nblocks -= span;
+	    span *= NINDIR;
+	}
+
+	for ( i=0; i<NDADDR; i++ )
+	    if ( cp->addr[i] && ! plausible_indir ( cp->addr[i], 0 ) )
+		return 0;
+	for ( i=0; i<3; i++ )
+	    if ( cp->addr[NDADDR+i] && ! plausible_indir ( cp->addr[NDADDR+i], i+1 ) )
+		return 0;
+	return 1;
+}
+
+/* An orphan directory whose ".." is another orphan directory
+ * is part of a lost subtree, and will be reached by walking
+ * the top of it.
+ */
+static int
+orphan_child ( int inode )
+{
+	const struct direct *ddp;
+	struct mem_direct dotdot;
+	struct core_inode *pp;
+	u_int block;
+
+	block = itable[inode].addr[0];
+	if ( itable[inode].size < 2 * sizeof(struct direct) || ! block )
+	    return 0;
+
+	ddp = (const struct direct *) disk_block ( block );
+	fix_direct ( &dotdot, &ddp[1] );
+	if ( strcmp ( dotdot.name, ".." ) != 0 || dotdot.inode == inode )
+	    return 0;
+	if ( dotdot.inode <= ROOT_INO || dotdot.inode > num_inodes || reached[dotdot.inode] )
+	    return 0;
+
+	pp = &itable[dotdot.inode];
+	return (pp->mode & IFMT) == IFDIR && plausible ( pp );
+}
+
+/* Linear passes over the inode table, looking for allocated
+ * inodes the walk never got to.  Directories go first, since
+ * walking one of them may reach some of the others: first the
+ * tops of lost subtrees, then any directories those didn't reach
+ * (a loop of orphans has no top), then everything else.
+ * They are named by inode number, the way fsck does it.
+ * (Files that were really deleted have their mode and block
+ * list cleared, so there is nothing we can do about those.)
+ */
+void
+recover_orphans ( char *path )
+{
+	struct mem_inode mi;
+	char lf_path[256];
+	char ent_path[256];
+	char name[16];
+	int count;
+	int pass;
+	int type;
+	int i;
+
+	sprintf ( lf_path, "%s/lost+found", path );
+	count = 0;
+
+	for ( pass = 0; pass < 3; pass++ ) {
+	    for ( i = ROOT_INO + 1; i <= num_inodes; i++ ) {
+		if ( ! itable[i].mode || reached[i] )
+		    continue;
+		type = itable[i].mode & IFMT;
+		if ( (pass < 2) != (type == IFDIR) )
+		    continue;
+
+		if ( ! plausible ( &itable[i] ) ) {
+		    printf ( "Not recovering inode %d (mode %o), its blocks make no sense\n",
+			i, itable[i].mode );
+		    reached[i] = 1;
+		    continue;
+		}
+		if ( pass == 0 && orphan_child ( i ) )
+		    continue;
+
+		if ( count++ == 0 ) {
+		    get_inode ( &mi, ROOT_INO, path, 0 );
+		    mi.mode = IFDIR | 0755;
+		    if ( tar_fd >= 0 )
+			tar_dir ( lf_path, &mi );
+		    else if ( mkdir ( lf_path, 0775 ) && errno != EEXIST ) {
+			printf ( "cannot create: %s\n", lf_path );
+			error ( "cannot create directory" );
+		    }
+		}
+
+		sprintf ( name, "#%d", i );
+		sprintf ( ent_path, "%s/%s", lf_path, name );
+		printf ( "Recover orphan inode %d as %s\n", i, ent_path );
+
+		reached[i] = 1;
+		get_inode ( &mi, i, ent_path, 0 );
+		make_entry ( ent_path, name, i, &mi );
+		if ( type == IFDIR )
+		    walk_dir ( i, ent_path );
+	    }
+	}
+
+	printf ( "Recovered %d orphaned inodes\n", count );
+}
+
+/* Start at the root and this should recurse through the entire filesystem
+ */
+void
+walk_it ( char *path )
+{
+    struct stat st;
+    struct mem_inode root;
+
+    free ( visited );
+    visited = calloc ( BIT_WORD(num_inodes) + 1, sizeof(u_int) );
+    if ( ! visited )
+	error ( "out of memory" );
+
+    if ( recover ) {
+	free ( reached );
+	reached = calloc ( num_inodes + 1, 1 );
+	if ( ! reached )
+	    error ( "out of memory" );
+	reached[ROOT_INO] = 1;
+    }
+
+    if ( tar_fd >= 0 ) {
+	get_inode ( &root, ROOT_INO, path, 0 );
+	tar_dir ( path, &root );
+	walk_dir ( ROOT_INO, path );
+	if ( recover )
+	    recover_orphans ( path );
+	tar_close ();
+	manifest_write ();
+	printf ( "Biggest file: %d  %s\n", biggest_size, biggest_path );
+	return;
+    }
+
+    if ( stat ( path, &st ) || ! S_ISDIR ( st.st_mode ) ) {
+	printf ( "cannot enter: %s\n", path );
+	error ( "Cannot enter directory" );
+    }
+
+    if ( update )
+	manifest_read ();
+
+    copy_start ();
+    walk_dir ( ROOT_INO, path );
+    if ( recover )
+	recover_orphans ( path );
+    copy_finish ();
+    link_finish ();
+    dir_set_times ();
+    manifest_write ();
+    if ( update ) {
+	manifest_free ();
+	printf ( "Unchanged: %d files\n", num_unchanged );
+    }
+
+    printf ( "Biggest file: %d  %s\n", biggest_size, biggest_path );
+}
+
+static void
+encode_time ( char *str, xtime_t tt )
+{
+    // time_t current_time;
+    struct tm * time_info;
+    // char timeString[9];  // space for "HH:MM:SS\0"
+    time_t big_time;
+
+    // time(&current_time);
+    // time_info = localtime(&current_time);
+
+    big_time = tt;
+    time_info = localtime(&big_time);
+
+    // strftime(timeString, sizeof(timeString), "%H:%M:%S", time_info);
+    strftime ( str, 32, "%x %H:%M:%S", time_info);
+    // puts(timeString);
+}
+
+void
+read_super ( void )
+{
+    int tmp;
+    char time_str[32];
+
+    // block 0 was called the "boot block".
+    // This was not used on the Callan, and I find
+    // it filled with 0x55.
+    // block 1 holds the super block
+    // disk_read ( buf, 0 );
+
+    memcpy ( &sb, disk_block ( 1 ), BSIZE );
+
+    sfix ( &sb.isize );
+    ifix ( &sb.fsize );
+    sfix ( &sb.nfree );
+    sfix ( &sb.ninode );
+    ifix ( &sb.time );
+    ifix ( &sb.tfree );
+    sfix ( &sb.tinode );
+    encode_time ( time_str, sb.time );
+
+    if ( sb.isize <= INODE_OFFSET || sb.isize >= size )
+	error ( "super block isize makes no sense" );
+    num_inodes = (sb.isize - INODE_OFFSET) * INODES_PER_BLOCK;
+
+    if ( ! verbose )
+	return;
+
+    printf ( "\n" );
+    printf ( "Filesystem isize: %d\n", sb.isize );	/* in blocks */
+    printf ( "Filesystem size: %d\n", sb.fsize );
+    printf ( "Filesystem nfree: %d\n", sb.nfree );
+    printf ( "Filesystem ninode: %d\n", sb.ninode );
+    printf ( "Filesystem time: %d %s\n", sb.time, time_str );
+    printf ( "Filesystem free: %d blocks, %d inodes\n", sb.tfree, sb.tinode );
+    printf ( "\n" );
+    printf ( "Filesystem inode size: %d\n", sizeof(struct dinode) );
+}
+
+
+/* ------------------------------------------------------- */
+/* Looking at single files without extracting everything */
+
+/* A cache of directory lookups, (parent inode, name) -> inode.
+ * When we have to scan a directory, every entry in it goes in,
+ * along with an entry with an empty name saying the directory is
+ * all there (so a miss after that means there is no such file).
+ */
+#define DCACHE_HASH	512
+
+struct dentry {
+	struct dentry *next;
+	int parent;
+	int inode;
+	char name[DIRSIZ+1];
+};
+
+static struct dentry *dcache[DCACHE_HASH];
+
+static int
+dcache_hash ( int parent, char *name )
+{
+	u_int h;
+
+	h = parent;
+	while ( *name )
+	    h = h * 31 + (u_char) *name++;
+	return h % DCACHE_HASH;
+}
+
+static struct dentry *
+dcache_find ( int parent, char *name )
+{
+	struct dentry *dp;
+
+	for ( dp = dcache[dcache_hash ( parent, name )]; dp; dp = dp->next )
+	    if ( dp->parent == parent && strcmp ( dp->name, name ) == 0 )
+		return dp;
+	return NULL;
+}
+
+static void
+dcache_add ( int parent, char *name, int inode )
+{
+	struct dentry *dp;
+	int h;
+
+	if ( dcache_find ( parent, name ) )
+	    return;
+
+	dp = malloc ( sizeof(struct dentry) );
+	if ( ! dp )
+	    error ( "out of memory for the name cache" );
+	dp->parent = parent;
+	dp->inode = inode;
+	strcpy ( dp->name, name );
+
+	h = dcache_hash ( parent, name );
+	dp->next = dcache[h];
+	dcache[h] = dp;
+}
+
+void
+dcache_clear ( void )
 {
-    int type;
-    int dev;
-    int major, minor;
-    int i;
+	struct dentry *dp;
+	int h;
 
-    type = '?';
-    if ( ip->mode & IFCHR )
-	type = 'c';
-    if ( ip->mode & IFBLK )
-	type = 'b';
+	for ( h=0; h<DCACHE_HASH; h++ ) {
+	    while ( dp = dcache[h] ) {
+		dcache[h] = dp->next;
+		free ( dp );
+	    }
+	}
+}
+
+/* Look up one name in a directory, returns 0 if not there */
+int
+dir_lookup ( int dir, char *name )
+{
+	struct mem_inode mi;
+	struct dir_iter iter;
+	struct mem_direct *dirp;
+	struct dentry *dp;
+
+	if ( dp = dcache_find ( dir, name ) )
+	    return dp->inode;
+	if ( dcache_find ( dir, "" ) )
+	    return 0;
+
+	get_inode ( &mi, dir, NULL, 0 );
+	if ( (mi.mode & IFMT) != IFDIR )
+	    return 0;
+
+	dir_open ( &iter, &mi );
+	while ( dirp = dir_next ( &iter ) )
+	    if ( dirp->inode && dirp->name[0] )
+		dcache_add ( dir, dirp->name, dirp->inode );
+	dcache_add ( dir, "", dir );
+
+	if ( dp = dcache_find ( dir, name ) )
+	    return dp->inode;
+	return 0;
+}
+
+/* Turn a path into an inode number, one component at a time.
+ * Like the real unix, names longer than 14 characters
+ * are cut down to 14.  Returns 0 if there is no such thing.
+ */
+int
+namei ( char *path )
+{
+	char name[DIRSIZ+1];
+	int inode;
+	int n;
+
+	inode = ROOT_INO;
+	for ( ;; ) {
+	    while ( *path == '/' )
+		path++;
+	    if ( ! *path )
+		return inode;
+
+	    for ( n=0; *path && *path != '/'; path++ )
+		if ( n < DIRSIZ )
+		    name[n++] = *path;
+	    name[n] = '\0';
+
+	    inode = dir_lookup ( inode, name );
+	    if ( ! inode )
+		return 0;
+	}
+}
+
+/* The usr partition is mounted on /usr, so if nobody told us
+ * which partition to use, a path under /usr means partition b.
+ * The path is moved past the /usr.
+ */
+static int
+path_part ( char **pathp, int part )
+{
+	char *path = *pathp;
+
+	if ( part >= 0 )
+	    return part;
+	if ( num_parts > 1 && strncmp ( path, "/usr", 4 ) == 0 &&
+		(path[4] == '/' || ! path[4]) ) {
+	    *pathp = path + 4;
+	    return 1;
+	}
+	return 0;
+}
+
+/* Returns the path within the partition */
+static int cur_part = -1;
+
+static char *
+cmd_part ( char *path, int part )
+{
+	struct partition *pp;
+	int want;
+
+	want = path_part ( &path, part );
+	if ( want != cur_part ) {
+	    pp = &parts[want];
+	    open_fs ( pp->offset, pp->size, pp->limit );
+	    cur_part = want;
+	}
+
+	return path;
+}
+
+static void
+mode_string ( char *buf, int mode )
+{
+	static char *rwx = "rwxrwxrwx";
+	int i;
+
+	switch ( mode & IFMT ) {
+	    case IFDIR: buf[0] = 'd'; break;
+	    case IFCHR: buf[0] = 'c'; break;
+	    case IFBLK: buf[0] = 'b'; break;
+	    case IFMPC:
+	    case IFMPB: buf[0] = 'm'; break;
+	    default: buf[0] = '-'; break;
+	}
+
+	for ( i=0; i<9; i++ )
+	    buf[i+1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+
+	if ( mode & ISUID )
+	    buf[3] = (mode & IEXEC) ? 's' : 'S';
+	if ( mode & ISGID )
+	    buf[6] = (mode & (IEXEC>>3)) ? 's' : 'S';
+	if ( mode & ISVTX )
+	    buf[9] = (mode & (IEXEC>>6)) ? 't' : 'T';
+	buf[10] = '\0';
+}
+
+static void
+ls_one ( int inode, char *name, int lflag )
+{
+	struct mem_inode mi;
+	char mode[12];
+	char date[32];
+	struct tm *tm;
+	time_t t;
+	int type;
+
+	if ( ! lflag ) {
+	    printf ( "%s\n", name );
+	    return;
+	}
+
+	get_inode ( &mi, inode, NULL, 0 );
+	mode_string ( mode, mi.mode );
+	t = mi.mtime;
+	tm = localtime ( &t );
+	strftime ( date, sizeof(date), "%b %e %H:%M %Y", tm );
+
+	type = mi.mode & IFMT;
+	if ( type == IFCHR || type == IFBLK || type == IFMPC || type == IFMPB )
+	    printf ( "%s %2d %3d %3d %4d,%3d %s %s\n", mode, mi.nlink, mi.uid, mi.gid,
+		(mi.addr[0] >> 8) & 0xff, mi.addr[0] & 0xff, date, name );
+	else
+	    printf ( "%s %2d %3d %3d %8d %s %s\n", mode, mi.nlink, mi.uid, mi.gid,
+		mi.size, date, name );
+}
+
+static int
+ls_compare ( const void *a, const void *b )
+{
+	return strcmp ( ((struct mem_direct *) a)->name, ((struct mem_direct *) b)->name );
+}
+
+/* path is within the partition, show is what the user gave us */
+static int
+cmd_ls ( char *path, char *show, int lflag, int aflag )
+{
+	struct mem_inode mi;
+	struct dir_iter iter;
+	struct mem_direct *dirp;
+	struct mem_direct *list;
+	int inode;
+	int n;
+	int i;
+
+	inode = namei ( path );
+	if ( ! inode ) {
+	    fprintf ( stderr, "%s: not found\n", show );
+	    return 1;
+	}
+
+	get_inode ( &mi, inode, NULL, 0 );
+	if ( (mi.mode & IFMT) != IFDIR ) {
+	    ls_one ( inode, show, lflag );
+	    return 0;
+	}
+
+	list = malloc ( (mi.size / sizeof(struct direct) + 1) * sizeof(struct mem_direct) );
+	if ( ! list )
+	    error ( "out of memory for ls" );
+
+	n = 0;
+	dir_open ( &iter, &mi );
+	while ( dirp = dir_next ( &iter ) ) {
+	    if ( ! dirp->inode )
+		continue;
+	    if ( dirp->name[0] == '.' && ! aflag )
+		continue;
+	    list[n++] = *dirp;
+	}
+
+	qsort ( list, n, sizeof(struct mem_direct), ls_compare );
+	for ( i=0; i<n; i++ )
+	    ls_one ( list[i].inode, list[i].name, lflag );
+
+	free ( list );
+	return 0;
+}
+
+static int
+cmd_cat ( char *path, char *show )
+{
+	struct mem_inode mi;
+	int inode;
+
+	inode = namei ( path );
+	if ( ! inode ) {
+	    fprintf ( stderr, "%s: not found\n", show );
+	    return 1;
+	}
+
+	get_inode ( &mi, inode, NULL, 0 );
+	if ( (mi.mode & IFMT) != IFREG ) {
+	    fprintf ( stderr, "%s: not a regular file\n", show );
+	    return 1;
+	}
+
+	fflush ( stdout );
+	copy_data ( 1, &mi );
+	return 0;
+}
+
+/* ------------------------------------------------------- */
+/* Checking a filesystem, in the spirit of fsck (but read only).
+ *
+ * Pass 1 goes through every inode, marking the blocks it owns
+ *  (indirect blocks too) in a bitmap, and counting references
+ *  to inodes from every directory.  The inodes are split into
+ *  ranges, one per thread, and the bitmap is updated atomically.
+ * Then the free list and inode free cache in the superblock are
+ *  checked against that, and the link counts against the references.
+ */
+static u_int *chk_owned;	/* bitmap of blocks in use */
+static u_int *chk_free;		/* bitmap of blocks on the free list */
+static int *chk_refs;		/* directory entries for each inode */
+static int chk_problems;
+static int chk_blocks;
+
+static void
+chk_problem ( void )
+{
+	__atomic_fetch_add ( &chk_problems, 1, __ATOMIC_RELAXED );
+}
+
+/* Mark a block as belonging to an inode.
+ * Returns 0 if we should not look inside it.
+ */
+static int
+chk_claim ( u_int block, int inode )
+{
+	u_int old;
+
+	if ( block < sb.isize || block >= sb.fsize ) {
+	    printf ( "BAD BLOCK NUMBER: %u in inode %d\n", block, inode );
+	    chk_problem ();
+	    return 0;
+	}
+
+	if ( block >= (u_int) limit ) {
+	    printf ( "BAD BLOCK: %u in inode %d (past the good cylinders)\n", block, inode );
+	    chk_problem ();
+	}
+
+	old = __atomic_fetch_or ( &chk_owned[BIT_WORD(block)], BIT_MASK(block), __ATOMIC_RELAXED );
+	if ( old & BIT_MASK(block) ) {
+	    printf ( "DUP BLOCK: %u in inode %d\n", block, inode );
+	    chk_problem ();
+	    return 0;
+	}
+
+	__atomic_fetch_add ( &chk_blocks, 1, __ATOMIC_RELAXED );
+	return 1;
+}
+
+static void
+chk_indir ( u_int block, int level, int inode )
+{
+	u_int buf[NINDIR];
+	int i;
+
+	if ( ! chk_claim ( block, inode ) )
+	    return;
+
+	fix_addr_block ( buf, disk_block ( block ) );
+	for ( i=0; i<NINDIR; i++ ) {
+	    if ( ! buf[i] )
+		continue;
+	    if ( level > 1 )
+		chk_indir ( buf[i], level-1, inode );
+	    else
+		chk_claim ( buf[i], inode );
+	}
+}
+
+static void
+chk_inode ( int inode )
+{
+	struct core_inode *cp;
+	struct mem_inode mi;
+	struct dir_iter iter;
+	struct mem_direct *dirp;
+	int type;
+	int i;
+
+	cp = &itable[inode];
+	type = cp->mode & IFMT;
+	if ( type != IFDIR && type != IFREG )
+	    return;
+
+	for ( i=0; i<NDADDR; i++ )
+	    if ( cp->addr[i] )
+		chk_claim ( cp->addr[i], inode );
+	for ( i=0; i<3; i++ )
+	    if ( cp->addr[NDADDR+i] )
+		chk_indir ( cp->addr[NDADDR+i], i+1, inode );
+
+	if ( type != IFDIR )
+	    return;
+
+	get_inode ( &mi, inode, NULL, 0 );
+	dir_open ( &iter, &mi );
+	while ( dirp = dir_next ( &iter ) ) {
+	    if ( ! dirp->inode )
+		continue;
+	    if ( dirp->inode > num_inodes ) {
+		printf ( "BAD INODE NUMBER: %d for %s in directory inode %d\n",
+		    dirp->inode, dirp->name, inode );
+		chk_problem ();
+		continue;
+	    }
+	    if ( ! itable[dirp->inode].mode ) {
+		printf ( "UNALLOCATED: %s in directory inode %d is free inode %d\n",
+		    dirp->name, inode, dirp->inode );
+		chk_problem ();
+	    }
+	    __atomic_fetch_add ( &chk_refs[dirp->inode], 1, __ATOMIC_RELAXED );
+	}
+}
+
+struct chk_range {
+	pthread_t thread;
+	int first;
+	int last;
+};
+
+static void *
+chk_thread ( void *arg )
+{
+	struct chk_range *rp = arg;
+	int i;
+
+	for ( i = rp->first; i <= rp->last; i++ )
+	    chk_inode ( i );
+	return NULL;
+}
+
+/* The free list: sb.free[] holds nfree blocks, and free[0] is
+ * a block holding the next batch (a count, then 50 addresses).
+ * read_super leaves sb.free[] big endian.
+ */
+static int
+chk_free_list ( void )
+{
+	u_int list[NICFREE];
+	const u_int *ip;
+	u_int block;
+	int nfree;
+	int count;
+	int i;
+
+	nfree = sb.nfree;
+	for ( i=0; i<NICFREE; i++ )
+	    list[i] = f_ifix ( sb.free[i] );
+
+	count = 0;
+	for ( ;; ) {
+	    if ( nfree > NICFREE ) {
+		printf ( "BAD FREE LIST: count %d\n", nfree );
+		chk_problem ();
+		break;
+	    }
+	    for ( i=0; i<nfree; i++ ) {
+		block = list[i];
+		if ( ! block )
+		    continue;
+		if ( block < sb.isize || block >= sb.fsize ) {
+		    printf ( "BAD FREE BLOCK: %u\n", block );
+		    chk_problem ();
+		    continue;
+		}
+		if ( chk_free[BIT_WORD(block)] & BIT_MASK(block) ) {
+		    printf ( "DUP FREE BLOCK: %u (giving up on the free list)\n", block );
+		    chk_problem ();
+		    return count;
+		}
+		chk_free[BIT_WORD(block)] |= BIT_MASK(block);
+		count++;
+		if ( chk_owned[BIT_WORD(block)] & BIT_MASK(block) ) {
+		    printf ( "FREE BLOCK IN USE: %u\n", block );
+		    chk_problem ();
+		}
+	    }
+
+	    block = list[0];
+	    if ( ! nfree || ! block || block < sb.isize || block >= sb.fsize )
+		break;
+
+	    ip = (const u_int *) disk_block ( block );
+	    nfree = f_ifix ( ip[0] );
+	    for ( i=0; i<NICFREE; i++ )
+		list[i] = f_ifix ( ip[i+1] );
+	}
+
+	return count;
+}
+
+int
+check_fs ( int part )
+{
+	struct partition *pp = &parts[part];
+	struct chk_range range[MAX_COPIERS];
+	struct core_inode *cp;
+	int nthreads;
+	int nfree;
+	int ino;
+	int missing;
+	int used;
+	int per;
+	int i;
+
+	open_fs ( pp->offset, pp->size, pp->limit );
+	load_inodes ();
+
+	chk_owned = calloc ( sb.fsize / 32 + 1, sizeof(u_int) );
+	chk_free = calloc ( sb.fsize / 32 + 1, sizeof(u_int) );
+	chk_refs = calloc ( num_inodes + 1, sizeof(int) );
+	if ( ! chk_owned || ! chk_free || ! chk_refs )
+	    error ( "out of memory for check" );
+	chk_problems = 0;
+	chk_blocks = 0;
+
+	printf ( "Checking partition %c (%d blocks, %d inodes)\n",
+	    'a' + part, sb.fsize, num_inodes );
+
+	/* Pass 1, the inodes, split across threads */
+	nthreads = num_copiers;
+	if ( nthreads < 1 )
+	    nthreads = 1;
+	if ( nthreads > MAX_COPIERS )
+	    nthreads = MAX_COPIERS;
+	per = (num_inodes + nthreads - 1) / nthreads;
+
+	for ( i=0; i<nthreads; i++ ) {
+	    range[i].first = 1 + i * per;
+	    range[i].last = (i+1) * per;
+	    if ( range[i].last > num_inodes )
+		range[i].last = num_inodes;
+	    if ( pthread_create ( &range[i].thread, NULL, chk_thread, &range[i] ) )
+		error ( "cannot start check thread" );
+	}
+	for ( i=0; i<nthreads; i++ )
+	    pthread_join ( range[i].thread, NULL );
+
+	/* Pass 2, the free list, and blocks nobody has */
+	nfree = chk_free_list ();
+
+	missing = 0;
+	for ( i = sb.isize; i < sb.fsize; i++ ) {
+	    if ( (chk_owned[BIT_WORD(i)] | chk_free[BIT_WORD(i)]) & BIT_MASK(i) )
+		continue;
+	    if ( missing++ < 10 )
+		printf ( "MISSING BLOCK: %d (neither free nor in use)\n", i );
+	}
+	if ( missing ) {
+	    printf ( "%d blocks missing\n", missing );
+	    chk_problem ();
+	}
+
+	/* Pass 3, the inodes again: link counts, orphans, free cache.
+	 * Inode 1 is the bad block file, nobody refers to it.
+	 */
+	used = 0;
+	for ( i=2; i<=num_inodes; i++ ) {
+	    cp = &itable[i];
+	    if ( ! cp->mode )
+		continue;
+	    used++;
+	    if ( ! chk_refs[i] ) {
+		printf ( "ORPHAN INODE: %d (mode %o, size %d, nlink %d)\n",
+		    i, cp->mode, cp->size, cp->nlink );
+		chk_problem ();
+	    } else if ( chk_refs[i] != cp->nlink ) {
+		printf ( "LINK COUNT: inode %d has nlink %d, but %d references\n",
+		    i, cp->nlink, chk_refs[i] );
+		chk_problem ();
+	    }
+	}
+
+	for ( i=0; i<sb.ninode && i<NICINOD; i++ ) {
+	    ino = f_sfix ( sb.inode[i] );
+	    if ( ino < 1 || ino > num_inodes ) {
+		printf ( "BAD FREE INODE: %d\n", ino );
+		chk_problem ();
+	    } else if ( itable[ino].mode ) {
+		printf ( "FREE INODE IN USE: %d\n", ino );
+		chk_problem ();
+	    }
+	}
+
+	printf ( "Partition %c: %d inodes in use, %d blocks in use, %d free, %d problems\n",
+	    'a' + part, used, chk_blocks, nfree, chk_problems );
+
+	free ( chk_owned );
+	free ( chk_free );
+	free ( chk_refs );
+
+	return chk_problems ? 1 : 0;
+}
+
+static void
+frag_hist ( char *title, int *hist )
+{
+	int lo, hi;
+	int i;
+
+	printf ( "%s\n", title );
+	for ( i=0; i<FRAG_HIST; i++ ) {
+	    if ( ! hist[i] )
+		continue;
+	    lo = i ? (1 << (i-1)) + 1 : 1;
+	    hi = 1 << i;
+	    if ( i == FRAG_HIST - 1 )
+		printf ( "  %5d+     %6d\n", lo, hist[i] );
+	    else if ( lo == hi )
+		printf ( "  %5d      %6d\n", lo, hist[i] );
+	    else
+		printf ( "  %5d-%-5d%6d\n", lo, hi, hist[i] );
+	}
+}
+
+/* The whole report for one partition */
+int
+frag_fs ( int part )
+{
+	struct partition *pp = &parts[part];
+	struct frag_cost ideal;
+	u_int start;
+	int i;
+
+	open_fs ( pp->offset, pp->size, pp->limit );
+	load_inodes ();
+
+	free ( visited );
+	visited = calloc ( BIT_WORD(num_inodes) + 1, sizeof(u_int) );
+	if ( ! visited )
+	    error ( "out of memory" );
+
+	memset ( &frag_walk, 0, sizeof(frag_walk) );
+	memset ( frag_ext_hist, 0, sizeof(frag_ext_hist) );
+	memset ( frag_seek_hist, 0, sizeof(frag_seek_hist) );
+	frag_files = frag_dirs = frag_broken = 0;
+
+	printf ( "Partition %c, cylinders %d-%d (%d heads, %d sectors)\n", 'a' + part,
+	    pp->offset / CYL_BLOCKS, (pp->offset + sb.fsize - 1) / CYL_BLOCKS,
+	    HEADS, SECTORS );
+	printf ( "blocks  ext seeks  cyls  read ms  contig   path\n" );
+
+	frag_report = 1;
+	walk_dir ( ROOT_INO, "" );
+	frag_report = 0;
+
+	if ( ! frag_walk.blocks )
+	    return 0;
+
+	/* Everything end to end, in the order the walk read it */
+	memset ( &ideal, 0, sizeof(ideal) );
+	start = pp->offset + sb.isize;
+	for ( i=0; i<frag_walk.blocks; i++ )
+	    frag_add ( &ideal, start + i, NULL );
+
+	printf ( "%d files, %d directories, %d blocks in %d extents\n",
+	    frag_files, frag_dirs, frag_walk.blocks, frag_walk.extents );
+	printf ( "%d files are in more than one piece\n", frag_broken );
+	printf ( "Reading it all in walk order: %d seeks over %d cylinders, %.1f s\n",
+	    frag_walk.seeks, frag_walk.cyls, frag_walk.ms / 1000.0 );
+	printf ( "Laid out in that order instead: %d seeks, %.1f s (%.0f%% saved)\n",
+	    ideal.seeks, ideal.ms / 1000.0, 100.0 * (1.0 - ideal.ms / frag_walk.ms) );
+
+	frag_hist ( "Extents per file:", frag_ext_hist );
+	frag_hist ( "Seek distance (cylinders):", frag_seek_hist );
+	return 0;
+}
+
+int
+is_command ( char *name )
+{
+	return strcmp ( name, "cat" ) == 0 || strcmp ( name, "ls" ) == 0 ||
+	    strcmp ( name, "check" ) == 0 || strcmp ( name, "frag" ) == 0 ||
+	    strcmp ( name, "diff" ) == 0;
+}
+
+/* argv[0] is the command, the rest are its arguments.
+ * part is -1 if we should figure it out from each path.
+ */
+int
+run_command ( int argc, char **argv, int part )
+{
+	char *cmd = argv[0];
+	int lflag = 0;
+	int aflag = 0;
+	int rv = 0;
+	int npath = 0;
+	int i;
+	char *p;
+
+	/* check takes no paths, just the partition (or all of them) */
+	if ( strcmp ( cmd, "check" ) == 0 ) {
+	    for ( i=0; i<num_parts; i++ )
+		if ( part < 0 || part == i )
+		    rv |= check_fs ( i );
+	    cur_part = -1;
+	    return rv;
+	}
+
+	/* diff takes the other image */
+	if ( strcmp ( cmd, "diff" ) == 0 ) {
+	    if ( argc != 2 ) {
+		fprintf ( stderr, "diff wants one other image\n" );
+		return 2;
+	    }
+	    return diff_images ( argv[1], part );
+	}
+
+	/* So does frag, -l lists every file */
+	if ( strcmp ( cmd, "frag" ) == 0 ) {
+	    for ( i=1; i<argc; i++ )
+		if ( strcmp ( argv[i], "-l" ) == 0 )
+		    frag_list = 1;
+	    for ( i=0; i<num_parts; i++ )
+		if ( part < 0 || part == i )
+		    rv |= frag_fs ( i );
+	    cur_part = -1;
+	    return rv;
+	}
+
+	for ( i=1; i<argc; i++ ) {
+	    if ( argv[i][0] == '-' && strcmp ( cmd, "ls" ) == 0 ) {
+		for ( p = &argv[i][1]; *p; p++ ) {
+		    if ( *p == 'l' )
+			lflag = 1;
+		    else if ( *p == 'a' )
+			aflag = 1;
+		}
+		continue;
+	    }
+
+	    npath++;
+	    p = cmd_part ( argv[i], part );
+	    if ( strcmp ( cmd, "cat" ) == 0 )
+		rv |= cmd_cat ( p, argv[i] );
+	    else
+		rv |= cmd_ls ( p, argv[i], lflag, aflag );
+	}
 
-    if ( ip->bcount > 0 )
-	dev = ip->addr[0];
-    else
-	dev = 0;
+	/* ls with no path lists the top */
+	if ( strcmp ( cmd, "ls" ) == 0 && npath == 0 )
+	    rv |= cmd_ls ( cmd_part ( "/", part ), "/", lflag, aflag );
 
-    major = (dev >> 8)&0xff;
-    minor = dev & 0xff;
+	return rv;
+}
 
-    // printf ( "SPECIAL: mode %36s - %08x\n", path, ip->mode );
-    // printf ( "SPECIAL: addr %36s - bcount %d - %08x\n", path, ip->bcount, ip->addr[0] );
+/* ------------------------------------------------------- */
+/* Serving requests over a unix socket (see serve.h).
+ *
+ * Every partition is opened and its inodes decoded once, then
+ * kept: switching partitions just swaps the inode table, the
+ * superblock and the name cache in and out (diff uses this too,
+ * to go back and forth between two images).  The block cache
+ * (or the mapping) goes on from request to request as well,
+ * so a request costs a few lookups and no process start.
+ * One thread, requests are answered one at a time.
+ */
+#define SERVE_CLIENTS	32
+
+struct fs_state {
+	struct source *disk;
+	int offset;
+	int size;
+	int limit;
+	struct super sb;
+	struct core_inode *itable;
+	int num_inodes;
+	struct dentry *dcache[DCACHE_HASH];
+};
 
-    printf ( "SPECIAF: %36s %2d %2d\n", path, ip->uid, ip->gid );
-    printf ( "SPECIAL: %36s - mknod %c %2d %2d\n", path, type, major, minor );
+static struct fs_state serve_fs[MAX_PARTS];
 
-    // for ( i=0; i<ip->bcount; i++ )
-	//printf ( "SPECIAL: addr %36s - %2d %08x\n", path, i, ip->addr[i] );
-    // block_dump ( (u_char *) &ip->orig, sizeof(struct dinode) );
+static u_char *serve_buf;
+static int serve_len;
+static int serve_max;
+
+/* Take the current filesystem out of the globals */
+static void
+fs_save ( struct fs_state *fp )
+{
+	fp->disk = disk;
+	fp->offset = offset;
+	fp->size = size;
+	fp->limit = limit;
+	fp->sb = sb;
+	fp->itable = itable;
+	fp->num_inodes = num_inodes;
+	memcpy ( fp->dcache, dcache, sizeof(dcache) );
+	itable = NULL;
+	memset ( dcache, 0, sizeof(dcache) );
 }
 
-/* Global: statistics */
-int biggest_size = 0;
-char biggest_path[256];
+static void
+fs_load ( struct fs_state *fp )
+{
+	disk = fp->disk;
+	disk_offset ( fp->offset, fp->size, fp->limit );
+	sb = fp->sb;
+	itable = fp->itable;
+	num_inodes = fp->num_inodes;
+	memcpy ( dcache, fp->dcache, sizeof(dcache) );
+	indir_flush ();
+}
 
-void
-walk_dir ( int inode, char *path, char *lpath )
+static void
+serve_part ( int part )
 {
-    struct mem_inode cur_inode;
-    struct mem_inode entry_inode;
-    struct mem_direct m_dir;
-    int entry;
-    int code;
-    int s;
-    char ent_path[256];
+	if ( part == cur_part )
+	    return;
+	if ( cur_part >= 0 )
+	    fs_save ( &serve_fs[cur_part] );
+	fs_load ( &serve_fs[part] );
+	cur_part = part;
+}
+
+static void
+serve_put ( const void *data, int n )
+{
+	if ( serve_len + n > serve_max ) {
+	    serve_max = (serve_len + n) * 2;
+	    serve_buf = realloc ( serve_buf, serve_max );
+	    if ( ! serve_buf )
+		error ( "out of memory for a reply" );
+	}
+	memcpy ( &serve_buf[serve_len], data, n );
+	serve_len += n;
+}
 
-    // printf ( "Start walk for inode %d\n", inode );
+static void
+serve_fill ( struct serve_stat *sp, struct mem_inode *mp, char *name )
+{
+	int type;
+
+	memset ( sp, 0, sizeof(*sp) );
+	sp->inode = mp->number;
+	sp->part = cur_part;
+	sp->mode = mp->mode;
+	sp->nlink = mp->nlink;
+	sp->uid = mp->uid;
+	sp->gid = mp->gid;
+	sp->size = mp->size;
+	type = mp->mode & IFMT;
+	if ( type == IFCHR || type == IFBLK || type == IFMPC || type == IFMPB )
+	    sp->rdev = mp->addr[0] & 0xffff;
+	sp->atime = mp->atime;
+	sp->mtime = mp->mtime;
+	sp->ctime = mp->ctime;
+	if ( name )
+	    strncpy ( sp->name, name, DIRSIZ );
+}
 
-    enter_dir ( lpath );
+/* Find what a request is about, by inode or by path */
+static int
+serve_lookup ( struct serve_req *rp, char *path, struct mem_inode *mp )
+{
+	int part;
+	int inode;
 
-    // show_inode ( inode );
+	if ( rp->part >= num_parts || (rp->inode && rp->part < 0) )
+	    return EINVAL;
 
-    // get_inode ( &cur_inode, inode, path, 1 );
-    get_inode ( &cur_inode, inode, path, 0 );
+	part = path_part ( &path, rp->part );
+	serve_part ( part );
 
-    if ( (cur_inode.mode & IFMT) != IFDIR )
-	error ( "oops - not a directory" );
+	inode = rp->inode ? rp->inode : namei ( path );
+	if ( inode < 1 || inode > num_inodes )
+	    return ENOENT;
+	get_inode ( mp, inode, NULL, 0 );
+	return 0;
+}
 
-    /* First pass,
-     * - list full contents
-     * - process "leaf" nodes, making files and directories
-     */
-    for ( entry = 0; get_dir_entry ( &m_dir, &cur_inode, entry ); entry++ ) {
-	if ( ! m_dir.inode )
-	    continue;
+static int
+serve_readdir ( struct mem_inode *mp )
+{
+	struct mem_inode ei;
+	struct dir_iter iter;
+	struct mem_direct *dirp;
+	struct serve_stat st;
 
-	strcpy ( ent_path, path );
-	strcat ( ent_path, "/" );
-	strcat ( ent_path, m_dir.name );
+	if ( (mp->mode & IFMT) != IFDIR )
+	    return ENOTDIR;
 
-	if ( strcmp ( m_dir.name, "." ) == 0 )
-	    continue;
-	if ( strcmp ( m_dir.name, ".." ) == 0 )
+	dir_open ( &iter, mp );
+	while ( dirp = dir_next ( &iter ) ) {
+	    if ( dirp->inode < 1 || dirp->inode > num_inodes )
 		continue;
+	    get_inode ( &ei, dirp->inode, NULL, 0 );
+	    serve_fill ( &st, &ei, dirp->name );
+	    serve_put ( &st, sizeof(st) );
+	}
+	return 0;
+}
 
-	// printf ( "Fetch inode %d for %s\n", m_dir.inode, m_dir.name );
-	// show_inode ( m_dir.inode );
-	get_inode ( &entry_inode, m_dir.inode, ent_path, 0 );
+static int
+serve_read ( struct mem_inode *mp, u_int off, u_int count )
+{
+	u_char *buf;
+	u_int block;
+	int boff;
+	int len;
+
+	if ( (mp->mode & IFMT) == IFDIR )
+	    return EISDIR;
+	if ( (mp->mode & IFMT) != IFREG )
+	    return EINVAL;
+	if ( off >= mp->size )
+	    return 0;
+
+	if ( count > SERVE_MAX_READ )
+	    count = SERVE_MAX_READ;
+	if ( count > mp->size - off )
+	    count = mp->size - off;
+
+	serve_len = count;
+	if ( serve_len > serve_max ) {
+	    serve_max = serve_len;
+	    serve_buf = realloc ( serve_buf, serve_max );
+	    if ( ! serve_buf )
+		error ( "out of memory for a reply" );
+	}
 
-	// printf ( "mem inode mode = %08x\n", entry_inode.mode );
-	code = ((entry_inode.mode & IFMT) == IFDIR) ? 'D' : 'R';
+	buf = serve_buf;
+	while ( count > 0 ) {
+	    boff = off % BSIZE;
+	    len = BSIZE - boff;
+	    if ( len > count )
+		len = count;
+	    block = bmap ( mp, off / BSIZE );
+	    if ( block )
+		memcpy ( buf, disk_block ( block ) + boff, len );
+	    else
+		memset ( buf, 0, len );
+	    buf += len;
+	    off += len;
+	    count -= len;
+	}
+	return 0;
+}
 
-	printf ( "%5d %c (%d %d) %s\n", m_dir.inode, code,
-	    entry_inode.nlink, entry_inode.size, m_dir.name );
+/* Everything under a directory whose name matches the pattern,
+ * the paths start with the one we were given.
+ * A directory is never gone into twice.
+ */
+struct find_dir {
+	int inode;
+	char *path;
+};
 
-#ifdef notdef
-#define IFMT    0170000         /* type of file */
-#define         IFDIR   0040000 /* directory */
-#define         IFCHR   0020000 /* character special */
-#define         IFBLK   0060000 /* block special */
-#define         IFREG   0100000 /* regular */
-#define         IFMPC   0030000 /* multiplexed char special */
-#define         IFMPB   0070000 /* multiplexed block special */
-#define ISUID   04000           /* set user id on execution */
-#define ISGID   02000           /* set group id on execution */
-#define ISVTX   01000           /* save swapped text even after use */
-#define IREAD   0400            /* read, write, execute permissions */
-#define IWRITE  0200
-#define IEXEC   0100
-#endif
-	if ( (entry_inode.mode & IFMT) == IFDIR ) {
-	    /* make the directory */
-	    s = mkdir ( m_dir.name, 0774 );
-	    if ( s ) {
-		printf ( "cannot create: %s\n", ent_path );
-		error ( "cannot create directory" );
+static int
+serve_find ( struct mem_inode *mp, char *path, char *pattern )
+{
+	struct find_dir *stack;
+	struct find_dir top;
+	struct mem_inode ei;
+	struct dir_iter iter;
+	struct mem_direct *dirp;
+	u_int *seen;
+	char *sub;
+	int depth, max;
+
+	if ( (mp->mode & IFMT) != IFDIR )
+	    return ENOTDIR;
+
+	seen = calloc ( BIT_WORD(num_inodes) + 1, sizeof(u_int) );
+	max = 64;
+	stack = malloc ( max * sizeof(struct find_dir) );
+	if ( ! seen || ! stack )
+	    error ( "out of memory for find" );
+
+	seen[BIT_WORD(mp->number)] |= BIT_MASK(mp->number);
+	stack[0].inode = mp->number;
+	stack[0].path = strdup ( path );
+	depth = 1;
+
+	while ( depth > 0 ) {
+	    top = stack[--depth];
+	    get_inode ( &ei, top.inode, NULL, 0 );
+	    dir_open ( &iter, &ei );
+	    while ( dirp = dir_next ( &iter ) ) {
+		if ( dirp->inode < 1 || dirp->inode > num_inodes )
+		    continue;
+		if ( strcmp ( dirp->name, "." ) == 0 || strcmp ( dirp->name, ".." ) == 0 )
+		    continue;
+
+		sub = malloc ( strlen ( top.path ) + DIRSIZ + 2 );
+		if ( ! sub )
+		    error ( "out of memory for find" );
+		if ( top.path[0] && top.path[strlen(top.path)-1] == '/' )
+		    sprintf ( sub, "%s%s", top.path, dirp->name );
+		else
+		    sprintf ( sub, "%s/%s", top.path, dirp->name );
+
+		if ( fnmatch ( pattern, dirp->name, 0 ) == 0 )
+		    serve_put ( sub, strlen ( sub ) + 1 );
+
+		if ( (itable[dirp->inode].mode & IFMT) != IFDIR ||
+			(seen[BIT_WORD(dirp->inode)] & BIT_MASK(dirp->inode)) ) {
+		    free ( sub );
+		    continue;
+		}
+		seen[BIT_WORD(dirp->inode)] |= BIT_MASK(dirp->inode);
+		if ( depth == max ) {
+		    max *= 2;
+		    stack = realloc ( stack, max * sizeof(struct find_dir) );
+		    if ( ! stack )
+			error ( "out of memory for find" );
+		}
+		stack[depth].inode = dirp->inode;
+		stack[depth].path = sub;
+		depth++;
+	    }
+	    free ( top.path );
+	}
+
+	free ( stack );
+	free ( seen );
+	return 0;
+}
+
+static int
+read_all ( int fd, void *buf, int n )
+{
+	int s;
+
+	while ( n > 0 ) {
+	    s = read ( fd, buf, n );
+	    if ( s <= 0 )
+		return -1;
+	    buf = (char *) buf + s;
+	    n -= s;
+	}
+	return 0;
+}
+
+static int
+write_all ( int fd, const void *buf, int n )
+{
+	int s;
+
+	while ( n > 0 ) {
+	    s = write ( fd, buf, n );
+	    if ( s <= 0 )
+		return -1;
+	    buf = (const char *) buf + s;
+	    n -= s;
+	}
+	return 0;
+}
+
+/* Answer one request, -1 if the client is gone (or talking nonsense) */
+static int
+serve_request ( int fd )
+{
+	struct serve_req req;
+	struct serve_rep rep;
+	struct serve_stat st;
+	struct mem_inode mi;
+	char path[SERVE_MAX_PATH+1];
+	char *pattern;
+
+	if ( read_all ( fd, &req, sizeof(req) ) < 0 )
+	    return -1;
+	if ( req.len > SERVE_MAX_PATH || read_all ( fd, path, req.len ) < 0 )
+	    return -1;
+	path[req.len] = '\0';
+
+	pattern = path + strlen ( path );
+	if ( pattern < path + req.len )
+	    pattern++;
+
+	serve_len = 0;
+	rep.error = serve_lookup ( &req, path, &mi );
+	if ( ! rep.error ) {
+	    switch ( req.op ) {
+		case SERVE_STAT:
+		    serve_fill ( &st, &mi, NULL );
+		    serve_put ( &st, sizeof(st) );
+		    break;
+		case SERVE_READDIR:
+		    rep.error = serve_readdir ( &mi );
+		    break;
+		case SERVE_READ:
+		    rep.error = serve_read ( &mi, req.offset, req.count );
+		    break;
+		case SERVE_FIND:
+		    rep.error = serve_find ( &mi, path, *pattern ? pattern : "*" );
+		    break;
+		default:
+		    rep.error = EINVAL;
+		    break;
+	    }
+	}
+	if ( rep.error )
+	    serve_len = 0;
+	rep.len = serve_len;
+
+	if ( write_all ( fd, &rep, sizeof(rep) ) < 0 )
+	    return -1;
+	return write_all ( fd, serve_buf, serve_len );
+}
+
+int
+serve ( char *sock_path )
+{
+	struct sockaddr_un addr;
+	struct pollfd pfd[SERVE_CLIENTS+1];
+	struct partition *pp;
+	int nfd;
+	int lfd;
+	int fd;
+	int i;
+
+	for ( i=0; i<num_parts; i++ ) {
+	    pp = &parts[i];
+	    open_fs ( pp->offset, pp->size, pp->limit );
+	    load_inodes ();
+	    fs_save ( &serve_fs[i] );
+	}
+	cur_part = -1;
+
+	memset ( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	if ( strlen ( sock_path ) >= sizeof(addr.sun_path) )
+	    error ( "socket path is too long" );
+	strcpy ( addr.sun_path, sock_path );
+
+	/* Don't pull the socket out from under another server */
+	fd = socket ( AF_UNIX, SOCK_STREAM, 0 );
+	if ( fd >= 0 && connect ( fd, (struct sockaddr *) &addr, sizeof(addr) ) == 0 )
+	    error ( "something is already serving on that socket" );
+	close ( fd );
+	unlink ( sock_path );
+
+	lfd = socket ( AF_UNIX, SOCK_STREAM, 0 );
+	if ( lfd < 0 || bind ( lfd, (struct sockaddr *) &addr, sizeof(addr) ) < 0 )
+	    error ( "cannot make the socket" );
+	if ( listen ( lfd, 8 ) < 0 )
+	    error ( "cannot listen on the socket" );
+
+	/* A client that goes away mid reply is not our problem */
+	signal ( SIGPIPE, SIG_IGN );
+
+	printf ( "Serving %s (%s, %d partitions) on %s\n",
+	    disk_path, disk->kind, num_parts, sock_path );
+	fflush ( stdout );
+
+	pfd[0].fd = lfd;
+	pfd[0].events = POLLIN;
+	nfd = 1;
+
+	for ( ;; ) {
+	    if ( poll ( pfd, nfd, -1 ) < 0 ) {
+		if ( errno == EINTR )
+		    continue;
+		error ( "poll failed" );
 	    }
-	    if ( entry_inode.size > biggest_size ) {
-		biggest_size = entry_inode.size;
-		strcpy ( biggest_path, ent_path );
+
+	    for ( i = nfd-1; i > 0; i-- ) {
+		if ( ! pfd[i].revents )
+		    continue;
+		if ( (pfd[i].revents & POLLIN) && serve_request ( pfd[i].fd ) == 0 )
+		    continue;
+		close ( pfd[i].fd );
+		pfd[i] = pfd[--nfd];
 	    }
-	    // if ( entry_inode.nlink > 1 )
-		// printf ( "DLINK: %d %s\n", entry_inode.nlink, ent_path );
-	} else if ( (entry_inode.mode & IFMT) == IFREG ) {
-	    num_files++;
-	    /* regular file */
-	    // printf ( "COPY file: %s\n", ent_path );
-	    file_stuff ( ent_path, &entry_inode );
-	    copy_file ( &entry_inode, m_dir.name );
-
-	    if ( entry_inode.size > biggest_size ) {
-		biggest_size = entry_inode.size;
-		strcpy ( biggest_path, ent_path );
+
+	    if ( pfd[0].revents & POLLIN ) {
+		fd = accept ( lfd, NULL, NULL );
+		if ( fd >= 0 && nfd > SERVE_CLIENTS )
+		    close ( fd );
+		else if ( fd >= 0 ) {
+		    pfd[nfd].fd = fd;
+		    pfd[nfd].events = POLLIN;
+		    pfd[nfd].revents = 0;
+		    nfd++;
+		}
 	    }
-	    if ( entry_inode.nlink > 1 )
-		file_link ( entry_inode.nlink, m_dir.inode, ent_path );
-	} else {
-	    /* some kind of special file */
-	    // printf ( "SPECIAL: %s\n", ent_path );
-	    special ( ent_path, &entry_inode );
-	    if ( entry_inode.nlink > 1 )
-		printf ( "SLINK: %d %s\n", entry_inode.nlink, ent_path );
 	}
-    }
+}
+
+/* ------------------------------------------------------- */
+/* Comparing two images of the same disk, say one read over the
+ * serial line and one from the MFM decoder.
+ *
+ * Both trees are walked together, a directory at a time: the
+ * entries of the two are sorted and merged by name, giving what
+ * was added and removed, and what is in both gets its inode
+ * compared.  For a regular file of the same size with the same
+ * block list, the blocks are compared side by side and the ones
+ * that differ listed (with where they are on the disk, to read
+ * again).  Only when the block lists differ do we hash the two
+ * files to see if the contents are the same.  Each image is read
+ * once, nothing is extracted.
+ */
+#define DIFF_RUN	64	/* blocks compared at a time */
+#define DIFF_SHOW	20	/* differing blocks listed per file */
 
-    // printf ( "Start walk pass 2 for inode %d\n", inode );
+struct diff_frame {
+	int ia;
+	int ib;
+	char *path;
+};
 
-    /* Second pass, recurse into subdirectories.
-     * Avoid "." and ".."
-     */
-    for ( entry = 0; get_dir_entry ( &m_dir, &cur_inode, entry ); entry++ ) {
-	if ( ! m_dir.inode )
-	    continue;
+static struct fs_state diff_fs[2];
+static int diff_side;
+static int diff_added;
+static int diff_removed;
+static int diff_changed;
+static int diff_moved;
+static int diff_same;
 
-	strcpy ( ent_path, path );
-	strcat ( ent_path, "/" );
-	strcat ( ent_path, m_dir.name );
+static void
+diff_use ( int side )
+{
+	if ( side == diff_side )
+	    return;
+	fs_save ( &diff_fs[diff_side] );
+	fs_load ( &diff_fs[side] );
+	diff_side = side;
+}
 
-	if ( strcmp ( m_dir.name, "." ) == 0 )
-	    continue;
-	if ( strcmp ( m_dir.name, ".." ) == 0 )
-		continue;
+/* The entries of a directory (no . or ..) sorted by name */
+static struct mem_direct *
+diff_list ( int side, int inode, int *countp )
+{
+	struct mem_inode mi;
+	struct dir_iter iter;
+	struct mem_direct *dirp;
+	struct mem_direct *list;
+	int n;
 
-	// get_inode ( &entry_inode, m_dir.inode, NULL );
-	get_inode ( &entry_inode, m_dir.inode, ent_path, 0 );
+	diff_use ( side );
+	get_inode ( &mi, inode, NULL, 0 );
+	list = malloc ( (mi.size / sizeof(struct direct) + 1) * sizeof(struct mem_direct) );
+	if ( ! list )
+	    error ( "out of memory for diff" );
 
-	if ( (entry_inode.mode & IFMT) == IFDIR ) {
-	    // printf ( "Enter (pass2 for %s): %s\n", path, ent_path );
-	    walk_dir ( m_dir.inode, ent_path, m_dir.name );
-	    enter_dir ( ".." );
-	    // printf ( "Done (pass2 for %s): %s\n", path, ent_path );
+	n = 0;
+	dir_open ( &iter, &mi );
+	while ( dirp = dir_next ( &iter ) ) {
+	    if ( dirp->inode < 1 || dirp->inode > num_inodes )
+		continue;
+	    if ( strcmp ( dirp->name, "." ) == 0 || strcmp ( dirp->name, ".." ) == 0 )
+		continue;
+	    list[n++] = *dirp;
 	}
-    }
 
-    // printf ( "Walk done for inode %d\n", inode );
+	qsort ( list, n, sizeof(struct mem_direct), ls_compare );
+	*countp = n;
+	return list;
 }
 
-/* Start at the root and this should recurse through the entire filesystem
+static u_int *
+diff_blocks ( int side, struct mem_inode *mp )
+{
+	u_int *list;
+	int i;
+
+	diff_use ( side );
+	list = malloc ( (mp->bcount + 1) * sizeof(u_int) );
+	if ( ! list )
+	    error ( "out of memory for diff" );
+	for ( i=0; i<mp->bcount; i++ )
+	    list[i] = bmap ( mp, i );
+	return list;
+}
+
+/* Describe what differs in the inodes, returns how many things */
+static int
+diff_meta ( char *buf, struct mem_inode *ma, struct mem_inode *mb )
+{
+	int n = 0;
+
+	buf[0] = '\0';
+	if ( ma->mode != mb->mode )
+	    buf += sprintf ( buf, "%s mode %06o -> %06o", n++ ? "," : "", ma->mode, mb->mode );
+	if ( ma->nlink != mb->nlink )
+	    buf += sprintf ( buf, "%s links %d -> %d", n++ ? "," : "", ma->nlink, mb->nlink );
+	if ( ma->uid != mb->uid )
+	    buf += sprintf ( buf, "%s uid %d -> %d", n++ ? "," : "", ma->uid, mb->uid );
+	if ( ma->gid != mb->gid )
+	    buf += sprintf ( buf, "%s gid %d -> %d", n++ ? "," : "", ma->gid, mb->gid );
+	if ( ma->mtime != mb->mtime )
+	    buf += sprintf ( buf, "%s mtime %ld -> %ld", n++ ? "," : "", (long) ma->mtime, (long) mb->mtime );
+
+	/* A directory's size follows what is in it, we report that */
+	if ( (ma->mode & IFMT) == IFDIR )
+	    return n;
+
+	if ( ma->size != mb->size )
+	    buf += sprintf ( buf, "%s size %d -> %d", n++ ? "," : "", ma->size, mb->size );
+	if ( (ma->mode & IFMT) != IFREG && ma->addr[0] != mb->addr[0] )
+	    buf += sprintf ( buf, "%s device %d,%d -> %d,%d", n++ ? "," : "",
+		(ma->addr[0] >> 8) & 0xff, ma->addr[0] & 0xff,
+		(mb->addr[0] >> 8) & 0xff, mb->addr[0] & 0xff );
+	return n;
+}
+
+/* Same block list, so compare the blocks themselves.
+ * Returns how many differ, the first few are noted in bad.
  */
-void
-walk_it ( char *path )
+static int
+diff_data ( struct mem_inode *ma, u_int *list, u_int *bad )
+{
+	static u_char abuf[DIFF_RUN * BSIZE];
+	static u_char bbuf[DIFF_RUN * BSIZE];
+	int nbad = 0;
+	int run;
+	int len;
+	int i, j;
+
+	for ( i = 0; i < ma->bcount; i += run ) {
+	    run = ma->bcount - i < DIFF_RUN ? ma->bcount - i : DIFF_RUN;
+
+	    diff_use ( 0 );
+	    for ( j=0; j<run; j++ )
+		if ( list[i+j] )
+		    memcpy ( &abuf[j*BSIZE], disk_block ( list[i+j] ), BSIZE );
+	    diff_use ( 1 );
+	    for ( j=0; j<run; j++ )
+		if ( list[i+j] )
+		    memcpy ( &bbuf[j*BSIZE], disk_block ( list[i+j] ), BSIZE );
+
+	    for ( j=0; j<run; j++ ) {
+		if ( ! list[i+j] )
+		    continue;
+		len = ma->size - (i+j) * BSIZE;
+		if ( len > BSIZE )
+		    len = BSIZE;
+		if ( memcmp ( &abuf[j*BSIZE], &bbuf[j*BSIZE], len ) == 0 )
+		    continue;
+		if ( nbad < DIFF_SHOW )
+		    bad[nbad] = list[i+j];
+		nbad++;
+	    }
+	}
+	return nbad;
+}
+
+static void
+diff_file ( char *path, struct mem_inode *ma, struct mem_inode *mb )
 {
-    walk_dir ( ROOT_INO, path, path );
+	char what[256];
+	u_char hash_a[SHA256_LEN];
+	u_char hash_b[SHA256_LEN];
+	u_int bad[DIFF_SHOW];
+	u_int *la, *lb;
+	u_int abs;
+	int nbad = 0;
+	int moved = 0;
+	int same;
+	int i;
 
-    printf ( "Biggest file: %d  %s\n", biggest_size, biggest_path );
+	diff_meta ( what, ma, mb );
+
+	/* A different size is a different file, no need to look inside */
+	if ( (ma->mode & IFMT) == IFREG && (mb->mode & IFMT) == IFREG &&
+		ma->size == mb->size ) {
+	    la = diff_blocks ( 0, ma );
+	    lb = diff_blocks ( 1, mb );
+	    same = memcmp ( la, lb, ma->bcount * sizeof(u_int) ) == 0;
+	    if ( same )
+		nbad = diff_data ( ma, la, bad );
+	    else {
+		diff_use ( 0 );
+		hash_image ( ma, hash_a );
+		diff_use ( 1 );
+		hash_image ( mb, hash_b );
+		if ( memcmp ( hash_a, hash_b, SHA256_LEN ) == 0 )
+		    moved = 1;
+		else
+		    strcat ( what, what[0] ? ", contents" : " contents" );
+	    }
+	    free ( la );
+	    free ( lb );
+	}
+
+	if ( ! what[0] && ! nbad ) {
+	    if ( moved ) {
+		printf ( "Moved: %s (same contents, other blocks)\n", path );
+		diff_moved++;
+	    } else
+		diff_same++;
+	    return;
+	}
+
+	diff_changed++;
+	if ( nbad )
+	    printf ( "Changed: %s:%s%s %d block%s\n", path, what,
+		what[0] ? "," : "", nbad, nbad == 1 ? " differs" : "s differ" );
+	else
+	    printf ( "Changed: %s:%s\n", path, what );
+
+	for ( i=0; i<nbad && i<DIFF_SHOW; i++ ) {
+	    abs = diff_fs[0].offset + bad[i];
+	    printf ( "    block %u (cylinder %u head %u sector %u)\n", bad[i],
+		abs / CYL_BLOCKS, abs % CYL_BLOCKS / SECTORS, abs % SECTORS );
+	}
+	if ( nbad > DIFF_SHOW )
+	    printf ( "    and %d more\n", nbad - DIFF_SHOW );
+}
+
+static char *
+diff_path ( char *dir, char *name )
+{
+	char *path;
+
+	path = malloc ( strlen ( dir ) + DIRSIZ + 2 );
+	if ( ! path )
+	    error ( "out of memory for diff" );
+	sprintf ( path, "%s/%s", dir, name );
+	return path;
 }
 
+/* Walk one partition of each image, prefix goes on every path */
 static void
-encode_time ( char *str, xtime_t tt )
+diff_tree ( char *prefix )
 {
-    // time_t current_time;
-    struct tm * time_info;
-    // char timeString[9];  // space for "HH:MM:SS\0"
-    time_t big_time;
+	struct diff_frame *stack;
+	struct diff_frame *kids;
+	struct diff_frame top;
+	struct mem_direct *da, *db;
+	struct mem_inode ma, mb;
+	u_int *seen_a, *seen_b;
+	char *path;
+	int na, nb;
+	int depth, max;
+	int nkids;
+	int cmp;
+	int i, j;
+
+	seen_a = calloc ( BIT_WORD(diff_fs[0].num_inodes) + 1, sizeof(u_int) );
+	seen_b = calloc ( BIT_WORD(diff_fs[1].num_inodes) + 1, sizeof(u_int) );
+	max = 64;
+	stack = malloc ( max * sizeof(struct diff_frame) );
+	if ( ! seen_a || ! seen_b || ! stack )
+	    error ( "out of memory for diff" );
+
+	stack[0].ia = ROOT_INO;
+	stack[0].ib = ROOT_INO;
+	stack[0].path = strdup ( prefix );
+	depth = 1;
+
+	while ( depth > 0 ) {
+	    top = stack[--depth];
+	    seen_a[BIT_WORD(top.ia)] |= BIT_MASK(top.ia);
+	    seen_b[BIT_WORD(top.ib)] |= BIT_MASK(top.ib);
+
+	    da = diff_list ( 0, top.ia, &na );
+	    db = diff_list ( 1, top.ib, &nb );
+	    kids = malloc ( (na + 1) * sizeof(struct diff_frame) );
+	    if ( ! kids )
+		error ( "out of memory for diff" );
+	    nkids = 0;
+
+	    for ( i = 0, j = 0; i < na || j < nb; ) {
+		if ( i == na )
+		    cmp = 1;
+		else if ( j == nb )
+		    cmp = -1;
+		else
+		    cmp = strcmp ( da[i].name, db[j].name );
+
+		if ( cmp < 0 ) {
+		    path = diff_path ( top.path, da[i++].name );
+		    printf ( "Removed: %s\n", path );
+		    diff_removed++;
+		    free ( path );
+		    continue;
+		}
+		if ( cmp > 0 ) {
+		    path = diff_path ( top.path, db[j++].name );
+		    printf ( "Added: %s\n", path );
+		    diff_added++;
+		    free ( path );
+		    continue;
+		}
 
-    // time(&current_time);
-    // time_info = localtime(&current_time);
+		path = diff_path ( top.path, da[i].name );
+		diff_use ( 0 );
+		get_inode ( &ma, da[i].inode, NULL, 0 );
+		diff_use ( 1 );
+		get_inode ( &mb, db[j].inode, NULL, 0 );
+
+		if ( (ma.mode & IFMT) != IFDIR || (mb.mode & IFMT) != IFDIR ) {
+		    diff_file ( path, &ma, &mb );
+		    free ( path );
+		} else if ( (seen_a[BIT_WORD(ma.number)] & BIT_MASK(ma.number)) ||
+			(seen_b[BIT_WORD(mb.number)] & BIT_MASK(mb.number)) ) {
+		    printf ( "LOOP: %s, already compared\n", path );
+		    free ( path );
+		} else {
+		    diff_file ( path, &ma, &mb );
+		    kids[nkids].ia = ma.number;
+		    kids[nkids].ib = mb.number;
+		    kids[nkids].path = path;
+		    nkids++;
+		}
+		i++;
+		j++;
+	    }
 
-    big_time = tt;
-    time_info = localtime(&big_time);
+	    /* Backwards, so they come off the stack in order */
+	    while ( nkids > 0 ) {
+		if ( depth == max ) {
+		    max *= 2;
+		    stack = realloc ( stack, max * sizeof(struct diff_frame) );
+		    if ( ! stack )
+			error ( "out of memory for diff" );
+		}
+		stack[depth++] = kids[--nkids];
+	    }
 
-    // strftime(timeString, sizeof(timeString), "%H:%M:%S", time_info);
-    strftime ( str, 32, "%x %H:%M:%S", time_info);
-    // puts(timeString);
+	    free ( kids );
+	    free ( da );
+	    free ( db );
+	    free ( top.path );
+	}
+
+	free ( stack );
+	free ( seen_a );
+	free ( seen_b );
 }
 
-void
-read_super ( void )
+static void
+diff_part ( struct source *a, struct partition *pa, struct source *b, struct partition *pb, char *prefix )
 {
-    int tmp;
-    char time_str[32];
+	int side;
 
-    // block 0 was called the "boot block".
-    // This was not used on the Callan, and I find
-    // it filled with 0x55.
-    // block 1 holds the super block
-    // disk_read ( buf, 0 );
+	disk = a;
+	open_fs ( pa->offset, pa->size, pa->limit );
+	load_inodes ();
+	fs_save ( &diff_fs[0] );
 
-    disk_read ( (u_char *) &sb, 1 );
+	disk = b;
+	open_fs ( pb->offset, pb->size, pb->limit );
+	load_inodes ();
+	fs_save ( &diff_fs[1] );
 
-    sfix ( &sb.isize );
-    ifix ( &sb.fsize );
-    sfix ( &sb.nfree );
-    sfix ( &sb.ninode );
-    ifix ( &sb.time );
-    encode_time ( time_str, sb.time );
+	fs_load ( &diff_fs[0] );
+	diff_side = 0;
 
-    printf ( "\n" );
-    printf ( "Filesystem isize: %d\n", sb.isize );	/* in blocks */
-    printf ( "Filesystem size: %d\n", sb.fsize );
-    printf ( "Filesystem nfree: %d\n", sb.nfree );
-    printf ( "Filesystem ninode: %d\n", sb.ninode );
-    printf ( "Filesystem time: %d %s\n", sb.time, time_str );
-    printf ( "\n" );
-    printf ( "Filesystem inode size: %d\n", sizeof(struct dinode) );
+	diff_tree ( prefix );
+
+	fs_save ( &diff_fs[diff_side] );
+	for ( side = 0; side < 2; side++ )
+	    free ( diff_fs[side].itable );
+	disk = a;
+}
+
+/* The image we have open against another one, partition by
+ * partition (or just the one asked for).  Partition a is /,
+ * b is /usr, like the cat and ls commands.
+ */
+int
+diff_images ( char *path, int part )
+{
+	struct partition pa[MAX_PARTS];
+	struct partition pb[MAX_PARTS];
+	struct source *a, *b;
+	char prefix[32];
+	int na, nb;
+	int i;
+
+	a = disk;
+	memcpy ( pa, parts, sizeof(pa) );
+	na = num_parts;
+
+	b = source_open ( path, verbose );
+	disk = b;
+	find_parts ();
+	memcpy ( pb, parts, sizeof(pb) );
+	nb = num_parts;
+
+	if ( na != nb )
+	    printf ( "%s has %d partitions, %s has %d\n", disk_path, na, path, nb );
+
+	for ( i = 0; i < na && i < nb; i++ ) {
+	    if ( part >= 0 && part != i )
+		continue;
+	    if ( pa[i].offset != pb[i].offset || pa[i].size != pb[i].size )
+		printf ( "Partition %c: blocks %d-%d against %d-%d\n", 'a' + i,
+		    pa[i].offset, pa[i].offset + pa[i].size - 1,
+		    pb[i].offset, pb[i].offset + pb[i].size - 1 );
+	    if ( i == 0 )
+		prefix[0] = '\0';
+	    else if ( i == 1 )
+		strcpy ( prefix, "/usr" );
+	    else
+		sprintf ( prefix, "/%s", pa[i].dir );
+	    diff_part ( a, &pa[i], b, &pb[i], prefix );
+	}
+
+	disk = a;
+	memcpy ( parts, pa, sizeof(pa) );
+	num_parts = na;
+	source_close ( b );
+	itable = NULL;
+	cur_part = -1;
+
+	printf ( "Added: %d, removed: %d, changed: %d, moved: %d, same: %d\n",
+	    diff_added, diff_removed, diff_changed, diff_moved, diff_same );
+	return diff_added || diff_removed || diff_changed;
+}
+
+/* Is there a plausible V7 filesystem starting at this block?
+ * The superblock has no magic number, so we check that its
+ * numbers make sense and that inode 2 is a directory whose
+ * "." and ".." are both inode 2 (like any root directory).
+ * Returns the size of the filesystem, or 0.
+ */
+int
+probe_fs ( int off, int nblocks )
+{
+	const struct super *sp;
+	const struct dinode *dp;
+	const struct direct *ddp;
+	struct core_inode root;
+	struct mem_direct dot;
+	struct mem_direct dotdot;
+	u_int isize;
+	u_int fsize;
+
+	if ( off + INODE_OFFSET >= nblocks )
+	    return 0;
+
+	disk_offset ( off, nblocks - off, nblocks - off );
+
+	sp = (const struct super *) disk_block ( 1 );
+	isize = f_sfix ( sp->isize );
+	fsize = f_ifix ( sp->fsize );
+	if ( isize <= INODE_OFFSET || fsize <= isize || fsize > nblocks - off )
+	    return 0;
+	if ( f_sfix ( sp->nfree ) > NICFREE || f_sfix ( sp->ninode ) > NICINOD )
+	    return 0;
+
+	dp = (const struct dinode *) disk_block ( INODE_OFFSET );
+	decode_inode ( &root, &dp[ROOT_INO-1] );
+	if ( (root.mode & IFMT) != IFDIR )
+	    return 0;
+	if ( root.size < 2 * sizeof(struct direct) || root.size % sizeof(struct direct) )
+	    return 0;
+	if ( root.addr[0] < isize || root.addr[0] >= fsize )
+	    return 0;
+
+	ddp = (const struct direct *) disk_block ( root.addr[0] );
+	fix_direct ( &dot, &ddp[0] );
+	fix_direct ( &dotdot, &ddp[1] );
+	if ( dot.inode != ROOT_INO || strcmp ( dot.name, "." ) != 0 )
+	    return 0;
+	if ( dotdot.inode != ROOT_INO || strcmp ( dotdot.name, ".." ) != 0 )
+	    return 0;
+
+	return fsize;
+}
+
+/* Look at every cylinder boundary for a filesystem.
+ * When we find one, skip over it, there could be something
+ * that looks like a superblock inside it (a floppy image, say).
+ */
+void
+find_parts ( void )
+{
+	struct partition *pp;
+	int nblocks;
+	int fsize;
+	int good;
+	int cut;
+	int off;
+
+	nblocks = disk->size / BSIZE;
+	num_parts = 0;
+
+	good = good_cyls;
+	if ( good < 0 )
+	    good = nblocks == CALLAN_BLOCKS ? CALLAN_GOOD : 0;
+
+	for ( off = 0; off < nblocks && num_parts < MAX_PARTS; off += CYL_BLOCKS ) {
+	    fsize = probe_fs ( off, nblocks );
+	    if ( ! fsize )
+		continue;
+
+	    pp = &parts[num_parts];
+	    pp->offset = off;
+	    pp->size = fsize;
+	    pp->limit = fsize;
+	    cut = good * CYL_BLOCKS - off;
+	    if ( good && cut < fsize )
+		pp->limit = cut > 0 ? cut : 0;
+	    if ( num_parts == 0 )
+		strcpy ( pp->dir, "root" );
+	    else if ( num_parts == 1 )
+		strcpy ( pp->dir, "usr" );
+	    else
+		sprintf ( pp->dir, "part_%c", 'a' + num_parts );
+
+	    if ( verbose )
+		printf ( "Partition %c: blocks %d-%d, %d cylinders (%s)\n",
+		    'a' + num_parts, off, off + fsize - 1,
+		    (fsize + CYL_BLOCKS - 1) / CYL_BLOCKS, pp->dir );
+	    if ( verbose && pp->limit < fsize )
+		printf ( "  blocks from %d on are past cylinder %d, suspect\n", pp->limit, good - 1 );
+	    num_parts++;
+
+	    off += ((fsize + CYL_BLOCKS - 1) / CYL_BLOCKS - 1) * CYL_BLOCKS;
+	}
+
+	if ( num_parts == 0 )
+	    error ( "no filesystems found on the image" );
 }
 
+/* A partition letter, checked against what we found */
+int
+part_index ( char *name )
+{
+	int part;
+
+	part = name[0] - (name[0] >= 'a' ? 'a' : 'A');
+	if ( part < 0 || part >= num_parts || name[1] ) {
+	    fprintf ( stderr, "No partition %s (found %d)\n", name, num_parts );
+	    error ( "bad partition" );
+	}
+	return part;
+}
 
+/* Get ready to look at one of the filesystems.
+ * Nothing cached from another one can be used.
+ */
 void
-dump_fs ( char *start_path, int offset, int size, int limit )
+open_fs ( int offset, int size, int limit )
 {
     disk_offset ( offset, size, limit );
+    free ( itable );
+    itable = NULL;
+    indir_flush ();
+    dcache_clear ();
     read_super ();
+}
+
+void
+dump_fs ( char *start_path, int offset, int size, int limit )
+{
+    open_fs ( offset, size, limit );
+    load_inodes ();
 
     // printf ( "Start Filesystem **************************\n" );
     walk_it ( start_path );
@@ -1073,31 +4638,107 @@ dump_fs ( char *start_path, int offset, int size, int limit )
 int
 main ( int argc, char **argv )
 {
-    int first = 1;
+    char *part_name = NULL;
+    char *serve_path = NULL;
+    int part;
     char *p;
 
     argc--;
     argv++;
 
+    simd_init ();
+
     // printf ( "argc = %d\n", argc );
 
-    if ( argc > 0 ) {
+    /* A single letter picks the partition (same as -p),
+     * -g N says blocks past cylinder N-1 are suspect,
+     * -j N sets the number of copier threads,
+     * -m file writes a manifest with a hash of every file,
+     * -o file writes a tar archive instead ("-" for stdout),
+     * -p a|b|.. picks the partition,
+     * -r recovers orphaned inodes into lost+found,
+     * -u only rewrites files that changed since the -m manifest,
+     * --serve socket answers requests from ufs_query,
+     * a command (cat, ls) takes the rest of the arguments,
+     * anything else is the image ("-" for stdin)
+     */
+    for ( ; argc > 0; argc--, argv++ ) {
 	p = argv[0];
 	// printf ( "arg = %s\n", p );
-	if ( *p == 'b' || *p == 'B' )
-	    first = 0;
-    } else {
-	// printf ( "crazy\n" );
+	if ( is_command ( p ) ) {
+	    verbose = 0;
+	    disk_open ( disk_path );
+	    find_parts ();
+	    part = part_name ? part_index ( part_name ) : -1;
+	    return run_command ( argc, argv, part );
+	} else if ( strcmp ( p, "-p" ) == 0 && argc > 1 ) {
+	    argc--;
+	    argv++;
+	    part_name = argv[0];
+	} else if ( strcmp ( p, "-r" ) == 0 ) {
+	    recover = 1;
+	} else if ( strcmp ( p, "-u" ) == 0 ) {
+	    update = 1;
+	} else if ( strcmp ( p, "-g" ) == 0 && argc > 1 ) {
+	    argc--;
+	    argv++;
+	    good_cyls = atoi ( argv[0] );
+	} else if ( strcmp ( p, "-j" ) == 0 && argc > 1 ) {
+	    argc--;
+	    argv++;
+	    num_copiers = atoi ( argv[0] );
+	} else if ( strcmp ( p, "-m" ) == 0 && argc > 1 ) {
+	    argc--;
+	    argv++;
+	    manifest_path = argv[0];
+	} else if ( strcmp ( p, "-o" ) == 0 && argc > 1 ) {
+	    argc--;
+	    argv++;
+	    tar_path = argv[0];
+	} else if ( strcmp ( p, "--serve" ) == 0 && argc > 1 ) {
+	    argc--;
+	    argv++;
+	    serve_path = argv[0];
+	} else if ( p[0] && ! p[1] ) {
+	    if ( *p == '-' )
+		disk_path = p;
+	    else
+		part_name = p;
+	} else
+	    disk_path = p;
+    }
+
+    if ( serve_path ) {
+	verbose = 0;
+	disk_open ( disk_path );
+	find_parts ();
+	return serve ( serve_path );
+    }
+
+    /* When the archive goes to stdout, all the chatter
+     * we print goes to stderr instead.
+     */
+    if ( tar_path && strcmp ( tar_path, "-" ) == 0 ) {
+	tar_fd = dup ( 1 );
+	dup2 ( 2, 1 );
+    } else if ( tar_path ) {
+	tar_fd = open ( tar_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( tar_fd < 0 )
+	    error ( "cannot create tar file" );
+    }
+
+    if ( update && ! manifest_path )
+	error ( "-u needs a manifest (-m)" );
+    if ( update && tar_fd >= 0 ) {
+	printf ( "-u does nothing for a tar archive\n" );
+	update = 0;
     }
 
-    disk_fd = open ( disk_path, O_RDONLY );
-    if ( disk_fd < 0 )
-	error ( "could not open disk image" );
+    disk_open ( disk_path );
+    find_parts ();
 
-    if ( first )
-	dump_fs ( "root", OFFSET_A, SIZE_A, LIMIT_A );
-    else
-	dump_fs ( "usr", OFFSET_B, SIZE_B, LIMIT_B );
+    part = part_name ? part_index ( part_name ) : 0;
+    dump_fs ( parts[part].dir, parts[part].offset, parts[part].size, parts[part].limit );
 
     return 0;
 }